@@ -0,0 +1,465 @@
+// Benchmarks of write_gpt: in-process micro-benchmarks of the hot paths, then end-to-end builds
+//   of the write_gpt executable and request latency of its --serve mode. Results go to stdout
+//   as one JSON document, progress to stderr.
+//
+//   write_gpt_bench [--exe PATH] [--dir DIR] [--quick]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <config.h>
+#include <uefi_io.h>
+#include <uefi_gpt.h>
+#include <uefi_crc32.h>
+#include <uefi_fat32.h>
+#include <uefi_layout.h>
+
+enum {
+    CRC_BUFFER_SIZE = 1024 * 1024,
+    DIR_ENTRY_FILES = 10000,            // Files in the one directory of the directory entry benchmark
+    SERVE_CLIENTS = 8,                  // Concurrent connections to the build service
+    SERVE_REQUESTS = 200,               // Small ESP images built per connection
+};
+
+// Micro-benchmarks repeat until they ran at least this long
+static const double MIN_SECONDS = 0.5;
+
+static const char *exePath = "./write_gpt";
+static const char *workDir = "/tmp";
+static bool quick = false;
+static bool firstResult = true;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One object of the "benchmarks" array; fields is the JSON text after the name
+static void printResult(const char *name, const char *fields)
+{
+    printf("%s\n    { \"name\": \"%s\", %s }", firstResult ? "" : ",", name, fields);
+    firstResult = false;
+    fflush(stdout);
+    fprintf(stderr, "%s: %s\n", name, fields);
+}
+
+// Micro-benchmarks ----------------------
+
+static void benchCrc32(void)
+{
+    uint8_t *buf = malloc(CRC_BUFFER_SIZE);
+    if (!buf) return;
+    for (size_t i = 0; i < CRC_BUFFER_SIZE; i++) buf[i] = (uint8_t)(i * 2654435761u >> 24);
+
+    uint64_t iterations = 0;
+    volatile uint32_t sink = 0;
+    const double start = now();
+    double elapsed = 0;
+    while (elapsed < MIN_SECONDS) {
+        for (int i = 0; i < 64; i++) sink ^= calculateCRC32(buf, CRC_BUFFER_SIZE);
+        iterations += 64;
+        elapsed = now() - start;
+    }
+    free(buf);
+
+    char fields[256];
+    snprintf(fields, sizeof fields,
+             "\"engine\": \"%s\", \"iterations\": %llu, \"bytes\": %d, \"seconds\": %.6f, \"bytes_per_second\": %.0f",
+             crc32Engine(), (unsigned long long)iterations, CRC_BUFFER_SIZE, elapsed,
+             iterations * (double)CRC_BUFFER_SIZE / elapsed);
+    printResult("crc32", fields);
+}
+
+static void benchGuid(void)
+{
+    ImageContext ctx;
+    initImageContext(&ctx);
+
+    uint64_t iterations = 0;
+    volatile uint32_t sink = 0;
+    const double start = now();
+    double elapsed = 0;
+    while (elapsed < MIN_SECONDS) {
+        for (int i = 0; i < 65536; i++) sink ^= new_guid(&ctx).TimeLow;
+        iterations += 65536;
+        elapsed = now() - start;
+    }
+
+    char fields[256];
+    snprintf(fields, sizeof fields, "\"iterations\": %llu, \"seconds\": %.6f, \"ns_per_op\": %.2f",
+             (unsigned long long)iterations, elapsed, elapsed * 1e9 / iterations);
+    printResult("new_guid", fields);
+}
+
+// Lay out the default ESP + data pair and write only the ESP into path; returns seconds or -1
+static double buildEsp(const char *path, uint64_t size, uint64_t lba, char *dir)
+{
+    ImageContext ctx;
+    initImageContext(&ctx);
+    ctx.ImageName = path;
+    ctx.LbaSize = lba;
+    ctx.EspSize = size;
+    ctx.EspDir = dir;
+
+    GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES];
+    if (!planLayout(&ctx, table)) return -1;
+
+    const double start = now();
+    ImageIO *io = openImageIO(&ctx);
+    if (!io) return -1;
+    const bool ok = writeESP(&ctx, io);
+    const bool closed = closeImageIO(io);
+    const double elapsed = now() - start;
+
+    unlink(path);
+    return ok && closed ? elapsed : -1;
+}
+
+// FAT generation: an empty 1 GiB ESP is almost only its two FAT copies
+static void benchFat(const char *image)
+{
+    const uint64_t size = 1024ull * 1024 * 1024;
+
+    uint64_t iterations = 0;
+    double elapsed = 0;
+    while (elapsed < MIN_SECONDS) {
+        const double t = buildEsp(image, size, 512, NULL);
+        if (t < 0) return;
+        elapsed += t;
+        iterations++;
+    }
+
+    char fields[256];
+    snprintf(fields, sizeof fields,
+             "\"esp_bytes\": %llu, \"lba\": 512, \"iterations\": %llu, \"seconds\": %.6f, \"ms_per_op\": %.3f",
+             (unsigned long long)size, (unsigned long long)iterations, elapsed, elapsed * 1e3 / iterations);
+    printResult("fat_generation", fields);
+}
+
+// Directory entry writing: one directory of DIR_ENTRY_FILES empty files with long names
+static void benchDirEntries(const char *image)
+{
+    char dir[4096];
+    snprintf(dir, sizeof dir, "%s/write_gpt_bench.%d", workDir, (int)getpid());
+    if (mkdir(dir, 0755) != 0) {
+        fprintf(stderr, "Error: could not create directory %s\n", dir);
+        return;
+    }
+
+    char path[4200];
+    bool ok = true;
+    for (int i = 0; ok && i < DIR_ENTRY_FILES; i++) {
+        snprintf(path, sizeof path, "%s/Capsule-Update-%05d.efi", dir, i);
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = fd >= 0 && close(fd) == 0;
+    }
+
+    uint64_t iterations = 0;
+    double elapsed = 0;
+    while (ok && elapsed < MIN_SECONDS) {
+        const double t = buildEsp(image, 64ull * 1024 * 1024, 512, dir);
+        ok = t >= 0;
+        elapsed += t;
+        iterations++;
+    }
+
+    for (int i = 0; i < DIR_ENTRY_FILES; i++) {
+        snprintf(path, sizeof path, "%s/Capsule-Update-%05d.efi", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    if (!ok) return;
+
+    char fields[256];
+    snprintf(fields, sizeof fields,
+             "\"entries\": %d, \"iterations\": %llu, \"seconds\": %.6f, \"ns_per_entry\": %.1f",
+             DIR_ENTRY_FILES, (unsigned long long)iterations, elapsed,
+             elapsed * 1e9 / ((double)iterations * DIR_ENTRY_FILES));
+    printResult("dir_entries", fields);
+}
+
+// End-to-end builds ---------------------
+
+// Run write_gpt with args; wall time and peak RSS of the child, or -1
+static double runBuild(char *const argv[], long *peakRssKiB)
+{
+    const pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        const int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(exePath, argv);
+        _exit(127);
+    }
+
+    const double start = now();
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) return -1;
+    const double elapsed = now() - start;
+
+    *peakRssKiB = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+// Run write_gpt with args under ptrace and count the system calls of all its threads, or -1
+static long long countSyscalls(char *const argv[])
+{
+    const pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        const int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        execv(exePath, argv);
+        _exit(127);
+    }
+
+    // Stopped at exec: follow every thread, stop on each system call entry and exit
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    long long count = 0;
+    bool ok = false;
+    for (;;) {
+        const pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) break;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) {
+                ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                break;
+            }
+            continue;
+        }
+
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof info, &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY)
+                count++;
+        } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+            signal = WSTOPSIG(status);   // A real signal for the child, not a ptrace event
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)signal);
+    }
+
+    return ok ? count : -1;
+}
+
+static void benchBuild(const char *image, uint64_t espBytes, unsigned lba)
+{
+    char esp[32], lbaArg[16];
+    if (espBytes % (1ull << 30) == 0) snprintf(esp, sizeof esp, "%lluG", (unsigned long long)(espBytes >> 30));
+    else                              snprintf(esp, sizeof esp, "%lluM", (unsigned long long)(espBytes >> 20));
+    snprintf(lbaArg, sizeof lbaArg, "%u", lba);
+    char *const argv[] = {
+        (char *)exePath, "--image", (char *)image, "--lba", lbaArg, "--esp-size", esp, NULL,
+    };
+
+    long peak = 0;
+    const double elapsed = runBuild(argv, &peak);
+    unlink(image);
+    const long long syscalls = elapsed >= 0 ? countSyscalls(argv) : -1;
+    unlink(image);
+
+    char name[64];
+    snprintf(name, sizeof name, "build_esp_%s_lba_%u", esp, lba);
+    if (elapsed < 0 || syscalls < 0) {
+        fprintf(stderr, "Error: %s failed\n", name);
+        return;
+    }
+
+    char fields[256];
+    snprintf(fields, sizeof fields,
+             "\"esp_bytes\": %llu, \"lba\": %u, \"seconds\": %.6f, \"bytes_per_second\": %.0f, "
+             "\"syscalls\": %lld, \"peak_rss_kib\": %ld",
+             (unsigned long long)espBytes, lba, elapsed, espBytes / elapsed, syscalls, peak);
+    printResult(name, fields);
+}
+
+// Build service --------------------------
+
+typedef struct {
+
+    const char *Socket;
+    char        Image[4096 + 16];
+    double      Latency[SERVE_REQUESTS];    // Seconds from sending a request to its answer
+    size_t      Count;
+
+} ServeClient;
+
+static int connectSocket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (const struct sockaddr *)&addr, sizeof addr) == 0) return fd;
+
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+// One connection, one request at a time: send a manifest line, wait for its answer line
+static void *serveClient(void *arg)
+{
+    ServeClient *client = arg;
+    const int fd = connectSocket(client->Socket);
+    if (fd < 0) return NULL;
+
+    char request[4200], answer[4200];
+    const int len = snprintf(request, sizeof request, "image=%s sparse\n", client->Image);
+    for (size_t i = 0; i < SERVE_REQUESTS; i++) {
+        const double start = now();
+        if (write(fd, request, len) != len) break;
+
+        size_t got = 0;
+        while (got < sizeof answer && (got == 0 || answer[got - 1] != '\n')) {
+            const ssize_t n = read(fd, answer + got, sizeof answer - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got < 3 || strncmp(answer, "OK ", 3) != 0) break;
+
+        client->Latency[client->Count++] = now() - start;
+    }
+
+    close(fd);
+    unlink(client->Image);
+    return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Latency of default images built by a running --serve process under concurrent requests
+static void benchServe(const char *image)
+{
+    char socketPath[4096 + 16];
+    snprintf(socketPath, sizeof socketPath, "%s.sock", image);
+    unlink(socketPath);
+
+    char jobs[16];
+    snprintf(jobs, sizeof jobs, "%u", SERVE_CLIENTS);
+    char *const argv[] = { (char *)exePath, "--serve", socketPath, "--jobs", jobs, NULL };
+
+    const pid_t pid = fork();
+    if (pid < 0) return;
+    if (pid == 0) {
+        const int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(exePath, argv);
+        _exit(127);
+    }
+
+    // Wait for the service to listen, at most a few seconds
+    int probe = -1;
+    for (int i = 0; i < 500 && (probe = connectSocket(socketPath)) < 0; i++)
+        nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 10000000 }, NULL);
+    if (probe >= 0) close(probe);
+
+    static ServeClient clients[SERVE_CLIENTS];
+    pthread_t threads[SERVE_CLIENTS];
+    unsigned started = 0;
+    const double start = now();
+    for (; probe >= 0 && started < SERVE_CLIENTS; started++) {
+        clients[started] = (ServeClient){ .Socket = socketPath, .Count = 0 };
+        snprintf(clients[started].Image, sizeof clients[started].Image, "%s.serve%u", image, started);
+        if (pthread_create(&threads[started], NULL, serveClient, &clients[started]) != 0) break;
+    }
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    const double elapsed = now() - start;
+
+    kill(pid, SIGTERM);
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    static double latency[SERVE_CLIENTS * SERVE_REQUESTS];
+    size_t count = 0;
+    for (unsigned i = 0; i < started; i++)
+        for (size_t j = 0; j < clients[i].Count; j++) latency[count++] = clients[i].Latency[j];
+
+    if (count < (size_t)SERVE_CLIENTS * SERVE_REQUESTS) {
+        fprintf(stderr, "Error: serve_esp_33M failed after %zu requests\n", count);
+        return;
+    }
+    qsort(latency, count, sizeof *latency, compareDoubles);
+
+    char fields[256];
+    snprintf(fields, sizeof fields,
+             "\"clients\": %u, \"requests\": %zu, \"images_per_second\": %.0f, \"p50_ms\": %.3f, "
+             "\"p99_ms\": %.3f, \"max_ms\": %.3f",
+             SERVE_CLIENTS, count, count / elapsed, latency[count / 2] * 1e3, latency[count * 99 / 100] * 1e3,
+             latency[count - 1] * 1e3);
+    printResult("serve_esp_33M", fields);
+}
+
+// =============================
+// MAIN
+// =============================
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--exe") == 0 && i + 1 < argc)      exePath = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) workDir = argv[++i];
+        else if (strcmp(argv[i], "--quick") == 0)               quick = true;
+        else {
+            fprintf(stderr, "Usage: %s [--exe PATH] [--dir DIR] [--quick]\n"
+                            "  --exe PATH  write_gpt executable for the end-to-end builds (default: ./write_gpt)\n"
+                            "  --dir DIR   directory for the benchmark images (default: /tmp)\n"
+                            "  --quick     end-to-end builds up to 1 GiB only\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char image[4096];
+    snprintf(image, sizeof image, "%s/write_gpt_bench.%d.img", workDir, (int)getpid());
+
+    printf("{\n  \"crc32_engine\": \"%s\",\n  \"benchmarks\": [", crc32Engine());
+
+    benchCrc32();
+    benchGuid();
+    benchFat(image);
+    benchDirEntries(image);
+
+    // The ESP is the only part of the image that is written, its size drives the build
+    static const uint64_t sizes[] = { 33ull << 20, 1ull << 30, 16ull << 30, 256ull << 30 };
+    static const unsigned lbas[] = { 512, 1024, 2048, 4096 };
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        if (quick && sizes[s] > (1ull << 30)) break;
+        for (size_t l = 0; l < sizeof lbas / sizeof lbas[0]; l++) {
+            // FAT32 needs 65525 clusters of one sector at least, 33M only fits 512 byte LBAs
+            if (sizes[s] < 65525ull * lbas[l]) continue;
+            benchBuild(image, sizes[s], lbas[l]);
+        }
+    }
+
+    benchServe(image);
+
+    printf("\n  ]\n}\n");
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,8 @@
 #ifndef __CONFIG__UEFI_GPT_IMAGE_CREATOR__
 #define __CONFIG__UEFI_GPT_IMAGE_CREATOR__
 
+#include <stddef.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 // -----------------------------------------
@@ -12,30 +14,149 @@ enum {
     NUMBER_OF_GPT_TABLE_ENTRIES = 128,  // Количество записей в таблице GPT.
     GPT_TABLE_SIZE = 16384,             // 1024 * 16 Общий размер таблицы GPT в байтах (16 KiB).
     ALIGNMENT = 1048576,                // 1024 * 1024 * 1 Размер одного физического кластера в байтах (1 MiB или больше).
+    FAT_EPOCH = 315532800,              // 1980-01-01 00:00:00 UTC, самая ранняя дата FAT; время воспроизводимой сборки по умолчанию.
 };
 
+// Реализация записи образа (см. uefi_io.h).
+typedef enum {
+    IO_BACKEND_AUTO,                    // io_uring, если доступен, иначе синхронная запись.
+    IO_BACKEND_SYNC,                    // Блокирующие pwrite/copy_file_range, по одной операции.
+    IO_BACKEND_URING,                   // io_uring: до IoDepth независимых операций в очереди.
+} IOBackend;
+
+// Вывод статистики фаз сборки (--stats, см. uefi_stats.h).
+typedef enum {
+    STATS_OFF,                          // Фазы не записываются.
+    STATS_TABLE,                        // Таблица в stderr после каждого образа.
+    STATS_JSON,                         // Одна строка JSON в stderr после каждого образа.
+} StatsFormat;
+
+// Формат выходного файла образа.
+typedef enum {
+    IMAGE_FORMAT_RAW,                   // Образ диска байт в байт.
+    IMAGE_FORMAT_QCOW2,                 // qcow2 v3: выделены только записанные кластеры.
+} ImageFormat;
+
 
 // -------------------------------------
-// Глобальные переменные
+// Контекст образа
 // -------------------------------------
 
-extern char *image_name;          // Название выходного файла образа диска.
+struct PartitionSpec;
+struct BuildPhases;
+struct IOCache;
+
+/**
+ * @brief Всё состояние сборки одного образа: параметры пользователя (флаги или строка
+ * манифеста), вычисленная разметка и генератор GUID.
+ *
+ * @note Глобальных изменяемых данных у библиотеки нет: сборки с разными контекстами
+ * независимы и могут идти параллельно в любых потоках. Один контекст - одна сборка за раз.
+ * Таблицы CRC32 и шаблоны VBR/FSInfo - константные данные, общие для всех.
+ *
+ * @param ImageName Имя выходного файла образа ("-" - stdout, см. openImageIO).
+ * @param EspDir Каталог хоста, содержимое которого записывается в ESP (NULL - только /EFI/BOOT).
+ * @param Format Формат выходного файла (--format).
+ * @param Sparse Разреженный образ: размер задаётся ftruncate, нулевые области не записываются.
+ * @param IoBackend Реализация записи образа (--io).
+ * @param IoDepth Глубина очереди записи и число буферов (--io-depth, 0 - IO_DEFAULT_DEPTH).
+ * @param Reproducible Воспроизводимая сборка: GUID из Seed, время - Epoch (UTC).
+ * @param Seed Начальное значение генератора GUID (--seed). GUID выводятся из Seed и описания
+ * образа (hashImageSpec); формат выходного файла и Sparse на содержимое не влияют.
+ * @param Epoch Время воспроизводимой сборки (SOURCE_DATE_EPOCH), более новые mtime ограничиваются им.
+ * @param CacheDir Каталог кэша готовых образов (--cache, NULL - без кэша).
+ * @param Stats Статистика фаз сборки (--stats).
+ * @param LbaSize Размер одного логического блока данных (512, 1024, 2048, 4096).
+ * @param EspSize Размер раздела EFI System Partition (ESP) в байтах.
+ * @param DataSize Размер раздела данных в байтах.
+ * @param DataSource Файл или устройство хоста, копируемое в раздел данных (NULL - раздел не заполняется).
+ * @param PairOption Последняя заданная опция стандартной пары ESP + Basic Data (esp-size,
+ * data-size, data-source) или NULL. С Partitions она не действует, и planLayout отклоняет её.
+ * @param DiskSize Заданный размер диска в байтах (0 - по размеру разделов).
+ * @param Partitions Разметка диска (см. uefi_layout.h), NULL - ESP (EspSize) + Basic Data (DataSize).
+ * @param PartitionCount Количество разделов.
+ * @param OwnsPartitions Массив Partitions выделен для этого контекста (освобождается freeImageContext).
+ * @param VerityData Раздел (номер с 1), над которым строится дерево хэшей dm-verity (--verity), 0 - нет.
+ * @param VerityHash Раздел для дерева хэшей, 0 - файл рядом с образом (см. uefi_verity.h).
+ * @param VerityBlock Размер блока данных и хэшей дерева (--verity-block), от 512 до VERITY_MAX_BLOCK и не меньше LbaSize.
+ * @param VeritySalt Соль дерева в hex (--verity-salt), "-" - без соли, NULL - из генератора GUID.
+ *
+ * @param ImageSize Общий размер образа диска в байтах (вычисляет planLayout).
+ * @param ImageSizeLBAs Общий размер образа диска в логических блоках (LBA).
+ * @param GptTableLBAs Размер таблицы GPT в логических блоках.
+ * @param AlignLBA Выравнивание разделов в логических блоках.
+ * @param EspLBA Начало раздела ESP (0 - в разметке нет ESP).
+ * @param EspSizeLBAs Размер раздела ESP в логических блоках.
+ *
+ * @param GuidState Состояние генератора GUID (splitmix64, см. new_guid).
+ * @param GuidSeeded Генератор инициализирован (seedGuids или getrandom при первом GUID).
+ * @param Phases Записанные фазы сборки (uefi_stats), NULL вне сборки со статистикой.
+ * @param IoCache Кольцо io_uring и буферы пула, оставшиеся от прошлого образа этого потока
+ * (см. newIOCache), NULL - создаются и освобождаются для каждого образа.
+ */
+typedef struct ImageContext {
+
+    const char  *ImageName;
+    char        *EspDir;
+    ImageFormat Format;
+    bool        Sparse;
+    IOBackend   IoBackend;
+    unsigned    IoDepth;
+    bool        Reproducible;
+    uint64_t    Seed;
+    int64_t     Epoch;
+    char        *CacheDir;
+    StatsFormat Stats;
+
+    uint64_t    LbaSize;
+    uint64_t    EspSize;
+    uint64_t    DataSize;
+    const char  *DataSource;
+    const char  *PairOption;
+    uint64_t    DiskSize;
+    struct PartitionSpec *Partitions;
+    size_t      PartitionCount;
+    bool        OwnsPartitions;
+    size_t      VerityData;
+    size_t      VerityHash;
+    uint32_t    VerityBlock;
+    const char  *VeritySalt;
+
+    uint64_t    ImageSize;
+    uint64_t    ImageSizeLBAs;
+    uint64_t    GptTableLBAs;
+    uint64_t    AlignLBA;
+    uint64_t    EspLBA;
+    uint64_t    EspSizeLBAs;
+
+    uint64_t    GuidState;
+    bool        GuidSeeded;
+    struct BuildPhases *Phases;
+    struct IOCache *IoCache;
 
-extern uint64_t lbaSize;          // Размер одного логического блока данных. (512, 1024, 2048, 4096)
-extern uint64_t espSize;          // Размер раздела EFI System Partition (ESP) в байтах. (33 MiB)
-extern uint64_t dataSize;         // Размер раздела данных в байтах. (1 MiB)
-extern uint64_t imageSize;        // Общий размер образа диска в байтах. Первоначально инициализируется как 0 и будет рассчитан позже.
+} ImageContext;
 
+// ==========
+// Functions
+// ==========
 
-// Размер разделов в LBA.
-extern uint64_t espSizeLBAs;      // Размер раздела ESP в логических блоках (LBA).
-extern uint64_t dataSizeLBAs;     // Размер раздела данных в логических блоках (LBA).
-extern uint64_t imageSizeLBAs;    // Общий размер образа диска в логических блоках (LBA).
-extern uint64_t gptTableLBAs;     // Размер таблицы GPT в логических блоках (LBA).
+/**
+ * @brief Заполняет контекст значениями по умолчанию: test.img, LBA 512, ESP 33 MiB,
+ * раздел данных 1 MiB, raw, io_uring если доступен, случайные GUID и текущее время.
+ */
+void initImageContext(ImageContext *ctx);
 
-extern uint64_t alignLBA;         // Выравнивание в логических блоках (LBA).
-extern uint64_t espLBA;           // Начало раздела ESP в логических блоках (LBA).
-extern uint64_t dataLBA;          // Начало раздела данных в логических блоках (LBA).
+/**
+ * @brief Копирует параметры пользователя из src в dst.
+ *
+ * @note Вычисляемые поля, генератор GUID, фазы и IoCache в dst начинаются заново; массив разделов
+ * общий с src (dst им не владеет). Строки не копируются и должны жить до конца сборки.
+ */
+void copyImageContext(ImageContext *dst, const ImageContext *src);
 
+/**
+ * @brief Освобождает то, чем владеет контекст (массив разделов, добавленный через part).
+ */
+void freeImageContext(ImageContext *ctx);
 
-#endif
\ No newline at end of file
+#endif
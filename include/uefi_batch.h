@@ -0,0 +1,45 @@
+#ifndef __UEFI_IMAGE_CREATOR__BATCH_H__
+#define __UEFI_IMAGE_CREATOR__BATCH_H__
+
+#include <stdbool.h>
+
+#include <uefi_image.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Разбирает одну строку манифеста на месте: "image=a.img esp-size=64M sparse".
+ *
+ * @param line Строка; разделители заменяются на '\0', значения параметров указывают в неё.
+ * @param ctx Контекст, в который записываются параметры (см. setImageOption).
+ *
+ * @return true, если все параметры известны и корректны, иначе false (с сообщением в stderr).
+ */
+bool parseManifestLine(char *line, ImageContext *ctx);
+
+/**
+ * @brief Собирает все образы, описанные в файле манифеста, в пуле потоков.
+ *
+ * @param base Контекст со значениями по умолчанию для строк манифеста.
+ * @param manifest Путь к файлу манифеста.
+ * @param jobs Количество потоков (0 - по числу процессоров).
+ *
+ * @return true, если все образы собраны успешно, иначе false.
+ *
+ * @note Формат манифеста: одна строка - один образ, параметры через пробел в виде key=value
+ * (те же имена, что и у флагов командной строки, см. setImageOption), например:
+ *
+ *     image=a.img esp-size=64M esp-dir=./stage-a sparse
+ *
+ * Пустые строки и строки, начинающиеся с '#', пропускаются. Значения, не указанные в строке,
+ * берутся из base (т.е. из флагов командной строки).
+ *
+ * @note Каждая строка получает свой контекст (copyImageContext от base), потоки берут
+ * контексты из общей очереди. Таблицы CRC32 и шаблоны VBR/FSInfo - константные данные,
+ * общие для всех потоков.
+ */
+bool runBatch(const ImageContext *base, const char *manifest, unsigned jobs);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __UEFI_IMAGE_CREATOR__CACHE_H__
+#define __UEFI_IMAGE_CREATOR__CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+#include <uefi_sha256.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Добавляет к хэшу все параметры образа, от которых зависит его содержимое (байты диска).
+ *
+ * @param ctx Контекст образа.
+ * @param sha Состояние SHA-256.
+ *
+ * @note Учитываются размеры, разметка (Partitions), Seed и Epoch. Имя выходного файла,
+ * способ хранения (Sparse, формат, поток), реализация записи, содержимое EspDir и файлов
+ * Source разделов (только признак их наличия) не учитываются: raw, qcow2 и разреженный
+ * образ одного описания содержат одни и те же байты диска.
+ */
+void hashImageSpec(const ImageContext *ctx, Sha256 *sha);
+
+/**
+ * @brief Начальное значение генератора GUID для воспроизводимой сборки образа.
+ *
+ * @param ctx Контекст образа.
+ *
+ * @return Первые 8 байт SHA-256 описания образа (hashImageSpec): одинаковые описания дают
+ * одинаковые GUID, разные образы одного пакета - разные.
+ */
+uint64_t reproducibleSeed(const ImageContext *ctx);
+
+/**
+ * @brief Вычисляет ключ кэша образа.
+ *
+ * @param ctx Контекст образа.
+ * @param key Буфер для ключа (SHA-256 в шестнадцатеричном виде).
+ *
+ * @return true, если все входные данные прочитаны, иначе false (с сообщением в stderr).
+ *
+ * @details Хэшируются: исполняемый файл программы (другая версия - другой образ),
+ * hashImageSpec, Sparse и формат (другой файл в кэше), дерево EspDir в порядке имён - имя, тип, размер, mtime (ограниченный
+ * Epoch) и содержимое каждого файла, затем содержимое файлов Source разделов (DataSource).
+ * Это один проход чтения по входным данным.
+ */
+bool imageCacheKey(const ImageContext *ctx, char key[SHA256_HEX_SIZE]);
+
+/**
+ * @brief Собирает образ через кэш CacheDir.
+ *
+ * @param ctx Контекст образа.
+ * @param build Функция, записывающая образ контекста в его ImageName (на время сборки
+ * ImageName - временный файл кэша).
+ *
+ * @return true, если образ ImageName готов, иначе false (с сообщением в stderr).
+ *
+ * @details
+ * 1. Вычисляет ключ (imageCacheKey).
+ * 2. Если в кэше нет файла <ключ>.img, собирает образ во временный файл кэша и атомарно
+ *    переименовывает его (параллельные сборки одного образа безопасны).
+ * 3. Размещает образ в ImageName: reflink (FICLONE), иначе копия областей данных (cloneFile).
+ *
+ * @note Кэш требует воспроизводимой сборки (Reproducible) и выходного файла (не устройства
+ * и не потока). Файлы кэша доступны только для чтения. Жёсткая ссылка не используется:
+ * образ был бы тем же файлом, что и запись кэша, и --update или --resize образа изменили
+ * бы кэш и все следующие попадания.
+ */
+bool buildCachedImage(ImageContext *ctx, bool (*build)(ImageContext *));
+
+#endif
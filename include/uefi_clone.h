@@ -0,0 +1,42 @@
+#ifndef __UEFI_IMAGE_CREATOR__CLONE_H__
+#define __UEFI_IMAGE_CREATOR__CLONE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Заменяет идентификаторы образа новыми случайными значениями.
+ *
+ * @param ctx Контекст, генератор GUID которого даёт новые идентификаторы.
+ * @param path Путь к файлу образа.
+ *
+ * @return true, если образ успешно изменён, иначе false.
+ *
+ * @note Меняются только DiskGuid, UniquePartitionGUID всех используемых записей,
+ * BS_VolID разделов ESP (основной и резервный загрузочные сектора) и зависящие от них
+ * HeaderCRC32/PartitionEntryArrayCRC32 в основном и резервном GPT. Записывается несколько
+ * сотен байт, остальной образ не затрагивается.
+ */
+bool patchImageIdentity(ImageContext *ctx, const char *path);
+
+/**
+ * @brief Создаёт копию "золотого" образа с новыми идентификаторами.
+ *
+ * @param ctx Контекст, генератор GUID которого даёт новые идентификаторы.
+ * @param golden Путь к исходному образу.
+ * @param target Путь к новому образу.
+ *
+ * @return true, если копия создана, иначе false.
+ *
+ * @note Копия создаётся через cloneFile (reflink или копирование областей данных),
+ * затем идентификаторы заменяются через patchImageIdentity.
+ */
+bool cloneImage(ImageContext *ctx, const char *golden, const char *target);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __UEFI_IMAGE_CREATOR__COPY_H__
+#define __UEFI_IMAGE_CREATOR__COPY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+#include <uefi_io.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Копирует содержимое файла хоста в файл образа по заданному смещению.
+ *
+ * @param io Образ, открытый для записи.
+ * @param path Путь к исходному файлу на хосте.
+ * @param offset Смещение в байтах от начала образа, куда будут записаны данные.
+ * @param size Количество байт, которое будет скопировано.
+ *
+ * @return true, если все size байт успешно скопированы, иначе false.
+ *
+ * @note Копирование выполняет ioCopy: синхронно данные переносятся ядром напрямую между
+ * файлами (copy_file_range, затем sendfile, затем цикл pread/pwrite), через io_uring -
+ * связанными парами чтения и записи, до IoDepth одновременно.
+ *
+ * @note Для разреженного образа (ioSparse) копируются только области данных исходного файла
+ * (SEEK_DATA/SEEK_HOLE), его "дыры" остаются "дырами" в образе.
+ */
+bool copyFileToImage(ImageIO *io, const char *path, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Копирует образ файловой системы (файл или блочное устройство) в раздел образа.
+ *
+ * @param io Образ, открытый для записи.
+ * @param path Путь к исходному файлу или устройству.
+ * @param offset Смещение начала раздела в байтах.
+ * @param size Размер данных (см. hostFileSize).
+ *
+ * @return true, если все данные скопированы, иначе false (с сообщением в stderr).
+ *
+ * @note В отличие от copyFileToImage, данные идут через ioClone: reflink, если исходный файл
+ * и образ на одной файловой системе с его поддержкой, иначе copy_file_range - это один
+ * проход ядра по данным вместо чтения и записи через буферы. Для разреженного образа
+ * копируются только области данных.
+ */
+bool copyPayloadToImage(ImageIO *io, const char *path, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Размер файла или блочного устройства (BLKGETSIZE64) хоста.
+ *
+ * @param path Путь к файлу.
+ * @param size Указатель на переменную для результата.
+ *
+ * @return true, если размер получен, иначе false (с сообщением в stderr).
+ */
+bool hostFileSize(const char *path, uint64_t *size);
+
+/**
+ * @brief Копирует диапазон байт между двумя открытыми файлами.
+ *
+ * @param in Дескриптор исходного файла.
+ * @param out Дескриптор файла образа.
+ * @param inOffset Смещение в исходном файле.
+ * @param outOffset Смещение в образе.
+ * @param len Количество байт.
+ *
+ * @return true, если все len байт скопированы, иначе false.
+ *
+ * @note Тот же порядок методов, что и у copyFileToImage: copy_file_range, sendfile, pread/pwrite.
+ */
+bool copyRangeToImage(int in, int out, uint64_t inOffset, uint64_t outOffset, uint64_t len);
+
+/**
+ * @brief Создаёт копию файла (например, готового образа).
+ *
+ * @param src Путь к исходному файлу.
+ * @param dst Путь к файлу назначения (создаётся или перезаписывается).
+ *
+ * @return true, если копия создана, иначе false.
+ *
+ * @note Сначала пробуется reflink (ioctl FICLONE) - копия разделяет блоки с исходным файлом
+ * и не стоит ни одной записи данных (Btrfs, XFS, bcachefs). Иначе копируются только
+ * области данных исходного файла, "дыры" остаются "дырами".
+ */
+bool cloneFile(const char *src, const char *dst);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __UEFI_IMAGE_CREATOR__CRC32_H__
+#define __UEFI_IMAGE_CREATOR__CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Начальное значение для потокового вычисления CRC32.
+ *
+ * @return Состояние CRC32 перед обработкой первого байта (0xFFFFFFFF).
+ *
+ * @note Потоковый API: crc = crc32Init(); crc = crc32Update(crc, ...) для каждого фрагмента;
+ * результат = crc32Final(crc). Результат совпадает с CRC32 из спецификации UEFI (и zlib).
+ */
+static inline uint32_t crc32Init(void)
+{
+    return 0xFFFFFFFF;
+}
+
+/**
+ * @brief Добавляет фрагмент данных к потоковому вычислению CRC32.
+ *
+ * @param crc Текущее состояние (от crc32Init или предыдущего crc32Update).
+ * @param buf Указатель на буфер с данными.
+ * @param len Длина буфера в байтах.
+ *
+ * @return Новое состояние CRC32.
+ *
+ * @note Реализация выбирается один раз во время выполнения по возможностям процессора:
+ * PCLMULQDQ (x86-64), инструкции CRC32 (ARMv8) или переносимый slicing-by-16 по
+ * предвычисленным таблицам. Функция потокобезопасна, таблицы - константные данные.
+ */
+uint32_t crc32Update(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Завершает потоковое вычисление CRC32.
+ *
+ * @param crc Состояние после последнего вызова crc32Update.
+ *
+ * @return Значение CRC32 (инвертированное состояние).
+ */
+static inline uint32_t crc32Final(uint32_t crc)
+{
+    return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * @brief Вычисляет значение CRC32 для диапазона данных.
+ *
+ * @param buf Указатель на буфер с данными.
+ * @param len Длина буфера в байтах.
+ *
+ * @return Значение CRC32 для предоставленных данных.
+ *
+ * @note Однократный вызов crc32Init / crc32Update / crc32Final.
+ */
+static inline uint32_t calculateCRC32(const void *buf, size_t len)
+{
+    return crc32Final(crc32Update(crc32Init(), buf, len));
+}
+
+/**
+ * @brief Название реализации CRC32, выбранной для текущего процессора.
+ *
+ * @return "pclmul", "armv8-crc" или "slice16".
+ */
+const char *crc32Engine(void);
+
+#endif
@@ -9,6 +9,7 @@
 
 #include <config.h>
 #include <uefi_lba.h>
+#include <uefi_io.h>
 
 /**
  * @brief Структура для хранения данных FAT32 Volume Boot Record (VBR).
@@ -133,6 +134,10 @@ typedef enum {
                      ATTR_SYSTEM    | ATTR_VOLUME_ID,
 } FAT32_DirAttr;
 
+enum {
+    FAT_DIR_MAX_ENTRIES = 65536,        // Наибольшее число записей в каталоге (2 MiB), fatgen103
+};
+
 
 /**
  * @brief FAT32 Byte Directory Entry Short Structure
@@ -177,6 +182,79 @@ typedef struct
 } __attribute__((packed)) FAT32_DirEntryShort;
 
 
+/**
+ * @brief FAT32 Long File Name (LFN) Directory Entry Structure
+ *
+ * @note Длинное имя (UTF-16, до 255 символов) хранится по 13 символов в записях, стоящих
+ * непосредственно перед короткой записью файла, в обратном порядке: первой идёт запись
+ * с последним фрагментом имени (LDIR_Ord | 0x40). Имя завершается нулём (если есть место)
+ * и дополняется 0xFFFF.
+ *
+ * @param LDIR_Ord Порядковый номер записи (1..20), 0x40 - последняя запись имени.
+ * @param LDIR_Name1 Символы 1-5 фрагмента имени.
+ * @param LDIR_Attr Атрибуты, всегда ATTR_LONG_NAME.
+ * @param LDIR_Type Тип записи, 0 - часть длинного имени.
+ * @param LDIR_Chksum Контрольная сумма короткого имени (DIR_Name) этого файла.
+ * @param LDIR_Name2 Символы 6-11 фрагмента имени.
+ * @param LDIR_FstClusLO Всегда 0.
+ * @param LDIR_Name3 Символы 12-13 фрагмента имени.
+ */
+typedef struct
+{
+
+    uint8_t     LDIR_Ord;
+    uint16_t    LDIR_Name1[5];
+    uint8_t     LDIR_Attr;
+    uint8_t     LDIR_Type;
+    uint8_t     LDIR_Chksum;
+    uint16_t    LDIR_Name2[6];
+    uint16_t    LDIR_FstClusLO;
+    uint16_t    LDIR_Name3[2];
+
+} __attribute__((packed)) FAT32_DirEntryLong;
+
+
+/**
+ * @brief Узел дерева файлов и каталогов ESP.
+ *
+ * @note Дерево строится в памяти до записи раздела: сначала из каталога хоста (EspDir)
+ * или из стандартного скелета /EFI/BOOT, затем каждому узлу выделяется цепочка кластеров,
+ * и только после этого записываются FAT, каталоги и данные файлов.
+ *
+ * @param Name Короткое имя в формате 8.3 (11 байт, как в DIR_Name).
+ * @param NTRes Флаги строчных букв короткого имени (DIR_NTRes).
+ * @param LongName Длинное имя в UTF-16 для записей LFN (NULL, если хватает короткого).
+ * @param LongLen Длина LongName в символах.
+ * @param Attr Атрибуты записи каталога (ATTR_DIRECTORY или ATTR_ARCHIVE).
+ * @param HostPath Путь к файлу на хосте, откуда копируются данные (NULL для каталогов).
+ * @param Size Размер файла в байтах (0 для каталогов).
+ * @param MTime Время последнего изменения, записывается в DIR_WrtTime/DIR_WrtDate.
+ * @param FirstCluster Первый кластер цепочки (0 для пустых файлов).
+ * @param ClusterCount Количество кластеров в цепочке.
+ * @param Parent Родительский каталог (NULL для корня).
+ * @param Child Первый дочерний узел каталога.
+ * @param Next Следующий узел в том же каталоге.
+ */
+typedef struct FAT32_Node {
+
+    uint8_t             Name[11];
+    uint8_t             NTRes;
+    uint16_t           *LongName;
+    uint8_t             LongLen;
+    uint8_t             Attr;
+    char               *HostPath;
+    uint32_t            Size;
+    time_t              MTime;
+    uint32_t            FirstCluster;
+    uint32_t            ClusterCount;
+
+    struct FAT32_Node  *Parent;
+    struct FAT32_Node  *Child;
+    struct FAT32_Node  *Next;
+
+} FAT32_Node;
+
+
 // ==========
 // Functions
 // ==========
@@ -184,20 +262,60 @@ typedef struct
 /**
  * @brief Получает текущее время и дату в формате FAT.
  *
+ * @param ctx Контекст образа.
  * @param inTime Указатель на переменную, в которую будет записано время.
  * @param inDate Указатель на переменную, в которую будет записана дата.
  *
  * @note Функция преобразует текущее локальное время в формат, совместимый с файловой системой FAT.
  * Год рассчитывается как количество лет с 1980 года, месяцы считаются с 1 до 12, а не с 0 до 11.
  * Время обрабатывается в формате FAT, где секунды считаются в 2-секундных интервалах.
+ * При воспроизводимой сборке (Reproducible) вместо текущего времени берётся Epoch в UTC.
  */
-void getFATDirEntTimeDate(uint16_t *inTime, uint16_t *inDate);
+void getFATDirEntTimeDate(const ImageContext *ctx, uint16_t *inTime, uint16_t *inDate);
 
+/**
+ * @brief Преобразует заданное время в формат FAT.
+ *
+ * @param t Время (например, st_mtime файла хоста).
+ * @param utc Считать в UTC (воспроизводимая сборка), иначе - в локальном часовом поясе.
+ * @param inTime Указатель на переменную, в которую будет записано время.
+ * @param inDate Указатель на переменную, в которую будет записана дата.
+ *
+ * @note Время до 1980 года заменяется на FAT_EPOCH.
+ */
+void getFATTimeDateOf(time_t t, bool utc, uint16_t *inTime, uint16_t *inDate);
+
+/**
+ * @brief Преобразует имя файла хоста в короткое имя 8.3 ("boot.efi" -> "BOOT    EFI").
+ *
+ * @param name Имя файла (без пути).
+ * @param shortName Буфер из 11 байт для результата (формат DIR_Name).
+ *
+ * @return true, если имя представимо в формате 8.3, иначе false.
+ *
+ * @note Строчные буквы переводятся в заглавные, допустимы буквы, цифры и символы $%'-_@~`!(){}^#&.
+ */
+bool toShortName(const char *name, uint8_t shortName[11]);
+
+
+/**
+ * @brief Проверяет, что из ESP размером EspSizeLBAs получается том FAT32.
+ *
+ * @param ctx Контекст образа с разметкой от planLayout (EspSizeLBAs, AlignLBA, LbaSize).
+ *
+ * @return true, если геометрия тома (размер кластера, FAT) подобрана, иначе false
+ * (с сообщением в stderr).
+ *
+ * @note Вызывается до открытия образа, writeESP подбирает ту же геометрию.
+ */
+bool checkESPGeometry(const ImageContext *ctx);
 
 /**
  * @brief Записывает таблицу разделов EFI System Partition (ESP) в файл образа.
  *
- * @param image Указатель на файл образа, в который будут записаны данные ESP.
+ * @param ctx Контекст образа с разметкой от planLayout (EspLBA, EspSizeLBAs, AlignLBA);
+ * BS_VolID берётся из его генератора GUID.
+ * @param io Образ, в который будут записаны данные ESP.
  *
  * @return true, если запись успешно выполнена, иначе false.
  *
@@ -205,12 +323,20 @@ void getFATDirEntTimeDate(uint16_t *inTime, uint16_t *inDate);
  * Используется для создания структуры файловой системы FAT32 на разделе ESP.
  * 
  * @details
- * 1. Заполняет и записывает Volume Boot Record (VBR) в зарезервированную область.
- * 2. Записывает File System Info (FSInfo) сектор.
- * 3. Создает и записывает резервную копию VBR и FSInfo.
- * 4. Заполняет FAT таблицы, зеркально записывая их.
- * 5. Записывает корневую директорию и директорию EFI.
+ * 1. Строит дерево ESP: содержимое каталога EspDir или, если он не задан, скелет /EFI/BOOT.
+ *    Имена не в формате 8.3 получают записи LFN и уникальное в каталоге короткое имя ~N.
+ * 2. Выделяет каждому каталогу и файлу непрерывную цепочку кластеров; каталогу - столько
+ *    кластеров, сколько занимают его записи вместе с LFN (до FAT_DIR_MAX_ENTRIES).
+ * 3. Заполняет и записывает Volume Boot Record (VBR) в зарезервированную область.
+ * 4. Записывает File System Info (FSInfo) сектор: число свободных кластеров и первый свободный
+ *    кластер точные, всё место после дерева - один свободный отрезок.
+ * 5. Создает и записывает резервную копию VBR и FSInfo.
+ * 6. Заполняет FAT таблицы цепочками кластеров, зеркально записывая их.
+ * 7. Записывает каталоги целыми кластерами (остаток последнего кластера - нули) и копирует
+ *    данные файлов из хоста (см. copyFileToImage).
+ *
+ * Все записи ставятся в очередь ioSubmit/ioCopy и выполняются независимо друг от друга.
  */
-bool writeESP(FILE *image);
+bool writeESP(ImageContext *ctx, ImageIO *io);
 
 #endif
\ No newline at end of file
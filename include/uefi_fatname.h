@@ -0,0 +1,215 @@
+#ifndef __UEFI_IMAGE_CREATOR__FATNAME_H__
+#define __UEFI_IMAGE_CREATOR__FATNAME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uefi_fat32.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+enum {
+    LFN_CHARS_PER_ENTRY = 13,           // Символов UTF-16 в одной записи FAT32_DirEntryLong
+    LFN_MAX_CHARS = 255,                // Наибольшая длина длинного имени
+    LFN_MAX_ENTRIES = 20,               // Записей на имя из LFN_MAX_CHARS символов
+    LFN_LAST_ENTRY = 0x40,              // Флаг LDIR_Ord записи с концом имени
+    NTRES_LOWER_BASE = 0x08,            // DIR_NTRes: имя 8.3 строчными буквами
+    NTRES_LOWER_EXT = 0x10,             // DIR_NTRes: расширение 8.3 строчными буквами
+};
+
+/**
+ * @brief Имя файла FAT: короткое имя и, если нужно, длинное (VFAT LFN).
+ *
+ * @param Long Имя в UTF-16, как его задал пользователь или хост.
+ * @param LongLen Длина Long в символах UTF-16.
+ * @param HasLong Нужны записи LFN: имя не 8.3 или регистр букв смешан.
+ * @param Lossy Short не передаёт имя точно (недопустимые символы, усечение), нужен хвост ~N.
+ * @param Short Короткое имя (формат DIR_Name): базовое имя до makeShortAlias.
+ * @param NTRes Флаги строчных букв для DIR_NTRes (только если HasLong == false).
+ */
+typedef struct {
+
+    uint16_t    Long[LFN_MAX_CHARS];
+    uint8_t     LongLen;
+    bool        HasLong;
+    bool        Lossy;
+    uint8_t     Short[11];
+    uint8_t     NTRes;
+
+} FAT32_Name;
+
+/**
+ * @brief Чтение длинных имён из записей каталога по порядку.
+ *
+ * @param Long Собираемое имя.
+ * @param LongLen Длина имени, 0 - нет последовательности LFN.
+ * @param Expect Номер следующей ожидаемой записи LFN.
+ * @param Checksum Контрольная сумма последовательности.
+ */
+typedef struct {
+
+    uint16_t    Long[LFN_MAX_CHARS];
+    uint8_t     LongLen;
+    uint8_t     Expect;
+    uint8_t     Checksum;
+
+} FAT32_LfnReader;
+
+/**
+ * @brief Хэш-индекс имён одного каталога FAT.
+ *
+ * @note Каждая запись индексируется по короткому имени и, если оно есть, по длинному
+ * (без учёта регистра ASCII), поэтому проверка коллизий и поиск по имени занимают O(1)
+ * вместо просмотра каталога.
+ */
+typedef struct FAT32_NameIndex FAT32_NameIndex;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Разбирает имя файла и строит его короткое имя.
+ *
+ * @param name Имя в UTF-8 (без пути).
+ * @param out Результат.
+ *
+ * @return true, если имя допустимо в FAT (VFAT), иначе false.
+ *
+ * @details
+ * - Имя 8.3 из допустимых символов, каждая часть которого целиком в одном регистре
+ *   ("BOOTX64.EFI", "grub.cfg"), хранится только коротким именем, строчные буквы - флагами NTRes.
+ * - Имя 8.3 со смешанным регистром ("Boot.efi") получает LFN, короткое имя - то же в верхнем регистре.
+ * - Остальные имена получают LFN и базовое короткое имя по правилам VFAT: верхний регистр,
+ *   без пробелов и начальных точек, символы не из набора 8.3 заменяются на '_', имя
+ *   усекается до 8 символов, расширение (после последней точки) - до 3. Хвост ~N
+ *   добавляет makeShortAlias.
+ *
+ * @note Недопустимы пустые имена, "." и "..", имена длиннее 255 символов UTF-16, с точкой
+ * или пробелом в конце, с управляющими символами и символами "*:<>?\|/ и с неверным UTF-8.
+ */
+bool makeFatName(const char *name, FAT32_Name *out);
+
+/**
+ * @brief Подбирает свободное в каталоге короткое имя с хвостом ~N.
+ *
+ * @param index Индекс имён каталога.
+ * @param name Имя от makeFatName, Short заменяется на найденное.
+ *
+ * @return true, если короткое имя найдено, иначе false.
+ *
+ * @note Как в Windows: сначала "BASENA~1".."BASENA~4", затем два символа базового имени,
+ * четыре шестнадцатеричные цифры хэша длинного имени и ~1, ~2, ... Каждая попытка - один
+ * поиск в индексе. Имя без потерь (Lossy == false) не меняется.
+ */
+bool makeShortAlias(const FAT32_NameIndex *index, FAT32_Name *name);
+
+/**
+ * @brief Контрольная сумма короткого имени для LDIR_Chksum.
+ *
+ * @param shortName Короткое имя (формат DIR_Name).
+ */
+uint8_t lfnChecksum(const uint8_t shortName[11]);
+
+/**
+ * @brief Число записей LFN перед короткой записью имени.
+ *
+ * @param name Имя от makeFatName.
+ *
+ * @return 0 для коротких имён, иначе 1..LFN_MAX_ENTRIES.
+ */
+size_t lfnEntryCount(const FAT32_Name *name);
+
+/**
+ * @brief Заполняет записи LFN имени в порядке их расположения в каталоге.
+ *
+ * @param name Имя от makeFatName (с окончательным Short).
+ * @param entries Буфер на lfnEntryCount(name) записей.
+ *
+ * @return Число записанных записей.
+ */
+size_t makeLongEntries(const FAT32_Name *name, FAT32_DirEntryLong *entries);
+
+/**
+ * @brief Добавляет к читаемому имени очередную запись LFN.
+ *
+ * @param reader Состояние чтения (в начале каталога - нули).
+ * @param entry Запись с атрибутом ATTR_LONG_NAME.
+ *
+ * @note Запись с флагом LFN_LAST_ENTRY начинает новую последовательность, запись не по порядку
+ * или с другой контрольной суммой её сбрасывает.
+ */
+void readLongEntry(FAT32_LfnReader *reader, const FAT32_DirEntryLong *entry);
+
+/**
+ * @brief Завершает имя на короткой записи.
+ *
+ * @param reader Состояние чтения, сбрасывается для следующего имени.
+ * @param entry Короткая запись (вызывается и для удалённых записей, чтобы сбросить состояние).
+ * @param name Имя файла: короткое имя, NTRes и длинное имя, если оно есть.
+ *
+ * @return true, если перед записью была полная последовательность LFN с верной контрольной
+ * суммой, false - если её не было (имя только короткое) или она не подходит к записи.
+ */
+bool readShortEntry(FAT32_LfnReader *reader, const FAT32_DirEntryShort *entry, FAT32_Name *name);
+
+/**
+ * @brief Записывает имя в UTF-8: длинное, если есть, иначе короткое с учётом NTRes.
+ *
+ * @param name Имя.
+ * @param out Буфер.
+ * @param size Размер буфера (достаточно 4 * LFN_MAX_CHARS + 1).
+ */
+void formatFatName(const FAT32_Name *name, char *out, size_t size);
+
+/**
+ * @brief Создаёт пустой индекс имён.
+ *
+ * @return Индекс или NULL, если не хватило памяти.
+ */
+FAT32_NameIndex *newNameIndex(void);
+
+/**
+ * @brief Освобождает индекс имён.
+ */
+void freeNameIndex(FAT32_NameIndex *index);
+
+/**
+ * @brief Добавляет имя в индекс.
+ *
+ * @param index Индекс имён.
+ * @param name Имя с окончательным коротким именем.
+ * @param value Значение, которое вернёт findIndexName (например, номер записи каталога).
+ *
+ * @return true, если добавлено, false - если не хватило памяти.
+ */
+bool addIndexName(FAT32_NameIndex *index, const FAT32_Name *name, uint64_t value);
+
+/**
+ * @brief Ищет в индексе файл, которому соответствует имя.
+ *
+ * @param index Индекс имён.
+ * @param name Имя от makeFatName.
+ * @param value Значение найденного имени (может быть NULL).
+ *
+ * @return true, если имя совпадает (без учёта регистра) с длинным или коротким именем
+ * файла каталога, иначе false.
+ */
+bool findIndexName(const FAT32_NameIndex *index, const FAT32_Name *name, uint64_t *value);
+
+/**
+ * @brief Удаляет из индекса файл, которому соответствует имя (см. findIndexName).
+ *
+ * @return true, если файл был в индексе.
+ */
+bool removeIndexName(FAT32_NameIndex *index, const FAT32_Name *name);
+
+/**
+ * @brief Число файлов в индексе.
+ */
+size_t indexNameCount(const FAT32_NameIndex *index);
+
+#endif
@@ -9,6 +9,8 @@
 
 #include <config.h>
 #include <uefi_lba.h>
+#include <uefi_crc32.h>
+#include <uefi_io.h>
 
 // ----------------
 // Global Typedefs
@@ -118,35 +120,25 @@ typedef struct {
 /**
  * @brief Создает новый GUID версии 4, варианта 2.
  *
+ * @param ctx Контекст образа, генератор которого используется.
+ *
  * @return Новый GUID.
  *
  * @note Функция генерирует новый GUID версии 4, варианта 2, который можно использовать
  * для уникальной идентификации объектов. GUID генерируется с использованием случайных данных.
- */
-Guid new_guid();
-
-extern uint32_t crcTable[256];
-/**
- * @brief Создает таблицу CRC32.
  *
- * @note Функция инициализирует глобальную таблицу crcTable[256], которая используется для
- * вычисления контрольных сумм CRC32. Таблица содержит 256 предвычисленных значений,
- * которые ускоряют процесс вычисления CRC32.
+ * @note Генератор (splitmix64) свой у каждого контекста, блокировок нет. Без seedGuids
+ * он инициализируется из getrandom при первом вызове.
  */
-void createCRC32Table(void);
+Guid new_guid(ImageContext *ctx);
 
 /**
- * @brief Вычисляет значение CRC32 для диапазона данных.
- *
- * @param buf Указатель на буфер с данными.
- * @param len Длина буфера в байтах.
- *
- * @return Значение CRC32 для предоставленных данных.
+ * @brief Задаёт начальное значение генератора GUID контекста.
  *
- * @note Функция принимает указатель на буфер и его длину, и возвращает значение CRC32, 
- * вычисленное для этих данных. Использует предвычисленную таблицу CRC32 для ускорения вычислений.
+ * @param ctx Контекст образа.
+ * @param seed Начальное значение; одно и то же значение даёт одну и ту же последовательность GUID.
  */
-uint32_t calculateCRC32(void *buf, int32_t len);
+void seedGuids(ImageContext *ctx, uint64_t seed);
 
 /**
  * @brief EFI GUID.
@@ -169,13 +161,51 @@ extern const Guid BASIC_DATA_GUID;
 /**
  * @brief Записывает заголовки и таблицы GPT в файл образа.
  *
- * @param image Указатель на файл образа, в который будут записаны заголовки и таблицы GPT.
+ * @param ctx Контекст образа с разметкой от planLayout (ImageSizeLBAs, GptTableLBAs);
+ * DiskGuid берётся из его генератора.
+ * @param io Образ, в который будут записаны заголовки и таблицы GPT.
+ * @param table Массив записей разделов (см. planLayout), один и тот же для обеих таблиц.
  *
  * @return true, если запись прошла успешно, иначе false.
  *
  * @note Функция создает и записывает заголовки и таблицы GPT в указанный файл образа.
  * Эта функция должна быть вызвана после того, как файл образа был открыт для записи.
+ * Все четыре записи независимы и ставятся в очередь ввода-вывода одновременно.
+ */
+bool writeGPTs(ImageContext *ctx, ImageIO *io, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]);
+
+/**
+ * @brief Определяет размер LBA существующего образа по положению заголовка GPT.
+ *
+ * @param fd Дескриптор файла образа, открытого для чтения.
+ *
+ * @return Размер LBA (512, 1024, 2048 или 4096) или 0, если заголовок "EFI PART" не найден.
+ */
+uint64_t detectImageLBASize(int fd);
+
+/**
+ * @brief Читает и проверяет заголовок GPT существующего образа.
+ *
+ * @param fd Дескриптор файла образа.
+ * @param lba Номер LBA заголовка (1 для основного, AlternateLBA для резервного).
+ * @param lbaBytes Размер LBA образа в байтах.
+ * @param header Указатель на структуру для результата.
+ *
+ * @return true, если сигнатура, размер заголовка и HeaderCRC32 корректны, иначе false.
+ */
+bool readGptHeader(int fd, uint64_t lba, uint64_t lbaBytes, GptHeader *header);
+
+/**
+ * @brief Читает и проверяет массив записей разделов, описанный заголовком GPT.
+ *
+ * @param fd Дескриптор файла образа.
+ * @param header Заголовок, прочитанный readGptHeader.
+ * @param lbaBytes Размер LBA образа в байтах.
+ * @param size Указатель на переменную для размера массива в байтах.
+ *
+ * @return Массив (освобождается через free) или NULL, если массив не читается
+ * или не совпадает PartitionEntryArrayCRC32.
  */
-bool writeGPTs(FILE *image);
+uint8_t *readGptEntries(int fd, const GptHeader *header, uint64_t lbaBytes, size_t *size);
 
 #endif
\ No newline at end of file
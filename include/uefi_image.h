@@ -0,0 +1,75 @@
+#ifndef __UEFI_IMAGE_CREATOR__IMAGE_H__
+#define __UEFI_IMAGE_CREATOR__IMAGE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+#include <uefi_layout.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Преобразует строку размера в байты.
+ *
+ * @param str Число с необязательным двоичным суффиксом: K, M, G, T (например "33M").
+ * @param bytes Указатель на переменную для результата.
+ *
+ * @return true, если строка корректна, иначе false.
+ */
+bool parseSize(const char *str, uint64_t *bytes);
+
+/**
+ * @brief Устанавливает один параметр образа по имени.
+ *
+ * @param ctx Контекст образа. Строка value не копируется и должна жить до конца сборки.
+ * @param key Имя параметра: image, esp-dir, lba, esp-size, data-size, disk-size, part, sparse,
+ * format (raw, qcow2), io (auto, sync, uring), io-depth, seed, source-date-epoch, cache,
+ * verity (N или N:M - раздел данных и раздел для дерева), verity-block, verity-salt.
+ * @param value Значение (для флага sparse может быть NULL).
+ *
+ * @return true, если параметр известен и значение корректно, иначе false (с сообщением в stderr).
+ *
+ * @note Одни и те же имена используются во флагах командной строки (--esp-size 64M)
+ * и в строках манифеста пакетного режима (esp-size=64M).
+ *
+ * @note seed и source-date-epoch включают воспроизводимую сборку.
+ *
+ * @note Каждый part добавляет раздел (см. parsePartitionSpec) в новый массив, которым владеет
+ * контекст; общий с другими контекстами массив не изменяется.
+ */
+bool setImageOption(ImageContext *ctx, const char *key, char *value);
+
+/**
+ * @brief Собирает образ диска, описанный контекстом.
+ *
+ * @param ctx Контекст образа (см. initImageContext, setImageOption). Вычисляемые поля
+ * (разметка, генератор GUID) заполняются сборкой.
+ *
+ * @return true, если образ успешно записан, иначе false (с сообщением в stderr).
+ *
+ * @details
+ * 0. Если задан CacheDir - берёт образ из кэша или собирает и добавляет его (buildCachedImage).
+ *    При воспроизводимой сборке генератор GUID инициализируется reproducibleSeed().
+ * 1. Размещает разделы (planLayout).
+ * 2. Создаёт файл ImageName (для разреженного образа - сразу нужного размера). Если
+ *    ImageName - блочное устройство, пишет прямо в него (O_DIRECT): LbaSize должен совпадать
+ *    с логическим блоком устройства, а без DiskSize диск занимает всё устройство.
+ *    Образ qcow2 всегда разреженный: в файл попадают только записанные кластеры.
+ *    ImageName "-" - потоковая запись в stdout по возрастанию смещений (см. openImageIO).
+ * 3. Записывает защитный MBR, заголовки и таблицы GPT, файловую систему первого раздела ESP.
+ *    С VerityData - запускает построение дерева хэшей раздела (startVerity), затем копирует
+ *    файлы разделов и записывает дерево (finishVerity).
+ * 4. Дожидается завершения всех записей (IoBackend, IoDepth) и закрывает образ.
+ *
+ * @note Без воспроизводимой сборки GUID случайные (генератор контекста, см. new_guid).
+ *
+ * @note Реентерабельна: образы с разными контекстами можно собирать одновременно в разных
+ * потоках одного процесса.
+ */
+bool buildImage(ImageContext *ctx);
+
+#endif
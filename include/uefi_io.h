@@ -0,0 +1,208 @@
+#ifndef __UEFI_IMAGE_CREATOR__IO_H__
+#define __UEFI_IMAGE_CREATOR__IO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+enum {
+    IO_BUFFER_SIZE = 1024 * 1024,   // Наименьший размер буфера пула (наибольшая одиночная запись), 1 MiB
+    IO_DEFAULT_DEPTH = 16,          // Глубина очереди по умолчанию
+};
+
+/**
+ * @brief Сведения о цели записи, полученные probeImageTarget.
+ *
+ * @param IsBlockDevice Цель - блочное устройство (иначе обычный файл, остальные поля 0).
+ * @param LogicalBlockSize Логический размер блока устройства (BLKSSZGET).
+ * @param PhysicalBlockSize Физический размер блока (BLKPBSZGET), не меньше логического.
+ * @param OptimalIOSize Оптимальный размер запроса (BLKIOOPT), 0 - не сообщается.
+ * @param Size Размер устройства в байтах (BLKGETSIZE64).
+ */
+typedef struct {
+
+    bool        IsBlockDevice;
+    uint32_t    LogicalBlockSize;
+    uint32_t    PhysicalBlockSize;
+    uint32_t    OptimalIOSize;
+    uint64_t    Size;
+
+} ImageTarget;
+
+/**
+ * @brief Открытый для записи образ и его очередь операций.
+ *
+ * @note Все записи адресуются смещением в байтах (как pwrite), текущей позиции нет.
+ * Данные записей берутся из буферов пула (ioAcquire): при асинхронной записи буфер
+ * освобождается только после завершения всех операций, которые его используют.
+ */
+typedef struct ImageIO ImageIO;
+
+/**
+ * @brief Ресурсы записи, переживающие образ: кольцо io_uring и буферы пула.
+ *
+ * @note Принадлежит одному потоку (например, потоку сервиса, см. uefi_serve.h): closeImageIO
+ * возвращает в него кольцо и буферы, следующий openImageIO того же потока берёт их вместо
+ * io_uring_setup, mmap и posix_memalign. Буферы остаются в памяти (IoDepth * 1 MiB).
+ */
+typedef struct IOCache IOCache;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Путь "-" означает потоковую запись образа в stdout.
+ */
+static inline bool isImageStream(const char *path)
+{
+    return path[0] == '-' && path[1] == '\0';
+}
+
+/**
+ * @brief Определяет, является ли путь блочным устройством, и запрашивает его размеры блоков.
+ *
+ * @param path Путь к файлу образа или устройству (может не существовать).
+ * @param target Указатель на структуру для результата.
+ *
+ * @return false, если устройство не удалось опросить (с сообщением в stderr), иначе true.
+ */
+bool probeImageTarget(const char *path, ImageTarget *target);
+
+/**
+ * @brief Создаёт пустой кэш ресурсов записи.
+ *
+ * @return Кэш или NULL, если не хватило памяти.
+ */
+IOCache *newIOCache(void);
+
+/**
+ * @brief Освобождает кэш: закрывает кольцо io_uring и освобождает буферы.
+ */
+void freeIOCache(IOCache *cache);
+
+/**
+ * @brief Открывает (создаёт или усекает) файл образа для записи.
+ *
+ * @param ctx Контекст образа: ImageName (путь к файлу или блочному устройству), Format
+ * (qcow2 - только для файла), IoBackend (AUTO - io_uring с откатом на синхронную),
+ * IoDepth (глубина очереди и число буферов пула, 0 - IO_DEFAULT_DEPTH), LbaSize и Sparse.
+ * Кольцо и буферы берутся из IoCache, если они там есть и подходят по глубине и размеру.
+ *
+ * @return Открытый образ или NULL (с сообщением в stderr).
+ *
+ * @note Блочное устройство открывается с O_DIRECT | O_EXCL (занятое или смонтированное
+ * устройство не открывается) и записывается на месте, минуя кэш страниц. Буферы пула тогда
+ * выровнены по физическому блоку, их размер кратен оптимальному размеру запроса устройства,
+ * а все смещения и длины записей должны быть кратны LbaSize (ioCopy дополняет последний
+ * блок файла нулями). При закрытии кэш записи устройства сбрасывается (fsync) и ядро
+ * перечитывает таблицу разделов.
+ *
+ * @note Путь "-" - потоковый режим: stdout (канал, ssh, компрессор) не поддерживает
+ * смещений, поэтому записи только планируются (данные метаданных копируются в память,
+ * для данных файлов запоминаются дескриптор и диапазон), а в closeImageIO выводятся
+ * строго по возрастанию смещения, с промежутками из нулей до размера из ioResize.
+ * Формат - только raw, запись всегда синхронная.
+ *
+ * @note В qcow2 все смещения записей - виртуальные смещения диска. Кластеры файла выделяются
+ * только под записанные данные, таблицы L1/L2 и счётчики ссылок дописываются в closeImageIO.
+ */
+ImageIO *openImageIO(const ImageContext *ctx);
+
+/**
+ * @brief Дожидается всех операций и закрывает образ.
+ *
+ * @note Простаивающее кольцо и буферы пула возвращаются в IoCache контекста, если он задан.
+ *
+ * @return true, если все записи с момента открытия выполнены успешно, иначе false.
+ */
+bool closeImageIO(ImageIO *io);
+
+/**
+ * @brief Задаёт размер диска: ftruncate для raw, виртуальный размер для qcow2.
+ *
+ * @return true, если размер установлен, иначе false.
+ */
+bool ioResize(ImageIO *io, uint64_t size);
+
+/**
+ * @brief Название используемой реализации записи ("sync" или "io_uring").
+ */
+const char *ioBackendName(const ImageIO *io);
+
+/**
+ * @brief Пропускаются ли нулевые области образа: Sparse контекста, а также всегда для qcow2
+ * и потока (их нули не нужно записывать).
+ */
+bool ioSparse(const ImageIO *io);
+
+/**
+ * @brief Берёт свободный буфер из пула, при необходимости дожидаясь завершения операций.
+ *
+ * @param io Образ.
+ * @param size Нужный размер (IO_BUFFER_SIZE помещается всегда).
+ *
+ * @return Буфер (выровнен по 4096 байт) или NULL при ошибке.
+ *
+ * @note Буфер принадлежит вызывающему до ioRelease. Его можно передать в ioSubmit
+ * несколько раз (например, одна и та же порция FAT во все её копии).
+ */
+void *ioAcquire(ImageIO *io, size_t size);
+
+/**
+ * @brief Ставит в очередь запись len байт буфера по смещению offset.
+ *
+ * @return false, если запись невозможна или одна из предыдущих операций завершилась с ошибкой.
+ *
+ * @note Содержимое буфера нельзя менять после первого ioSubmit.
+ */
+bool ioSubmit(ImageIO *io, void *buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Возвращает буфер в пул после завершения поставленных с ним операций.
+ */
+void ioRelease(ImageIO *io, void *buf);
+
+/**
+ * @brief Записывает копию данных (ioAcquire + memcpy + ioSubmit + ioRelease).
+ */
+bool ioWrite(ImageIO *io, const void *data, size_t len, uint64_t offset);
+
+/**
+ * @brief Записывает данные в логический блок lba, дополняя их нулями до конца блока.
+ */
+bool ioWriteLBA(ImageIO *io, const void *data, size_t len, uint64_t lba);
+
+/**
+ * @brief Копирует len байт файла in (с inOffset) в образ по смещению outOffset.
+ *
+ * @note Синхронная реализация использует copy_file_range (см. copyRangeToImage),
+ * io_uring - связанные пары чтения и записи через буферы пула. Для устройства с O_DIRECT
+ * данные всегда идут через буферы пула. Дескриптор in можно закрыть сразу после вызова.
+ */
+bool ioCopy(ImageIO *io, int in, uint64_t inOffset, uint64_t outOffset, uint64_t len);
+
+/**
+ * @brief Копирует большой диапазон файла in в образ без участия буферов пула.
+ *
+ * @note Для файла raw сначала пробуется reflink (ioctl FICLONERANGE, смещения выровнены
+ * по блокам файловой системы), затем copy_file_range/sendfile/pread+pwrite при любой
+ * реализации записи - данные не проходят через пользовательскую память, если ядро может
+ * их скопировать само. Для потока, qcow2 и устройства с O_DIRECT - то же, что ioCopy.
+ */
+bool ioClone(ImageIO *io, int in, uint64_t inOffset, uint64_t outOffset, uint64_t len);
+
+/**
+ * @brief Дожидается завершения всех поставленных операций.
+ *
+ * @return true, если все операции с момента открытия выполнены успешно, иначе false.
+ */
+bool ioFlush(ImageIO *io);
+
+#endif
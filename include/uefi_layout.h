@@ -0,0 +1,109 @@
+#ifndef __UEFI_IMAGE_CREATOR__LAYOUT_H__
+#define __UEFI_IMAGE_CREATOR__LAYOUT_H__
+
+#include <uchar.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+#include <uefi_gpt.h>
+#include <uefi_io.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+/**
+ * @brief Описание одного раздела, задаваемое пользователем.
+ *
+ * @param Type GUID типа раздела.
+ * @param Size Размер раздела в байтах, 0 - "остаток диска" (не больше одного такого раздела).
+ * @param Attributes Атрибуты записи GPT.
+ * @param Name Имя раздела (UTF-16, до 35 символов).
+ * @param Source Файл или блочное устройство хоста, копируемое в начало раздела (NULL - нет).
+ */
+struct PartitionSpec {
+
+    Guid        Type;
+    uint64_t    Size;
+    uint64_t    Attributes;
+    char16_t    Name[36];
+    const char *Source;
+
+};
+
+typedef struct PartitionSpec PartitionSpec;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Разбирает описание раздела вида "ТИП:РАЗМЕР[:ИМЯ[:АТРИБУТЫ]][=ФАЙЛ]".
+ *
+ * @param str Строка описания, например "esp:64M", "linux-root-x86-64:2G:root-a:0x4",
+ * "home:rest", "linux-root-x86-64:auto:root-a=rootfs.img". Строка должна жить, пока
+ * используется описание: Source указывает в неё.
+ * @param part Указатель на структуру для результата.
+ *
+ * @return true, если строка корректна, иначе false (с сообщением в stderr).
+ *
+ * @note ТИП - псевдоним (esp, data, linux, linux-root-x86-64, linux-root-arm64,
+ * linux-usr-x86-64, linux-usr-arm64, swap, home, srv, var, bios-boot) или GUID вида
+ * XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX. РАЗМЕР - как в parseSize, либо "rest" для раздела,
+ * занимающего остаток диска. Без ИМЕНИ используется имя по умолчанию для псевдонима.
+ *
+ * @note ФАЙЛ (всё после первого '=') - образ файловой системы или блочное устройство,
+ * которым заполняется раздел (не ESP: её заполняет esp-dir). РАЗМЕР "auto" - размер ФАЙЛА
+ * на момент разбора.
+ */
+bool parsePartitionSpec(const char *str, PartitionSpec *part);
+
+/**
+ * @brief Размещает разделы образа и заполняет массив записей GPT.
+ *
+ * @param ctx Контекст образа; UniquePartitionGUID берутся из его генератора.
+ * @param table Массив записей (NUMBER_OF_GPT_TABLE_ENTRIES), неиспользуемые записи обнуляются.
+ *
+ * @return true, если разделы помещаются на диск, а файлы Source - в свои разделы, иначе false
+ * (с сообщением в stderr).
+ *
+ * @details Разделы берутся из Partitions/PartitionCount, а если их нет - стандартная пара
+ * ESP (EspSize) + Basic Data (DataSize). Каждый раздел начинается с границы ALIGNMENT,
+ * в порядке описания. Если задан DiskSize, размер образа равен ему, и раздел "rest"
+ * получает всё оставшееся место (в середине списка - с округлением вниз до ALIGNMENT,
+ * чтобы следующие разделы остались выровненными). Без DiskSize образ заканчивается
+ * на границе ALIGNMENT после последнего раздела и резервной таблицы GPT.
+ *
+ * @note Вычисляет поля контекста GptTableLBAs, AlignLBA, ImageSizeLBAs, ImageSize, а также
+ * EspLBA и EspSizeLBAs по первому разделу типа EFI_GUID (0, если такого раздела нет).
+ * Массив один и тот же для основной и резервной таблиц GPT.
+ */
+bool planLayout(ImageContext *ctx, GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]);
+
+/**
+ * @brief Файл, которым заполняется раздел.
+ *
+ * @param ctx Контекст образа.
+ * @param index Номер раздела в разметке (с 0).
+ *
+ * @return Source раздела (для стандартной пары - DataSource) или NULL.
+ */
+const char *partitionSource(const ImageContext *ctx, size_t index);
+
+/**
+ * @brief Копирует файлы Source разделов в размещённые planLayout разделы.
+ *
+ * @param ctx Контекст образа.
+ * @param io Образ, открытый для записи.
+ * @param table Массив записей от planLayout.
+ *
+ * @return true, если все файлы поставлены в очередь записи, иначе false (с сообщением в stderr).
+ *
+ * @note Стандартная пара берёт Source раздела данных из DataSource. Файл больше раздела -
+ * ошибка; остаток раздела за файлом не записывается. Копирование - copyPayloadToImage.
+ */
+bool writePartitionPayloads(const ImageContext *ctx, ImageIO *io,
+                            const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <config.h>
 #include <uefi_lba.h>
+#include <uefi_io.h>
 
 // ----------------
 // Global Typedefs
@@ -66,17 +67,18 @@ typedef struct {
 /**
  * @brief Записывает Master Boot Record (MBR) в файл образа.
  * 
- * @param image Указатель на файл образа, в который будет записан MBR.
+ * @param ctx Контекст образа с разметкой от planLayout (ImageSizeLBAs).
+ * @param io Образ, в который будет записан MBR.
  * 
  * @return true, если запись прошла успешно, иначе false.
  * 
  * @note Функция создает структуру MBR с защитным GPT-разделом и записывает её в файл образа.
  * Если размер образа в LBA превышает 0xFFFFFFFF, то он ограничивается этим значением.
- * Затем функция заполняет оставшееся пространство до конца LBA нулевыми байтами, вызывая `writeFullLBASize`.
+ * MBR занимает весь LBA 0, остаток блока заполняется нулями (ioWriteLBA).
  * 
  * @note Перед вызовом этой функции необходимо открыть файл образа для записи.
  * 
  */
-bool writeMBR(FILE *image);
+bool writeMBR(const ImageContext *ctx, ImageIO *io);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+#ifndef __UEFI_IMAGE_CREATOR__QCOW2_H__
+#define __UEFI_IMAGE_CREATOR__QCOW2_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+enum {
+    QCOW2_MAGIC = 0x514649FB,           // "QFI\xfb"
+    QCOW2_VERSION = 3,
+    QCOW2_CLUSTER_BITS = 16,            // Кластер 64 KiB, как у qemu-img по умолчанию
+    QCOW2_CLUSTER_SIZE = 1 << QCOW2_CLUSTER_BITS,
+    QCOW2_REFCOUNT_ORDER = 4,           // 16-битные счётчики ссылок
+};
+
+/**
+ * @brief Заголовок qcow2 (версия 3), все поля в big-endian.
+ *
+ * @param Magic Сигнатура QCOW2_MAGIC.
+ * @param Version Версия формата (3).
+ * @param BackingFileOffset Смещение имени базового образа (0 - нет).
+ * @param BackingFileSize Длина имени базового образа.
+ * @param ClusterBits log2 размера кластера.
+ * @param Size Виртуальный размер диска в байтах.
+ * @param CryptMethod Шифрование (0 - нет).
+ * @param L1Size Число записей таблицы L1.
+ * @param L1TableOffset Смещение таблицы L1 в файле.
+ * @param RefcountTableOffset Смещение таблицы счётчиков ссылок.
+ * @param RefcountTableClusters Размер таблицы счётчиков ссылок в кластерах.
+ * @param NbSnapshots Число снимков (0).
+ * @param SnapshotsOffset Смещение таблицы снимков (0).
+ * @param IncompatibleFeatures Несовместимые возможности (0).
+ * @param CompatibleFeatures Совместимые возможности (0).
+ * @param AutoclearFeatures Автосбрасываемые возможности (0).
+ * @param RefcountOrder log2 ширины счётчика ссылок в битах.
+ * @param HeaderLength Длина этого заголовка (104).
+ */
+typedef struct {
+
+    uint32_t    Magic;
+    uint32_t    Version;
+    uint64_t    BackingFileOffset;
+    uint32_t    BackingFileSize;
+    uint32_t    ClusterBits;
+    uint64_t    Size;
+    uint32_t    CryptMethod;
+    uint32_t    L1Size;
+    uint64_t    L1TableOffset;
+    uint64_t    RefcountTableOffset;
+    uint32_t    RefcountTableClusters;
+    uint32_t    NbSnapshots;
+    uint64_t    SnapshotsOffset;
+    uint64_t    IncompatibleFeatures;
+    uint64_t    CompatibleFeatures;
+    uint64_t    AutoclearFeatures;
+    uint32_t    RefcountOrder;
+    uint32_t    HeaderLength;
+
+} __attribute__((packed)) Qcow2Header;
+
+/**
+ * @brief Отображение виртуальных смещений диска на кластеры файла qcow2.
+ *
+ * @note Кластеры файла выделяются по порядку при первой записи в виртуальный кластер
+ * (кластер 0 - заголовок), поэтому последовательные записи ложатся в файл непрерывно.
+ * Таблицы L2 хранятся в памяти и записываются вместе с L1 и счётчиками ссылок в
+ * writeQcow2Metadata, после всех данных.
+ */
+typedef struct Qcow2Map Qcow2Map;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Создаёт пустое отображение (ни один кластер не выделен).
+ *
+ * @return Отображение или NULL при нехватке памяти.
+ */
+Qcow2Map *newQcow2Map(void);
+
+/**
+ * @brief Освобождает отображение.
+ */
+void freeQcow2Map(Qcow2Map *map);
+
+/**
+ * @brief Задаёт виртуальный размер диска (не меньше наибольшего записанного смещения).
+ */
+void setQcow2Size(Qcow2Map *map, uint64_t size);
+
+/**
+ * @brief Отображает начало виртуального диапазона на непрерывный участок файла.
+ *
+ * @param map Отображение.
+ * @param offset Виртуальное смещение.
+ * @param len Длина диапазона в байтах (больше 0).
+ * @param hostOffset Указатель для смещения участка в файле qcow2.
+ *
+ * @return Длина непрерывного участка (от 1 до len), 0 при нехватке памяти.
+ *
+ * @note Недостающие кластеры выделяются. Новые кластеры в конце файла читаются как нули,
+ * поэтому частичная запись в кластер не требует дописывать его остаток.
+ */
+uint64_t mapQcow2Range(Qcow2Map *map, uint64_t offset, uint64_t len, uint64_t *hostOffset);
+
+/**
+ * @brief Дописывает таблицы L2, L1, счётчики ссылок и записывает заголовок.
+ *
+ * @param map Отображение.
+ * @param fd Дескриптор файла qcow2, все данные которого уже записаны.
+ *
+ * @return true, если метаданные записаны, иначе false.
+ */
+bool writeQcow2Metadata(const Qcow2Map *map, int fd);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __UEFI_IMAGE_CREATOR__RESIZE_H__
+#define __UEFI_IMAGE_CREATOR__RESIZE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Увеличивает существующий образ на месте и переносит резервный GPT в новый конец диска.
+ *
+ * @param path Путь к файлу образа (raw) или к блочному устройству.
+ * @param size Новый размер диска в байтах (округляется вниз до LBA). 0 - размер устройства;
+ * для файла размер обязателен.
+ * @param growLast Расширить последний раздел (с наибольшим EndingLBA) до нового LastUsableLBA.
+ *
+ * @return true, если образ изменён, иначе false (с сообщением в stderr).
+ *
+ * @details
+ * 1. Читает основной заголовок GPT и массив записей (с проверкой CRC); резервный заголовок
+ *    не нужен и при повреждении восстанавливается из основного.
+ * 2. Увеличивает файл через ftruncate: новое место - "дыра", данные не записываются.
+ * 3. Пишет резервный массив записей и резервный заголовок в конец диска, затем fdatasync.
+ * 4. Обновляет основной заголовок (AlternateLBA, LastUsableLBA, CRC), при growLast - и
+ *    основной массив записей, затем SizeInLBA защитного MBR (до 0xFFFFFFFF).
+ * 5. Старое место резервного GPT очищается: в файле - PUNCH_HOLE, на устройстве - нулями.
+ *
+ * @note Пишется несколько секторов и две копии массива записей (по 16 KiB), независимо от
+ * размера образа. Порядок записей такой, что после сбоя на любом шаге основной заголовок
+ * указывает на целый резервный GPT (старый или новый).
+ *
+ * @note Уменьшение образа не поддерживается. Файловая система расширенного раздела не
+ * меняется (для ESP - размер FAT32 прежний), её расширяет resize2fs и т.п.
+ */
+bool resizeImage(const char *path, uint64_t size, bool growLast);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __UEFI_IMAGE_CREATOR__SERVE_H__
+#define __UEFI_IMAGE_CREATOR__SERVE_H__
+
+#include <stdbool.h>
+
+#include <uefi_image.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Сервис сборки: принимает запросы на локальном сокете Unix и собирает образы,
+ * пока процесс не получит SIGINT или SIGTERM.
+ *
+ * @param base Контекст со значениями по умолчанию для запросов (флаги командной строки).
+ * @param socketPath Путь сокета (SOCK_STREAM). Оставшийся от упавшего сервиса сокет
+ * заменяется, занятый другим сервисом - ошибка.
+ * @param jobs Количество потоков (0 - по числу процессоров).
+ *
+ * @return true, если сервис остановлен сигналом, false - если не удалось создать сокет
+ * или потоки (с сообщением в stderr).
+ *
+ * @note Протокол - строки, как в манифесте пакетного режима (см. parseManifestLine):
+ *
+ *     image=/srv/a.img esp-size=64M esp-dir=/srv/stage-a seed=7
+ *
+ * На каждую строку сервис отвечает строкой "OK <образ> <микросекунды>" или "ERROR <образ>"
+ * (подробности - в stderr сервиса); пустые строки и строки с '#' пропускаются. В одном
+ * соединении можно отправить сколько угодно строк, ответы приходят в том же порядке.
+ *
+ * @note Вместо image= клиент может передать дескриптор открытого файла или устройства
+ * (SCM_RIGHTS, вместе с байтами строки): строка без image= пишет образ в следующий
+ * полученный дескриптор (через /proc/self/fd), после сборки он закрывается. Ответ на такую
+ * строку - "OK fd <микросекунды>" или "ERROR fd". Дескриптор должен быть обычным файлом или
+ * блочным устройством: сборка меняет размер образа и пишет не по порядку, канал (pipe) или
+ * сокет отклоняется.
+ *
+ * @note Каждый поток обслуживает одно соединение за раз и держит свой IOCache: кольцо
+ * io_uring и буферы пула создаются один раз на поток, а не на образ. Таблицы CRC32 и
+ * шаблоны VBR/FSInfo - константные данные процесса. Содержимое esp-dir читается заново
+ * для каждого запроса, файлы хоста между запросами могут меняться.
+ */
+bool serveImages(const ImageContext *base, const char *socketPath, unsigned jobs);
+
+#endif
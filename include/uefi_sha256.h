@@ -0,0 +1,82 @@
+#ifndef __UEFI_IMAGE_CREATOR__SHA256_H__
+#define __UEFI_IMAGE_CREATOR__SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+enum {
+    SHA256_BLOCK_SIZE = 64,             // Размер блока сжатия в байтах
+    SHA256_DIGEST_SIZE = 32,            // Размер хэша в байтах
+    SHA256_HEX_SIZE = 65,               // Хэш в шестнадцатеричном виде с завершающим нулём
+};
+
+/**
+ * @brief Состояние потокового вычисления SHA-256 (FIPS 180-4).
+ *
+ * @param State Промежуточное значение хэша H0..H7.
+ * @param Length Число обработанных байт.
+ * @param Block Неполный блок, ожидающий данных.
+ * @param Used Число байт в Block.
+ */
+typedef struct {
+
+    uint32_t    State[8];
+    uint64_t    Length;
+    uint8_t     Block[SHA256_BLOCK_SIZE];
+    size_t      Used;
+
+} Sha256;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Начинает вычисление SHA-256.
+ *
+ * @note Потоковый API, как у CRC32: sha256Init(&ctx); sha256Update(&ctx, ...) для каждого
+ * фрагмента; sha256Final(&ctx, digest).
+ */
+void sha256Init(Sha256 *ctx);
+
+/**
+ * @brief Добавляет фрагмент данных к вычислению SHA-256.
+ *
+ * @param ctx Состояние от sha256Init.
+ * @param buf Указатель на буфер с данными.
+ * @param len Длина буфера в байтах.
+ *
+ * @note Сжатие блоков выбирается один раз во время выполнения по возможностям процессора:
+ * инструкции SHA (x86-64 SHA-NI) или переносимая реализация. Функция потокобезопасна
+ * для разных ctx.
+ */
+void sha256Update(Sha256 *ctx, const void *buf, size_t len);
+
+/**
+ * @brief Завершает вычисление SHA-256.
+ *
+ * @param ctx Состояние после последнего sha256Update.
+ * @param digest Буфер для хэша (SHA256_DIGEST_SIZE байт).
+ */
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * @brief Записывает хэш в шестнадцатеричном виде (строчные буквы).
+ *
+ * @param digest Хэш.
+ * @param hex Буфер для строки (SHA256_HEX_SIZE байт).
+ */
+void sha256Hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+
+/**
+ * @brief Название реализации SHA-256, выбранной для текущего процессора.
+ *
+ * @return "sha-ni" или "portable".
+ */
+const char *sha256Engine(void);
+
+#endif
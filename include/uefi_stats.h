@@ -0,0 +1,100 @@
+#ifndef __UEFI_IMAGE_CREATOR__STATS_H__
+#define __UEFI_IMAGE_CREATOR__STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+/**
+ * @brief Счётчики записи образа текущего потока.
+ *
+ * @param Bytes Байт записано (для io_uring - поставлено в очередь).
+ * @param Writes Системных вызовов записи: pwrite, write, copy_file_range, sendfile, io_uring_enter.
+ * @param Seeks Вызовов lseek (позиция для sendfile, поиск данных SEEK_DATA/SEEK_HOLE).
+ *
+ * @note Счётчики свои у каждого потока, фазы контекста берут их разность: цифры точны,
+ * пока поток собирает один образ за раз (пакетный режим, потоки сервиса).
+ */
+typedef struct {
+
+    uint64_t    Bytes;
+    uint64_t    Writes;
+    uint64_t    Seeks;
+
+} IOCounters;
+
+extern _Thread_local IOCounters ioCounters;   // Растут всегда: одно сложение на системный вызов.
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Учитывает системные вызовы записи и записанные ими байты.
+ */
+static inline void countWrites(uint64_t calls, uint64_t bytes)
+{
+    ioCounters.Writes += calls;
+    ioCounters.Bytes += bytes;
+}
+
+/**
+ * @brief Учитывает вызовы lseek.
+ */
+static inline void countSeeks(uint64_t calls)
+{
+    ioCounters.Seeks += calls;
+}
+
+/**
+ * @brief Начинает фазу сборки образа.
+ *
+ * @param ctx Контекст образа, в котором записываются фазы.
+ * @param name Имя фазы (строка должна жить до statsReport), например "writeESP".
+ *
+ * @note Фазы вложены: каждая statsBegin закрывается statsEnd. Если статистика выключена
+ * (Stats == STATS_OFF и нет файла трассировки), вызов ничего не делает.
+ */
+void statsBegin(ImageContext *ctx, const char *name);
+
+/**
+ * @brief Завершает последнюю начатую фазу: время, счётчики ioCounters и пиковый RSS процесса.
+ *
+ * @note Для io_uring время фазы - время постановки в очередь, записи завершаются в closeImageIO
+ * (своя фаза). Байты и вызовы относятся ко всем открытым фазам сразу.
+ */
+void statsEnd(ImageContext *ctx);
+
+/**
+ * @brief Выводит фазы образа в stderr (таблица или JSON, см. Stats) и добавляет их
+ * в файл трассировки, затем освобождает записанные фазы контекста.
+ *
+ * @param ctx Контекст образа; ImageName - заголовок отчёта.
+ */
+void statsReport(ImageContext *ctx);
+
+/**
+ * @brief Открывает файл трассировки Chrome (trace_event, массив событий "X").
+ *
+ * @param path Путь к файлу.
+ *
+ * @return true, если файл создан, иначе false (с сообщением в stderr).
+ *
+ * @note Один файл на процесс: в пакетном режиме каждый поток пишет свои события (tid -
+ * поток, pid - процесс), время - микросекунды от открытия. Вызывается до запуска потоков.
+ */
+bool openTrace(const char *path);
+
+/**
+ * @brief Дописывает конец массива событий и закрывает файл трассировки.
+ *
+ * @return true, если файл записан без ошибок.
+ */
+bool closeTrace(void);
+
+#endif
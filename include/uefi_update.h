@@ -0,0 +1,74 @@
+#ifndef __UEFI_IMAGE_CREATOR__UPDATE_H__
+#define __UEFI_IMAGE_CREATOR__UPDATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+// Действие над файлом ESP существующего образа
+typedef enum {
+    UPDATE_ADD,         // Добавить файл или заменить существующий
+    UPDATE_DELETE,      // Удалить файл или пустой каталог
+} UpdateAction;
+
+/**
+ * @brief Одна операция изменения ESP существующего образа.
+ *
+ * @param Action Действие (добавить/заменить или удалить).
+ * @param Path Путь внутри ESP, например "/EFI/BOOT/BOOTX64.EFI".
+ * @param HostPath Файл хоста с новым содержимым (только для UPDATE_ADD).
+ */
+typedef struct {
+
+    UpdateAction    Action;
+    const char     *Path;
+    const char     *HostPath;
+
+} UpdateOp;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Изменяет файлы в ESP существующего образа на месте.
+ *
+ * @param path Путь к файлу образа.
+ * @param ops Массив операций, выполняются по порядку.
+ * @param count Количество операций.
+ *
+ * @return true, если все операции выполнены, иначе false.
+ *
+ * @note Образ разбирается так же, как его видит прошивка: защитный MBR, оба заголовка GPT
+ * (с проверкой CRC), запись ESP, VBR и FAT. Записываются только затронутые записи каталогов,
+ * изменённые сектора FAT (во все копии) и кластеры данных изменённых файлов.
+ *
+ * @note Имена пути сравниваются с длинными и короткими именами без учёта регистра. Новые файлы
+ * и каталоги получают записи LFN и короткое имя с хвостом ~N (см. uefi_fatname.h). Каждый
+ * затронутый каталог читается один раз за вызов, дальше поиск идёт по его хэш-индексу имён.
+ *
+ * @note Недостающие каталоги пути создаются. Если новый файл занимает столько же кластеров,
+ * сколько старый, данные пишутся в ту же цепочку и FAT не меняется. Иначе выделяется новая
+ * цепочка, старая освобождается после обновления записи каталога.
+ *
+ * @note Свободное место при открытии собирается из FAT в отсортированный список непрерывных
+ * отрезков. Новая цепочка занимает начало наибольшего отрезка; если такого нет, файл делится
+ * на наименьшее число частей по наибольшим отрезкам. Загрузчики /EFI/BOOT/\*.EFI всегда
+ * непрерывны: фрагментированный загрузчик переносится в один отрезок, а если отрезка нужного
+ * размера нет, операция завершается ошибкой. В обе копии FSInfo записываются точное число
+ * свободных кластеров и первый свободный кластер.
+ *
+ * @note Перед первой записью все операции по порядку проверяются на копии списка свободных
+ * отрезков (файлы хоста, имена, место и непрерывные отрезки для загрузчиков). Если места не
+ * хватает, образ не меняется; иначе ранний --add мог бы занять единственный отрезок, нужный
+ * загрузчику, и обновление остановилось бы на середине.
+ */
+bool updateImage(const char *path, const UpdateOp *ops, size_t count);
+
+#endif
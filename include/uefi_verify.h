@@ -0,0 +1,37 @@
+#ifndef __UEFI_IMAGE_CREATOR__VERIFY_H__
+#define __UEFI_IMAGE_CREATOR__VERIFY_H__
+
+#include <stdbool.h>
+
+#include <config.h>
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Проверяет структуру готового образа, не изменяя его.
+ *
+ * @param path Путь к файлу образа.
+ *
+ * @return true, если ошибок не найдено, иначе false.
+ *
+ * @details Образ отображается в память (mmap, только чтение) и проверяется:
+ * - защитный MBR (сигнатура, запись 0xEE на весь диск);
+ * - основной и резервный заголовки GPT: сигнатуры, HeaderCRC32, MyLBA/AlternateLBA,
+ *   FirstUsableLBA/LastUsableLBA, PartitionEntryArrayCRC32;
+ * - побайтовое совпадение основного и резервного массивов записей разделов;
+ * - границы, выравнивание по ALIGNMENT и отсутствие пересечений разделов;
+ * - для каждого раздела EFI: VBR, FSInfo и их резервные копии (BPB_BkBootSec),
+ *   совпадение всех копий FAT, целостность цепочек кластеров (нет циклов, перекрёстных
+ *   ссылок и потерянных кластеров), длина цепочек по размерам файлов, счётчик FSI_Free_Count.
+ *
+ * @note Сравнение копий FAT, подсчёт ссылок и поиск потерянных кластеров выполняются
+ * параллельно по диапазонам кластеров (по числу процессоров). Обход дерева каталогов
+ * последовательный, но каждый кластер посещается не более одного раза.
+ *
+ * @note Найденные ошибки печатаются в stderr, итог - в stdout.
+ */
+bool verifyImage(const char *path);
+
+#endif
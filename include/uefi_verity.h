@@ -0,0 +1,131 @@
+#ifndef __UEFI_IMAGE_CREATOR__VERITY_H__
+#define __UEFI_IMAGE_CREATOR__VERITY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <config.h>
+#include <uefi_gpt.h>
+#include <uefi_io.h>
+
+// ----------------
+// Global Typedefs
+// ----------------
+
+enum {
+    VERITY_DEFAULT_BLOCK = 4096,        // Размер блока данных и блока хэшей по умолчанию
+    VERITY_MAX_BLOCK = 4096,            // Наибольший блок: dm-verity не берёт блоки больше страницы
+    VERITY_MAX_SALT = 256,              // Наибольшая длина соли в байтах (поле суперблока)
+};
+
+/**
+ * @brief Суперблок dm-verity (формат veritysetup), первый блок области хэшей.
+ *
+ * @param Signature "verity\0\0".
+ * @param Version Версия суперблока (1).
+ * @param HashType Тип хэширования: 1 - соль перед данными блока (0 - Chrome OS, соль после).
+ * @param Uuid Идентификатор дерева.
+ * @param Algorithm Имя хэш-функции ("sha256").
+ * @param DataBlockSize Размер блока данных в байтах.
+ * @param HashBlockSize Размер блока хэшей в байтах.
+ * @param DataBlocks Количество блоков данных.
+ * @param SaltSize Длина соли в байтах.
+ * @param Salt Соль.
+ */
+typedef struct {
+
+    uint8_t     Signature[8];
+    uint32_t    Version;
+    uint32_t    HashType;
+    uint8_t     Uuid[16];
+    char        Algorithm[32];
+    uint32_t    DataBlockSize;
+    uint32_t    HashBlockSize;
+    uint64_t    DataBlocks;
+    uint16_t    SaltSize;
+    uint8_t     Padding1[6];
+    uint8_t     Salt[VERITY_MAX_SALT];
+    uint8_t     Padding2[168];
+
+} __attribute__((packed)) VeritySuperblock;
+
+/**
+ * @brief Дерево хэшей одного раздела, которое строится во время сборки образа.
+ */
+typedef struct VerityJob VerityJob;
+
+// ==========
+// Functions
+// ==========
+
+/**
+ * @brief Проверяет и запоминает соль дерева (--verity-salt).
+ *
+ * @param ctx Контекст образа.
+ * @param hex Соль в шестнадцатеричном виде (до VERITY_MAX_SALT байт), "-" - без соли.
+ *
+ * @return true, если строка корректна, иначе false (с сообщением в stderr).
+ */
+bool setVeritySalt(ImageContext *ctx, char *hex);
+
+/**
+ * @brief Проверяет, что разметка позволяет построить дерево: разделы VerityData и VerityHash
+ * есть, раздел хэшей пуст и вмещает дерево, образ - не поток.
+ *
+ * @param ctx Контекст образа после planLayout.
+ * @param table Массив записей от planLayout.
+ *
+ * @return true, если дерево можно построить, иначе false (с сообщением в stderr).
+ *
+ * @note Вызывается до открытия образа: ошибка в параметрах не должна стирать существующий файл.
+ */
+bool checkVerity(const ImageContext *ctx, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]);
+
+/**
+ * @brief Начинает строить дерево хэшей dm-verity над разделом VerityData.
+ *
+ * @param ctx Контекст образа после planLayout и writeESP.
+ * @param io Образ, открытый для записи.
+ * @param table Массив записей от planLayout.
+ *
+ * @return Задание или NULL (с сообщением в stderr).
+ *
+ * @details Блоки раздела (VerityBlock байт) хэшируются SHA-256 в пуле потоков (по числу
+ * процессоров) - листья дерева, нижний уровень. Данные берутся оттуда же, откуда их
+ * пишет сборка, а не из готового образа:
+ * 1. Раздел с файлом Source - из файла, параллельно с его копированием в образ
+ *    (writePartitionPayloads), остаток раздела - нули.
+ * 2. Раздел без файла - нули: хэш нулевого блока считается один раз.
+ * 3. ESP - после ioFlush читается из образа (он только что записан и лежит в кэше страниц),
+ *    поэтому для ESP нужен образ raw в файле или на устройстве.
+ *
+ * Если образ пишется на блочное устройство, всё, что сборка в раздел не пишет, читается
+ * с устройства: там могут остаться старые данные.
+ *
+ * @note Соль и UUID дерева без --verity-salt берутся из генератора GUID контекста (при
+ * воспроизводимой сборке они тоже воспроизводимы).
+ */
+VerityJob *startVerity(ImageContext *ctx, ImageIO *io, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]);
+
+/**
+ * @brief Дожидается листьев, достраивает верхние уровни и корневой хэш, записывает дерево.
+ *
+ * @param job Задание от startVerity (освобождается).
+ * @param io Образ, открытый для записи.
+ * @param write false - только остановить потоки (сборка уже не удалась).
+ *
+ * @return true, если дерево и корневой хэш записаны, иначе false (с сообщением в stderr).
+ *
+ * @details Область хэшей - как у veritysetup format: суперблок в первом блоке, затем уровни
+ * от верхнего к листьям, каждый хэш - SHA-256(соль || блок), хэши уровня выровнены по блоку.
+ * Она записывается в раздел VerityHash или, если он не задан, в файл "<образ>.verity"
+ * (расширение имени образа заменяется). Корневой хэш (hex) - в файл "<образ>.roothash"
+ * и в stdout, например для:
+ *
+ *     veritysetup open /dev/sda2 root /dev/sda3 $(cat disk.roothash)
+ *
+ * @note Всё дерево держится в памяти: около 1/128 объёма раздела при блоке 4096.
+ */
+bool finishVerity(VerityJob *job, ImageIO *io, bool write);
+
+#endif
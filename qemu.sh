@@ -5,6 +5,9 @@
 # Version 0.0.1
 qemu-system-x86_64 -bios bios64.bin -machine q35 -net none -drive file=test.img,format=raw
 
+# Образ в формате qcow2 (./write_gpt --format qcow2 --image test.qcow2)
+#qemu-system-x86_64 -bios bios64.bin -machine q35 -net none -drive file=test.qcow2,format=qcow2
+
 # qemu-system-x86_64 \: Запускает QEMU для эмуляции 64-битной архитектуры x86.
 # -bios ./bios/bios64.bin \: Указывает файл BIOS для использования (в данном случае bios64.bin из директории ./bios).
 # -m 256M \: Задает количество оперативной памяти для виртуальной машины (256 МБ).
@@ -1,12 +1,69 @@
 #include <config.h>
 
-// Определение и инициализация глобальных переменных
-char *image_name = "test.img";          // Название выходного файла образа диска.
-uint64_t lbaSize = 512;                 // Размер одного логического блока данных.
-uint64_t espSize = 1024 * 1024 * 33;    // Размер раздела EFI System Partition (ESP) в байтах. (33 MiB)
-uint64_t dataSize = 1024 * 1024 * 1;    // Размер раздела данных в байтах. (1 MiB)
-uint64_t imageSize = 0;                 // Общий размер образа диска в байтах. Первоначально инициализируется как 0 и будет рассчитан позже.
-
-// Размер раздела в LBA.
-uint64_t espSizeLBAs = 0, dataSizeLBAs = 0, imageSizeLBAs = 0, gptTableLBAs = 0;
-uint64_t alignLBA = 0, espLBA = 0, dataLBA = 0;
+#include <stdlib.h>
+
+void initImageContext(ImageContext *ctx)
+{
+    *ctx = (ImageContext) {
+        .ImageName = "test.img",                    // Название выходного файла образа диска.
+        .EspDir = NULL,                             // Каталог хоста для заполнения ESP (--esp-dir).
+        .Format = IMAGE_FORMAT_RAW,                 // Образ диска байт в байт (--format).
+        .Sparse = false,                            // Разреженный образ, нулевые области остаются "дырами" (--sparse).
+        .IoBackend = IO_BACKEND_AUTO,               // io_uring, если доступен (--io).
+        .IoDepth = 0,                               // Глубина очереди записи, 0 - IO_DEFAULT_DEPTH (--io-depth).
+        .Reproducible = false,                      // Случайные GUID и текущее время.
+        .Seed = 0,                                  // Начальное значение генератора GUID (--seed).
+        .Epoch = FAT_EPOCH,                         // Время воспроизводимой сборки (SOURCE_DATE_EPOCH).
+        .CacheDir = NULL,                           // Каталог кэша образов (--cache).
+        .Stats = STATS_OFF,                         // Без статистики фаз (--stats).
+        .LbaSize = 512,                             // Размер одного логического блока данных.
+        .EspSize = 1024 * 1024 * 33,                // Размер раздела EFI System Partition (ESP) в байтах. (33 MiB)
+        .DataSize = 1024 * 1024 * 1,                // Размер раздела данных в байтах. (1 MiB)
+        .DataSource = NULL,                         // Содержимое раздела данных (--data-source).
+        .PairOption = NULL,                         // Опции стандартной пары не заданы.
+        .DiskSize = 0,                              // Заданный размер диска (--disk-size), 0 - по размеру разделов.
+        .Partitions = NULL,                         // Разметка диска (--part), NULL - ESP + Basic Data.
+        .PartitionCount = 0,
+        .VerityData = 0,                            // Без дерева хэшей dm-verity (--verity).
+        .VerityHash = 0,
+        .VerityBlock = 4096,                        // Блок данных и хэшей дерева (--verity-block).
+        .VeritySalt = NULL,                         // Соль из генератора GUID (--verity-salt).
+    };
+}
+
+void copyImageContext(ImageContext *dst, const ImageContext *src)
+{
+    initImageContext(dst);
+
+    dst->ImageName = src->ImageName;
+    dst->EspDir = src->EspDir;
+    dst->Format = src->Format;
+    dst->Sparse = src->Sparse;
+    dst->IoBackend = src->IoBackend;
+    dst->IoDepth = src->IoDepth;
+    dst->Reproducible = src->Reproducible;
+    dst->Seed = src->Seed;
+    dst->Epoch = src->Epoch;
+    dst->CacheDir = src->CacheDir;
+    dst->Stats = src->Stats;
+    dst->LbaSize = src->LbaSize;
+    dst->EspSize = src->EspSize;
+    dst->DataSize = src->DataSize;
+    dst->DataSource = src->DataSource;
+    dst->PairOption = src->PairOption;
+    dst->DiskSize = src->DiskSize;
+    dst->Partitions = src->Partitions;
+    dst->PartitionCount = src->PartitionCount;
+    dst->VerityData = src->VerityData;
+    dst->VerityHash = src->VerityHash;
+    dst->VerityBlock = src->VerityBlock;
+    dst->VeritySalt = src->VeritySalt;
+}
+
+void freeImageContext(ImageContext *ctx)
+{
+    if (ctx->OwnsPartitions) free(ctx->Partitions);
+    ctx->Partitions = NULL;
+    ctx->PartitionCount = 0;
+    ctx->OwnsPartitions = false;
+}
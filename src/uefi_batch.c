@@ -0,0 +1,134 @@
+#include <uefi_batch.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+
+    ImageContext   *Images;
+    size_t          Count;
+    atomic_size_t   Next;       // Index of the next image a worker will pick up
+    atomic_size_t   Failed;
+
+} BatchQueue;
+
+bool parseManifestLine(char *line, ImageContext *ctx)
+{
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char *value = strchr(tok, '=');
+        if (value) *value++ = '\0';
+
+        if (!setImageOption(ctx, tok, value)) return false;
+    }
+
+    return true;
+}
+
+static void *batchWorker(void *arg)
+{
+    BatchQueue *queue = arg;
+
+    for (;;) {
+        const size_t i = atomic_fetch_add(&queue->Next, 1);
+        if (i >= queue->Count) break;
+
+        // Each image has a context of its own, nothing is shared between the workers
+        if (!buildImage(&queue->Images[i])) atomic_fetch_add(&queue->Failed, 1);
+    }
+
+    return NULL;
+}
+
+bool runBatch(const ImageContext *base, const char *manifest, unsigned jobs)
+{
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "Error: could not open manifest %s\n", manifest);
+        return false;
+    }
+
+    // Read all specs up front; lines are kept alive, contexts point into them
+    BatchQueue queue = { .Images = NULL, .Count = 0 };
+    char **lines = NULL;
+    size_t lineCount = 0, lineNo = 0;
+    bool ok = true;
+
+    char *line = NULL;
+    size_t cap = 0;
+    while (ok && getline(&line, &cap, file) != -1) {
+        lineNo++;
+
+        const char *p = line + strspn(line, " \t\r\n");
+        if (*p == '\0' || *p == '#') continue;
+
+        char **newLines = realloc(lines, (lineCount + 1) * sizeof *lines);
+        ImageContext *newImages = realloc(queue.Images, (queue.Count + 1) * sizeof *queue.Images);
+        if (newLines) lines = newLines;
+        if (newImages) queue.Images = newImages;
+        if (!newLines || !newImages) {
+            ok = false;
+            break;
+        }
+
+        lines[lineCount++] = line;
+        ImageContext *ctx = &queue.Images[queue.Count++];
+        copyImageContext(ctx, base);
+        ctx->ImageName = NULL;
+
+        const bool parsed = parseManifestLine(line, ctx);
+        if (!parsed || !ctx->ImageName) {
+            fprintf(stderr, "Error: %s:%zu: invalid image spec%s\n", manifest, lineNo,
+                    parsed ? ", image= is required" : "");
+            ok = false;
+        }
+
+        line = NULL;
+        cap = 0;
+    }
+    free(line);
+    fclose(file);
+
+    if (ok) {
+        if (jobs == 0) {
+            const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = cpus > 0 ? (unsigned)cpus : 1;
+        }
+        if (jobs > queue.Count) jobs = queue.Count ? queue.Count : 1;
+
+        atomic_init(&queue.Next, 0);
+        atomic_init(&queue.Failed, 0);
+
+        pthread_t *threads = calloc(jobs, sizeof *threads);
+        unsigned started = 0;
+        if (threads) {
+            for (; started < jobs; started++)
+                if (pthread_create(&threads[started], NULL, batchWorker, &queue) != 0) break;
+        }
+
+        // No worker threads at all: build on this thread
+        if (started == 0) batchWorker(&queue);
+
+        for (unsigned i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+
+        const size_t failed = atomic_load(&queue.Failed);
+        printf("Built %zu of %zu images using %u threads\n", queue.Count - failed, queue.Count,
+               started ? started : 1);
+        ok = failed == 0;
+    }
+
+    for (size_t i = 0; i < queue.Count; i++)
+        freeImageContext(&queue.Images[i]);
+    for (size_t i = 0; i < lineCount; i++)
+        free(lines[i]);
+    free(lines);
+    free(queue.Images);
+
+    return ok;
+}
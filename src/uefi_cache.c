@@ -0,0 +1,238 @@
+#include <uefi_cache.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <uefi_io.h>
+#include <uefi_copy.h>
+#include <uefi_layout.h>
+
+enum {
+    HASH_BUFFER_SIZE = 1024 * 1024,
+};
+
+// Fixed-width little-endian, so the key does not depend on the host
+static void hashU64(Sha256 *sha, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = value >> (8 * i);
+    sha256Update(sha, bytes, sizeof bytes);
+}
+
+static void hashString(Sha256 *sha, const char *str)
+{
+    sha256Update(sha, str, strlen(str) + 1);
+}
+
+void hashImageSpec(const ImageContext *ctx, Sha256 *sha)
+{
+    hashString(sha, "write_gpt image spec 1");
+    hashU64(sha, ctx->LbaSize);
+    hashU64(sha, ctx->EspSize);
+    hashU64(sha, ctx->DataSize);
+    hashU64(sha, ctx->DiskSize);
+    hashU64(sha, ctx->Reproducible);
+    hashU64(sha, ctx->Seed);
+    hashU64(sha, (uint64_t)ctx->Epoch);
+    hashU64(sha, ctx->EspDir != NULL);
+
+    hashU64(sha, ctx->PartitionCount);
+    for (size_t i = 0; i < ctx->PartitionCount; i++) {
+        const PartitionSpec *part = &ctx->Partitions[i];
+        sha256Update(sha, &part->Type, sizeof part->Type);
+        hashU64(sha, part->Size);
+        hashU64(sha, part->Attributes);
+        for (size_t j = 0; j < sizeof part->Name / sizeof part->Name[0]; j++) {
+            const uint8_t name[2] = { part->Name[j] & 0xFF, part->Name[j] >> 8 };
+            sha256Update(sha, name, sizeof name);
+        }
+        if (part->Source) hashString(sha, "source");
+    }
+
+    // Only when used, so specs without payloads keep the GUIDs they always had
+    if (ctx->DataSource) hashString(sha, "data-source");
+
+    // Same for the hash tree: its salt and UUID come from the GUID generator
+    if (ctx->VerityData) {
+        hashString(sha, "verity");
+        hashU64(sha, ctx->VerityData);
+        hashU64(sha, ctx->VerityHash);
+        hashU64(sha, ctx->VerityBlock);
+        if (ctx->VeritySalt) hashString(sha, ctx->VeritySalt);
+    }
+}
+
+uint64_t reproducibleSeed(const ImageContext *ctx)
+{
+    Sha256 sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256Init(&sha);
+    hashImageSpec(ctx, &sha);
+    sha256Final(&sha, digest);
+
+    uint64_t seed = 0;
+    for (int i = 0; i < 8; i++) seed |= (uint64_t)digest[i] << (8 * i);
+    return seed;
+}
+
+static bool hashFile(Sha256 *sha, const char *path, uint8_t *buf)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        return false;
+    }
+
+    ssize_t n;
+    while ((n = read(fd, buf, HASH_BUFFER_SIZE)) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0) sha256Update(sha, buf, n);
+    close(fd);
+
+    if (n < 0) fprintf(stderr, "Error: could not read file %s\n", path);
+    return n == 0;
+}
+
+// Same entries and order as the ESP tree (scanHostDir): regular files and directories by name
+static bool hashHostDir(Sha256 *sha, const char *path, int64_t epoch, uint8_t *buf)
+{
+    struct dirent **list = NULL;
+    const int count = scandir(path, &list, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "Error: could not read directory %s\n", path);
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        const char *name = list[i]->d_name;
+        char child[PATH_MAX];
+        struct stat st;
+
+        if (ok && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+            snprintf(child, sizeof child, "%s/%s", path, name) < (int)sizeof child &&
+            stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            const int64_t mtime = st.st_mtime < epoch ? st.st_mtime : epoch;
+
+            hashString(sha, name);
+            hashU64(sha, S_ISDIR(st.st_mode));
+            hashU64(sha, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0);
+            hashU64(sha, (uint64_t)mtime);
+            ok = S_ISDIR(st.st_mode) ? hashHostDir(sha, child, epoch, buf) : hashFile(sha, child, buf);
+        }
+        free(list[i]);
+    }
+    free(list);
+
+    hashString(sha, "");   // End of directory
+    return ok;
+}
+
+bool imageCacheKey(const ImageContext *ctx, char key[SHA256_HEX_SIZE])
+{
+    uint8_t *buf = malloc(HASH_BUFFER_SIZE);
+    if (!buf) return false;
+
+    Sha256 sha;
+    sha256Init(&sha);
+
+    // Same contents stored differently is a different cache entry, but not a different seed
+    bool ok = hashFile(&sha, "/proc/self/exe", buf);
+    hashImageSpec(ctx, &sha);
+    hashU64(&sha, ctx->Sparse);
+    hashU64(&sha, ctx->Format);
+    if (ok && ctx->EspDir) ok = hashHostDir(&sha, ctx->EspDir, ctx->Epoch, buf);
+
+    // Partition payloads by content, in layout order
+    if (ok && ctx->DataSource && !ctx->PartitionCount) ok = hashFile(&sha, ctx->DataSource, buf);
+    for (size_t i = 0; ok && i < ctx->PartitionCount; i++)
+        if (ctx->Partitions[i].Source) ok = hashFile(&sha, ctx->Partitions[i].Source, buf);
+    free(buf);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256Final(&sha, digest);
+    sha256Hex(digest, key);
+
+    return ok;
+}
+
+// Reflink shares the extents, otherwise the data extents are copied; never a hard link, the image
+// would be the cache entry itself and updating or resizing it would change every later hit
+static const char *placeImage(const char *entry, const char *path)
+{
+    if (unlink(path) != 0 && errno != ENOENT) return NULL;
+
+    const int in = open(entry, O_RDONLY);
+    const int out = in >= 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    const bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0) return NULL;
+
+    if (cloned) return "reflink";
+
+    return cloneFile(entry, path) ? "copy" : NULL;
+}
+
+bool buildCachedImage(ImageContext *ctx, bool (*build)(ImageContext *))
+{
+    const char *cacheDir = ctx->CacheDir;
+    if (!ctx->Reproducible) {
+        fprintf(stderr, "Error: the image cache needs a reproducible build (--seed or SOURCE_DATE_EPOCH)\n");
+        return false;
+    }
+
+    ImageTarget target;
+    if (isImageStream(ctx->ImageName) || !probeImageTarget(ctx->ImageName, &target) || target.IsBlockDevice) {
+        fprintf(stderr, "Error: the image cache needs an image file, not %s\n", ctx->ImageName);
+        return false;
+    }
+
+    char key[SHA256_HEX_SIZE];
+    if (!imageCacheKey(ctx, key)) return false;
+
+    if (mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create cache directory %s\n", cacheDir);
+        return false;
+    }
+
+    char entry[PATH_MAX];
+    if (snprintf(entry, sizeof entry, "%s/%s.img", cacheDir, key) >= (int)sizeof entry) {
+        fprintf(stderr, "Error: cache directory path %s is too long\n", cacheDir);
+        return false;
+    }
+
+    // Miss: build next to the entry, then publish it with one rename
+    const bool hit = access(entry, F_OK) == 0;
+    if (!hit) {
+        char temp[PATH_MAX];
+        snprintf(temp, sizeof temp, "%s/.%s.%d.%d.tmp", cacheDir, key, (int)getpid(), (int)gettid());
+
+        const char *name = ctx->ImageName;
+        ctx->ImageName = temp;
+        const bool built = build(ctx);
+        ctx->ImageName = name;
+
+        if (!built || chmod(temp, 0444) != 0 || rename(temp, entry) != 0) {
+            if (built) fprintf(stderr, "Error: could not add %s to the image cache\n", ctx->ImageName);
+            unlink(temp);
+            return false;
+        }
+    }
+
+    const char *how = placeImage(entry, ctx->ImageName);
+    if (!how) {
+        fprintf(stderr, "Error: could not place cached image %s at %s\n", entry, ctx->ImageName);
+        return false;
+    }
+
+    printf("%s: %s %s (%s)\n", ctx->ImageName, hit ? "cache hit" : "cached as", key, how);
+    return true;
+}
@@ -0,0 +1,109 @@
+#include <uefi_clone.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <uefi_gpt.h>
+#include <uefi_copy.h>
+#include <uefi_fat32.h>
+
+static bool writeHeader(int fd, uint64_t lbaBytes, GptHeader *header)
+{
+    header->HeaderCRC32 = 0;
+    header->HeaderCRC32 = calculateCRC32(header, header->HeaderSize);
+
+    return pwrite(fd, header, header->HeaderSize, header->MyLBA * lbaBytes) == header->HeaderSize;
+}
+
+// New BS_VolID in the VBR of a FAT32 volume and in its backup boot sector
+static bool patchVolumeID(ImageContext *ctx, int fd, uint64_t volumeOffset, uint64_t lbaBytes)
+{
+    Vbr vbr;
+    if (pread(fd, &vbr, sizeof vbr, volumeOffset) != sizeof vbr) return false;
+    if (vbr.BootSecT_Sig != 0xAA55 || memcmp(vbr.BS_FilSysType, "FAT32   ", 8) != 0)
+        return true;   // Not formatted by us, nothing to patch
+
+    const Guid random = new_guid(ctx);
+    const uint64_t field = offsetof(Vbr, BS_VolID);
+
+    if (pwrite(fd, &random.TimeLow, sizeof vbr.BS_VolID, volumeOffset + field) != sizeof vbr.BS_VolID)
+        return false;
+
+    if (vbr.BPB_BkBootSec == 0) return true;
+
+    return pwrite(fd, &random.TimeLow, sizeof vbr.BS_VolID,
+                  volumeOffset + vbr.BPB_BkBootSec * lbaBytes + field) == sizeof vbr.BS_VolID;
+}
+
+bool patchImageIdentity(ImageContext *ctx, const char *path)
+{
+    const int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        return false;
+    }
+
+    const uint64_t lbaBytes = detectImageLBASize(fd);
+    GptHeader primary, backup;
+    uint8_t *array = NULL;
+    size_t arraySize = 0;
+
+    bool ok = lbaBytes && readGptHeader(fd, 1, lbaBytes, &primary) &&
+              readGptHeader(fd, primary.AlternateLBA, lbaBytes, &backup);
+
+    if (ok) {
+        array = readGptEntries(fd, &primary, lbaBytes, &arraySize);
+        ok = array != NULL;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: %s is not a valid GPT image\n", path);
+        free(array);
+        close(fd);
+        return false;
+    }
+
+    // New unique GUID for every used entry; only that field is written, in both entry arrays
+    static const Guid unused = { 0 };
+    const uint64_t field = offsetof(GptPartitionEntry, UniquePartitionGUID);
+
+    for (uint32_t i = 0; ok && i < primary.NumberOfPartitionEntries; i++) {
+        GptPartitionEntry *entry = (GptPartitionEntry *)(array + (size_t)i * primary.SizeOfPartition);
+        if (memcmp(&entry->PartitionTypeGUID, &unused, sizeof unused) == 0) continue;
+
+        entry->UniquePartitionGUID = new_guid(ctx);
+
+        const uint64_t at = (uint64_t)i * primary.SizeOfPartition + field;
+        ok = pwrite(fd, &entry->UniquePartitionGUID, sizeof(Guid), primary.PartitionEntryLBA * lbaBytes + at) == sizeof(Guid) &&
+             pwrite(fd, &entry->UniquePartitionGUID, sizeof(Guid), backup.PartitionEntryLBA * lbaBytes + at) == sizeof(Guid);
+
+        if (ok && memcmp(&entry->PartitionTypeGUID, &EFI_GUID, sizeof EFI_GUID) == 0)
+            ok = patchVolumeID(ctx, fd, entry->StartingLBA * lbaBytes, lbaBytes);
+    }
+
+    // Headers: new disk GUID, CRCs over the patched entry array
+    if (ok) {
+        primary.DiskGuid = new_guid(ctx);
+        backup.DiskGuid = primary.DiskGuid;
+        primary.PartitionEntryArrayCRC32 = calculateCRC32(array, arraySize);
+        backup.PartitionEntryArrayCRC32 = primary.PartitionEntryArrayCRC32;
+
+        ok = writeHeader(fd, lbaBytes, &primary) && writeHeader(fd, lbaBytes, &backup);
+    }
+
+    free(array);
+    if (close(fd) != 0) ok = false;
+
+    if (!ok) fprintf(stderr, "Error: could not patch identity of %s\n", path);
+
+    return ok;
+}
+
+bool cloneImage(ImageContext *ctx, const char *golden, const char *target)
+{
+    return cloneFile(golden, target) && patchImageIdentity(ctx, target);
+}
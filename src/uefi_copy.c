@@ -0,0 +1,180 @@
+#include <uefi_copy.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include <uefi_stats.h>
+
+// Copy len bytes between descriptors at the given offsets, returns bytes left uncopied
+static uint64_t copyRange(int in, int out, off_t inOff, off_t outOff, uint64_t len)
+{
+    uint64_t left = len;
+
+    // 1st choice: in-kernel copy, may become a reflink/server-side copy on supporting filesystems
+    while (left > 0) {
+        const ssize_t n = copy_file_range(in, &inOff, out, &outOff, left, 0);
+        countWrites(1, n > 0 ? n : 0);
+        if (n <= 0) break;
+        left -= n;
+    }
+
+    // 2nd choice: sendfile, writes at the current file position of the image
+    if (left > 0) countSeeks(1);
+    if (left > 0 && lseek(out, outOff, SEEK_SET) == outOff) {
+        while (left > 0) {
+            const ssize_t n = sendfile(out, in, &inOff, left);
+            countWrites(1, n > 0 ? n : 0);
+            if (n <= 0) break;
+            left -= n;
+            outOff += n;
+        }
+    }
+
+    // Last resort: plain buffered copy
+    if (left > 0) {
+        uint8_t buf[65536];
+        while (left > 0) {
+            const size_t chunk = left < sizeof buf ? left : sizeof buf;
+            const ssize_t n = pread(in, buf, chunk, inOff);
+            if (n <= 0) break;
+            countWrites(1, n);
+            if (pwrite(out, buf, n, outOff) != n) break;
+            left -= n;
+            inOff += n;
+            outOff += n;
+        }
+    }
+
+    return left;
+}
+
+// Copy only the data extents of in[0, size) to out at outBase, its holes stay holes
+//   Returns bytes of data left uncopied (0 on success)
+static uint64_t copyExtents(int in, int out, uint64_t outBase, uint64_t size)
+{
+    off_t data = lseek(in, 0, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) return copyRange(in, out, 0, outBase, size);   // No SEEK_DATA support
+
+    uint64_t left = 0;
+    while (left == 0 && data >= 0 && (uint64_t)data < size) {
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > size) hole = size;
+
+        left = copyRange(in, out, data, outBase + data, hole - data);
+        data = lseek(in, hole, SEEK_DATA);
+    }
+
+    return left;
+}
+
+bool copyRangeToImage(int in, int out, uint64_t inOffset, uint64_t outOffset, uint64_t len)
+{
+    return copyRange(in, out, inOffset, outOffset, len) == 0;
+}
+
+// Queue in[0, size) at offset with copy (ioCopy or ioClone); a sparse image only gets the data extents
+static bool copyToImage(ImageIO *io, const char *path, uint64_t offset, uint64_t size,
+                        bool (*copy)(ImageIO *, int, uint64_t, uint64_t, uint64_t))
+{
+    const int in = open(path, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        return false;
+    }
+
+    bool ok = true;
+    const bool sparse = ioSparse(io);
+    off_t data = sparse ? lseek(in, 0, SEEK_DATA) : -1;
+    if (sparse) countSeeks(1);
+
+    if (!sparse || (data < 0 && errno != ENXIO)) {
+        ok = copy(io, in, 0, offset, size);
+    } else {
+        while (ok && data >= 0 && (uint64_t)data < size) {
+            off_t hole = lseek(in, data, SEEK_HOLE);
+            if (hole < 0 || (uint64_t)hole > size) hole = size;
+
+            ok = copy(io, in, data, offset + data, hole - data);
+            data = lseek(in, hole, SEEK_DATA);
+            countSeeks(2);
+        }
+    }
+
+    close(in);
+    return ok;
+}
+
+bool copyFileToImage(ImageIO *io, const char *path, uint64_t offset, uint64_t size)
+{
+    if (!copyToImage(io, path, offset, size, ioCopy)) {
+        fprintf(stderr, "Error: could not copy file %s to image\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool copyPayloadToImage(ImageIO *io, const char *path, uint64_t offset, uint64_t size)
+{
+    if (!copyToImage(io, path, offset, size, ioClone)) {
+        fprintf(stderr, "Error: could not copy payload %s to image\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool hostFileSize(const char *path, uint64_t *size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+        fprintf(stderr, "Error: %s is not a regular file or block device\n", path);
+        return false;
+    }
+
+    *size = st.st_size;
+    if (S_ISREG(st.st_mode)) return true;
+
+    const int fd = open(path, O_RDONLY);
+    const bool ok = fd >= 0 && ioctl(fd, BLKGETSIZE64, size) == 0;
+    if (fd >= 0) close(fd);
+
+    if (!ok) fprintf(stderr, "Error: could not query the size of device %s\n", path);
+    return ok;
+}
+
+bool cloneFile(const char *src, const char *dst)
+{
+    const int in = open(src, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", src);
+        return false;
+    }
+
+    const int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "Error: could not create file %s\n", dst);
+        close(in);
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(in, &st) == 0;
+
+    // Reflink shares every extent with the source, otherwise copy the data extents only
+    if (ok && ioctl(out, FICLONE, in) != 0) {
+        ok = ftruncate(out, st.st_size) == 0 && copyExtents(in, out, 0, st.st_size) == 0;
+    }
+
+    close(in);
+    if (close(out) != 0) ok = false;
+
+    if (!ok) fprintf(stderr, "Error: could not copy %s to %s\n", src, dst);
+
+    return ok;
+}
@@ -0,0 +1,248 @@
+#include <uefi_crc32.h>
+
+#include <string.h>
+#include <stdatomic.h>
+
+#include "uefi_crc32_table.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+typedef uint32_t (*CRC32UpdateFn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// Portable path -------------------------
+
+static uint32_t crc32Bytes(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len--)
+        crc = crc32Table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+// Slicing-by-16, then by-8, for the bulk; byte-at-a-time for the tail
+static uint32_t crc32Slice16(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const uint32_t (*t)[256] = crc32Table;
+
+    while (len >= 16) {
+        const uint32_t a = load32(buf) ^ crc;
+        const uint32_t b = load32(buf + 4);
+        const uint32_t c = load32(buf + 8);
+        const uint32_t d = load32(buf + 12);
+
+        crc = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^ t[12][a >> 24]
+            ^ t[11][b & 0xFF] ^ t[10][(b >> 8) & 0xFF] ^ t[ 9][(b >> 16) & 0xFF] ^ t[ 8][b >> 24]
+            ^ t[ 7][c & 0xFF] ^ t[ 6][(c >> 8) & 0xFF] ^ t[ 5][(c >> 16) & 0xFF] ^ t[ 4][c >> 24]
+            ^ t[ 3][d & 0xFF] ^ t[ 2][(d >> 8) & 0xFF] ^ t[ 1][(d >> 16) & 0xFF] ^ t[ 0][d >> 24];
+
+        buf += 16;
+        len -= 16;
+    }
+
+    if (len >= 8) {
+        const uint32_t a = load32(buf) ^ crc;
+        const uint32_t b = load32(buf + 4);
+
+        crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF] ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+            ^ t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF] ^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    return crc32Bytes(crc, buf, len);
+}
+
+// x86-64: carry-less multiply folding ---
+//   "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel),
+//   bit-reflected constants for polynomial 0x04C11DB7.
+
+#if defined(__x86_64__)
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < 64) return crc32Slice16(crc, buf, len);
+
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+
+    const size_t tail = len & 15;
+    len -= tail;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    // Load the first 64 bytes, mixing in the running CRC
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 x 128 bits in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // Fold the 4 lanes into one 128 bit value
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc32Bytes(crc, buf, tail);
+}
+#endif
+
+// ARMv8: CRC32 instructions -------------
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32Armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof v);
+        crc = __crc32d(crc, v);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32b(crc, *buf++);
+
+    return crc;
+}
+#endif
+
+// Runtime dispatch ----------------------
+
+static CRC32UpdateFn crc32Select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return crc32Pclmul;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32Armv8;
+#endif
+    return crc32Slice16;
+}
+
+static uint32_t crc32Resolve(uint32_t crc, const uint8_t *buf, size_t len);
+
+// Starts at the resolver, which swaps itself out on first use; racing threads pick the same engine
+static _Atomic(CRC32UpdateFn) crc32Impl = crc32Resolve;
+
+static uint32_t crc32Resolve(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const CRC32UpdateFn fn = crc32Select();
+    atomic_store(&crc32Impl, fn);
+    return fn(crc, buf, len);
+}
+
+uint32_t crc32Update(uint32_t crc, const void *buf, size_t len)
+{
+    return atomic_load_explicit(&crc32Impl, memory_order_relaxed)(crc, buf, len);
+}
+
+const char *crc32Engine(void)
+{
+    crc32Update(0, NULL, 0);   // Make sure the engine has been selected
+    const CRC32UpdateFn fn = atomic_load(&crc32Impl);
+
+#if defined(__x86_64__)
+    if (fn == crc32Pclmul) return "pclmul";
+#elif defined(__aarch64__)
+    if (fn == crc32Armv8) return "armv8-crc";
+#endif
+    return fn == crc32Slice16 ? "slice16" : "unknown";
+}
@@ -1,9 +1,28 @@
 #include <uefi_fat32.h>
+#include <uefi_gpt.h>
+#include <uefi_copy.h>
+#include <uefi_fatname.h>
+#include <uefi_stats.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Now, or the fixed build time of a reproducible build
+static time_t buildTime(const ImageContext *ctx)
+{
+    return ctx->Reproducible ? (time_t)ctx->Epoch : time(NULL);
+}
 
-void getFATDirEntTimeDate(uint16_t *inTime, uint16_t *inDate)
+void getFATTimeDateOf(time_t t, bool utc, uint16_t *inTime, uint16_t *inDate)
 {
-    time_t curr_time = time(NULL);
-    struct tm tm = *localtime(&curr_time);
+    // FAT dates start in 1980; reproducible builds do not depend on the host time zone
+    if (t < FAT_EPOCH) t = FAT_EPOCH;
+    struct tm tm;
+    if (utc) gmtime_r(&t, &tm);
+    else              localtime_r(&t, &tm);
 
     // FAT32 needs # of years since 1980, localtime returns tm_year as # years since 1900,
     //   subtract 80 years for correct year value. Also convert month of year from 0-11 to 1-12
@@ -15,193 +34,686 @@ void getFATDirEntTimeDate(uint16_t *inTime, uint16_t *inDate)
     *inTime = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
 }
 
-bool writeESP(FILE *image)
+void getFATDirEntTimeDate(const ImageContext *ctx, uint16_t *inTime, uint16_t *inDate)
 {
-    // Reserved sectors region ----------------
-    // Fill out Volume Boot Record(VBR)
-    const uint8_t reservedSectors = 32;      // FAT32 Count
+    getFATTimeDateOf(buildTime(ctx), ctx->Reproducible, inTime, inDate);
+}
 
-    Vbr vbr =
-    {
+// ESP tree -------------------------------
 
-        .BS_jmpBoot = {   0xEB, 0x00, 0x90 },
-        .BS_OEMName = {   "THISDISK"       },
-        .BPB_BytsPerSec = lbaSize,
-        .BPB_SecPerClus = 1,
-        .BPB_RsvdSecCnt = reservedSectors,
-
-        .BPB_NumFATs = 2,
-        .BPB_RootEntCnt = 0,
-        .BPB_TotSec16 = 0,
-        .BPB_Media = 0xF8,              // "Fixed" non-removable media; Could also be 0xF0 for e.g. flash driver
-        .BPB_FATSz16 = 0,
-        .BPB_SecPerTrk = 0,
-        .BPB_NumHeads = 0,
-        .BPB_HiddSec = espLBA - 1,      // of sectors before this partition/volume
-        .BPB_TotSec32 = espSizeLBAs,    // Size of this volume
-
-        .BPB_FATSz32 = (alignLBA - reservedSectors) / 2,     // Align data region: on aligment value
-        .BPB_ExtFlags = 0,              // Mirrored FATs
-        .BPB_FSVer = 0,
-        .BPB_RootClus = 2,              // Cluster 0 & 1 are reserved; root dir cluster starts at 2
-        .BPB_FSInfo = 1,                // Sector 0 = this Vbr, FS info sector follow it
-        .BPB_BkBootSec = 6,             // 
-        .BPB_Reserved = { 0 },
-        .BS_DrvNum = 0x80,              // 1st hard drive
-        .BS_Reserved1 = 0,
-
-        .BS_BootSig = 0x29,
-        .BS_VolID = {0},
-        .BS_VolLab = {"NO NAME    "},
-        .BS_FilSysType = {"FAT32   "},
-
-        .BootCode = {0},
-        .BootSecT_Sig = 0xAA55              //0xAA55
-    };
+bool toShortName(const char *name, uint8_t shortName[11])
+{
+    static const char special[] = "$%'-_@~`!(){}^#&";
 
-    // Fill out file system info sector
-    FSInfo fsinfo = {
+    const char *dot = strrchr(name, '.');
+    const size_t baseLen = dot ? (size_t)(dot - name) : strlen(name);
+    const size_t extLen = dot ? strlen(dot + 1) : 0;
 
-        .FSI_LeadSigOffset = 0x41615252,
-        .FSI_Reserved1 = {0},
-        .FSI_StrucSig = 0x61417272,
-        .FSI_Free_Count = 0xFFFFFFFF,
-        .FSI_Nxt_Free = 0xFFFFFFFF,
-        .FSI_Reserved2 = {0},
-        .FSI_TrailSig = 0xAA550000
-    };
+    if (baseLen == 0 || baseLen > 8 || extLen > 3 || (dot && extLen == 0)) return false;
 
-    // Write VBR
-    fseek(image, espLBA * lbaSize, SEEK_SET);
-    if(fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr)
-    {
-        fprintf(stderr, "Error: Could not write ESP Volume Boot Record to image\n");
+    memset(shortName, ' ', 11);
+    for (const char *p = name; *p; p++) {
+        if (p == dot) continue;
+
+        const unsigned char c = *p;
+        if (!isalnum(c) && !strchr(special, c)) return false;
+
+        if (dot && p > dot) shortName[8 + (p - dot - 1)] = toupper(c);
+        else                shortName[p - name] = toupper(c);
+    }
+
+    return true;
+}
+
+// New node is put at the front of the parent's list, callers add children in reverse order
+static FAT32_Node *newNode(FAT32_Node *parent, const uint8_t name[11], uint8_t attr, time_t mtime)
+{
+    FAT32_Node *node = calloc(1, sizeof *node);
+    if (!node) return NULL;
+
+    memcpy(node->Name, name, sizeof node->Name);
+    node->Attr = attr;
+    node->MTime = mtime;
+    node->Parent = parent;
+
+    if (parent) {
+        node->Next = parent->Child;
+        parent->Child = node;
+    }
+
+    return node;
+}
+
+static void freeTree(FAT32_Node *node)
+{
+    while (node) {
+        FAT32_Node *next = node->Next;
+        freeTree(node->Child);
+        free(node->HostPath);
+        free(node->LongName);
+        free(node);
+        node = next;
+    }
+}
+
+// Short name, case flags and long name of a node; the short name must already be unique in its directory
+static bool setNodeName(FAT32_Node *node, const FAT32_Name *name)
+{
+    memcpy(node->Name, name->Short, sizeof node->Name);
+    node->NTRes = name->NTRes;
+    if (!name->HasLong) return true;
+
+    node->LongName = malloc(name->LongLen * sizeof *node->LongName);
+    if (!node->LongName) return false;
+    memcpy(node->LongName, name->Long, name->LongLen * sizeof *node->LongName);
+    node->LongLen = name->LongLen;
+
+    return true;
+}
+
+static bool scanHostDir(const ImageContext *ctx, FAT32_Node *dir, const char *path);
+
+static bool addHostEntry(const ImageContext *ctx, FAT32_Node *dir, FAT32_NameIndex *names, const char *dirPath,
+                         const char *name)
+{
+    const size_t len = strlen(dirPath) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (!path) return false;
+    snprintf(path, len, "%s/%s", dirPath, name);
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Error: could not stat %s\n", path);
+        free(path);
         return false;
     }
-    writeFullLBASize(image);
 
-    // Write FSInfo
-    if(fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo)
-    {
-        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Warning: skipping %s, not a regular file or directory\n", path);
+        free(path);
+        return true;
+    }
+
+    // One hash lookup for the name, one per ~N tail tried for the short alias
+    FAT32_Name fatName;
+    if (!makeFatName(name, &fatName)) {
+        fprintf(stderr, "Error: %s is not a valid FAT file name\n", path);
+        free(path);
+        return false;
+    }
+    if (findIndexName(names, &fatName, NULL) || !makeShortAlias(names, &fatName)) {
+        fprintf(stderr, "Error: %s is not unique in its directory, FAT names ignore case\n", path);
+        free(path);
         return false;
     }
-    writeFullLBASize(image);
 
-    // Go to backup boot sector location
-    fseek(image, (espLBA + vbr.BPB_BkBootSec) * lbaSize, SEEK_SET);
+    if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: %s is larger than 4 GiB, too big for FAT32\n", path);
+        free(path);
+        return false;
+    }
 
-    // Write VBR and FSInfo
-    fseek(image, espLBA * lbaSize, SEEK_SET);
-    if(fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr)
-    {
-        fprintf(stderr, "Error: Could not write ESP Volume Boot Record to image\n");
+    FAT32_Node *node = newNode(dir, fatName.Short, S_ISDIR(st.st_mode) ? ATTR_DIRECTORY : ATTR_ARCHIVE, st.st_mtime);
+    if (!node || !setNodeName(node, &fatName) || !addIndexName(names, &fatName, 0)) {
+        free(path);
         return false;
     }
-    writeFullLBASize(image);
+    if (ctx->Reproducible && node->MTime > ctx->Epoch) node->MTime = ctx->Epoch;   // SOURCE_DATE_EPOCH clamps
 
-    // Write FSInfo
-    if(fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo)
-    {
-        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
+    if (S_ISDIR(st.st_mode)) {
+        const bool ok = scanHostDir(ctx, node, path);
+        free(path);
+        return ok;
+    }
+
+    node->HostPath = path;
+    node->Size = st.st_size;
+    return true;
+}
+
+static bool scanHostDir(const ImageContext *ctx, FAT32_Node *dir, const char *path)
+{
+    struct dirent **list = NULL;
+    const int count = scandir(path, &list, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "Error: could not read directory %s\n", path);
         return false;
     }
-    writeFullLBASize(image);
 
-    // FAT32 region ---------------------------
-    // Write FATs(NOTE: Fats will me mirrored)
-    const uint32_t fatLBA = espLBA + vbr.BPB_RsvdSecCnt;
-    for(uint8_t i = 0; i < vbr.BPB_NumFATs; ++i)
-    {
-        fseek(image, (fatLBA + i *vbr.BPB_FATSz32) * lbaSize, SEEK_SET);
+    // Walk forwards so ~N tails follow name order; newNode() prepends, so the list is reversed after
+    FAT32_NameIndex *names = newNameIndex();
+    bool ok = names != NULL;
+    for (int i = 0; i < count; i++) {
+        const char *name = list[i]->d_name;
+        if (ok && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            ok = addHostEntry(ctx, dir, names, path, name);
+        free(list[i]);
+    }
+    free(list);
+    freeNameIndex(names);
+
+    FAT32_Node *sorted = NULL;
+    while (dir->Child) {
+        FAT32_Node *child = dir->Child;
+        dir->Child = child->Next;
+        child->Next = sorted;
+        sorted = child;
+    }
+    dir->Child = sorted;
+
+    return ok;
+}
+
+// Default tree when no host directory is given: '/EFI/BOOT'
+static bool buildSkeleton(const ImageContext *ctx, FAT32_Node *root)
+{
+    FAT32_Node *efi = newNode(root, (const uint8_t *)"EFI        ", ATTR_DIRECTORY, buildTime(ctx));
+    return efi && newNode(efi, (const uint8_t *)"BOOT       ", ATTR_DIRECTORY, buildTime(ctx));
+}
+
+// Clusters are handed out in pre-order, the same order the FAT is written in,
+//   so every chain is contiguous and FAT entries can be written front to back
+static bool allocateClusters(FAT32_Node *node, uint64_t *nextCluster, uint64_t lastCluster,
+                             uint32_t clusterSize)
+{
+    if (node->Attr & ATTR_DIRECTORY) {
+        uint64_t entries = node->Parent ? 2 : 0;   // '.' and '..', root has neither
+        for (const FAT32_Node *child = node->Child; child; child = child->Next)
+            entries += 1 + (child->LongLen + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+
+        if (entries > FAT_DIR_MAX_ENTRIES) {
+            fprintf(stderr, "Error: directory %.11s has more than %u entries\n",
+                    node->Parent ? (const char *)node->Name : "/", FAT_DIR_MAX_ENTRIES);
+            return false;
+        }
+
+        // Whole clusters, at least one: an empty directory still needs its end marker
+        const uint64_t bytes = entries * sizeof(FAT32_DirEntryShort);
+        node->ClusterCount = bytes ? (bytes + clusterSize - 1) / clusterSize : 1;
+    } else {
+        node->ClusterCount = ((uint64_t)node->Size + clusterSize - 1) / clusterSize;
+    }
+
+    if (node->ClusterCount > 0) {
+        if (*nextCluster + node->ClusterCount - 1 > lastCluster) {
+            fprintf(stderr, "Error: ESP is too small, out of clusters at %.11s\n", node->Name);
+            return false;
+        }
+        node->FirstCluster = *nextCluster;
+        *nextCluster += node->ClusterCount;
+    }
 
-        uint32_t cluster = 0; 
+    for (FAT32_Node *child = node->Child; child; child = child->Next)
+        if (!allocateClusters(child, nextCluster, lastCluster, clusterSize)) return false;
 
-        // Cluster 0; FAT identifier, lowest 8 bits are the media type/byte
-        cluster = 0xFFFFFF00 | vbr.BPB_Media;
-        fwrite(&cluster, sizeof cluster, 1, image);
+    return true;
+}
 
-        // Cluster 1; End of Chain (EOC) marker
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+// FAT generation ------------------------
+// The FAT is produced in fixed size chunks from a sorted list of extents, so memory does not
+//   grow with the volume: one chunk buffer plus one extent per allocated run of clusters
 
-        // Cluster 2; Root dir '/' cluster start, if end of file/dir data then write EOC marker
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+enum {
+    FAT_CHUNK_ENTRIES = 256 * 1024,     // 1 MiB of FAT per write
+    FAT32_MIN_CLUSTERS = 65525,         // Fewer clusters make the volume FAT12/16 by definition
+};
 
-        // Cluster 3; '/EFI' dir cluster
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+// Run of consecutive clusters of one chain; the last entry points at Next (EOC at the end of the chain)
+typedef struct {
 
-        // Cluster 4; '/EFI/BOOT' dir cluster
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+    uint32_t    First;
+    uint32_t    Count;
+    uint32_t    Next;
 
-        // Cluster 5+; Other files/directories...
-        // e.g. if adding a file with a size = 5 sectors/clusters
-        //cluster = 6;    // Point to next cluster containing file data
-        //cluster = 7;    // Point to next cluster containing file data
-        //cluster = 8;    // Point to next cluster containing file data
-        //cluster = 9;    // Point to next cluster containing file data
-        //cluster = 0xFFFFFFFF; // EOC marker, no more file data after this cluster
+} FAT32_Extent;
+
+typedef struct {
+
+    FAT32_Extent   *Items;
+    size_t          Count;
+    size_t          Capacity;
+
+} FAT32_ExtentList;
+
+static bool collectExtents(const FAT32_Node *node, FAT32_ExtentList *list)
+{
+    if (node->ClusterCount > 0) {
+        if (list->Count == list->Capacity) {
+            const size_t capacity = list->Capacity ? list->Capacity * 2 : 64;
+            FAT32_Extent *items = realloc(list->Items, capacity * sizeof *items);
+            if (!items) return false;
+            list->Items = items;
+            list->Capacity = capacity;
+        }
+        list->Items[list->Count++] = (FAT32_Extent){ node->FirstCluster, node->ClusterCount, 0xFFFFFFFF };
     }
 
-    // Data region ----------------------------
-    // Write File/Dir Data...
-    const int32_t dataLBA = fatLBA + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
-    fseek(image, dataLBA * lbaSize, SEEK_SET);
+    for (const FAT32_Node *child = node->Child; child; child = child->Next)
+        if (!collectExtents(child, list)) return false;
+
+    return true;
+}
+
+static int compareExtents(const void *a, const void *b)
+{
+    const FAT32_Extent *x = a, *y = b;
+    return (x->First > y->First) - (x->First < y->First);
+}
+
+// Write every FAT copy chunk by chunk from the same buffer. Chunks without a single used entry
+//   stay holes in a sparse image and are written as zeros otherwise (stale data on the target)
+static bool writeFAT(ImageIO *io, const Vbr *vbr, uint64_t fatLBA, FAT32_ExtentList *list)
+{
+    qsort(list->Items, list->Count, sizeof *list->Items, compareExtents);
+
+    const uint64_t lbaSize = vbr->BPB_BytsPerSec;
+    const uint64_t fatBytes = (uint64_t)vbr->BPB_FATSz32 * lbaSize;
+    const bool sparse = ioSparse(io);
+    const uint64_t fatEntries = fatBytes / sizeof(uint32_t);
+    size_t first = 0;   // First extent that may still reach into the current chunk
+    bool ok = true;
+
+    for (uint64_t base = 0; ok && base < fatEntries; base += FAT_CHUNK_ENTRIES) {
+        const uint64_t end = base + FAT_CHUNK_ENTRIES < fatEntries ? base + FAT_CHUNK_ENTRIES : fatEntries;
+        bool used = base == 0;
+
+        // Each chunk gets its own pool buffer, so the writes of one chunk overlap the generation of the next
+        uint32_t *chunk = ioAcquire(io, (end - base) * sizeof *chunk);
+        if (!chunk) return false;
+        memset(chunk, 0, (end - base) * sizeof *chunk);
+
+        if (base == 0) {
+            chunk[0] = 0xFFFFFF00 | vbr->BPB_Media;    // Cluster 0; FAT identifier, lowest 8 bits are the media type
+            chunk[1] = 0xFFFFFFFF;                      // Cluster 1; End of Chain (EOC) marker
+        }
+
+        // Cluster 2+; each entry of an extent points at the following cluster, e.g. a file of 5
+        //   clusters starting at 6 is 7, 8, 9, 10, EOC. Plain increasing stores, vectorized by the compiler
+        while (first < list->Count && (uint64_t)list->Items[first].First + list->Items[first].Count <= base) first++;
+        for (size_t i = first; i < list->Count && list->Items[i].First < end; i++) {
+            const FAT32_Extent *extent = &list->Items[i];
+            const uint64_t extentEnd = (uint64_t)extent->First + extent->Count;
+            const uint64_t from = extent->First > base ? extent->First : base;
+            const uint64_t to = extentEnd < end ? extentEnd : end;
+
+            uint32_t *out = chunk + (from - base);
+            for (uint64_t c = from; c < to; c++) *out++ = (uint32_t)c + 1;
+            if (to == extentEnd) chunk[to - 1 - base] = extent->Next;
+            used = true;
+        }
+
+        const size_t len = (end - base) * sizeof *chunk;
+        for (uint8_t i = 0; ok && (used || !sparse) && i < vbr->BPB_NumFATs; i++)
+            ok = ioSubmit(io, chunk, len, fatLBA * lbaSize + i * fatBytes + base * sizeof *chunk);
+
+        ioRelease(io, chunk);
+    }
+
+    return ok;
+}
+
+static FAT32_DirEntryShort makeDirEntry(const ImageContext *ctx, const FAT32_Node *node, const char *name,
+                                        uint32_t cluster)
+{
+    uint16_t writeTime = 0, writeDate = 0;
+    getFATTimeDateOf(node->MTime, ctx->Reproducible, &writeTime, &writeDate);
 
-    // Root '/' Directory.
-    // /EFI Directory
     FAT32_DirEntryShort dirEnt = {
-        .DIR_Name = { "EFI        " },
-        .DIR_Attr = ATTR_DIRECTORY,
-        .DIR_NTRes = 0,
+        .DIR_Attr = node->Attr,
+        .DIR_NTRes = node->NTRes,
         .DIR_CrtTimeTenth = 0,
-        .DIR_CrtTime = 0,
-        .DIR_CrtDate = 0,
-        .DIR_LstAccDate = 0,
-        .DIR_FstClusHI = 0,
-        .DIR_WrtTime = 0,
-        .DIR_WrtDate = 0,
-        .DIR_FstClusLO = 3,
-        .DIR_FileSize = 0,  // Directories have 0 file size
+        .DIR_CrtTime = writeTime,
+        .DIR_CrtDate = writeDate,
+        .DIR_LstAccDate = writeDate,
+        .DIR_FstClusHI = cluster >> 16,
+        .DIR_WrtTime = writeTime,
+        .DIR_WrtDate = writeDate,
+        .DIR_FstClusLO = cluster & 0xFFFF,
+        .DIR_FileSize = (node->Attr & ATTR_DIRECTORY) ? 0 : node->Size,  // Directories have 0 file size
     };
+    memcpy(dirEnt.DIR_Name, name, sizeof dirEnt.DIR_Name);
 
-    uint16_t createTime = 0, createDate = 0;
-    getFATDirEntTimeDate(&createTime, &createDate);
+    return dirEnt;
+}
 
-    dirEnt.DIR_CrtTime = createTime;
-    dirEnt.DIR_CrtDate = createDate;
-    dirEnt.DIR_WrtTime = createTime;
-    dirEnt.DIR_WrtDate = createDate;
+// LFN entries of a node, straight before its short entry
+static size_t makeNodeLongEntries(const FAT32_Node *node, FAT32_DirEntryLong *entries)
+{
+    if (!node->LongName) return 0;
 
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+    FAT32_Name name = { .LongLen = node->LongLen, .HasLong = true };
+    memcpy(name.Long, node->LongName, node->LongLen * sizeof *node->LongName);
+    memcpy(name.Short, node->Name, sizeof name.Short);
 
-    // EFI Directory entries
+    return makeLongEntries(&name, entries);
+}
 
-    fseek(image, (dataLBA + 1) * lbaSize, SEEK_SET);
+// Directory entries streamed into pool buffers of whole clusters. LFN runs may cross a buffer
+//   boundary like they cross clusters on disk: the entries of a directory are one contiguous array
+typedef struct {
 
-    memcpy(dirEnt.DIR_Name, ".          ", 11);     //  "." entry, this directory itself 
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+    ImageIO                *Io;
+    FAT32_DirEntryShort    *Entries;
+    size_t                  Count;
+    size_t                  PerBuffer;
+    uint32_t                ClusterSize;
+    uint64_t                Offset;
 
-    memcpy(dirEnt.DIR_Name, "..         ", 11);     // ".." dir entry, parent dir (ROOT)
-    dirEnt.DIR_FstClusLO = 0;                       // Root directory does not have a cluster value
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+} DirWriter;
 
-    memcpy(dirEnt.DIR_Name, "BOOT       ", 11); // /EFI/BOOT directory
-    dirEnt.DIR_FstClusLO = 4;                   // /EFI/BOOT cluster
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+// Queue the buffer; the last one is padded with zeros to its cluster end, so the entry after
+//   the last name is an end marker whatever the target held before
+static bool flushDirEntries(DirWriter *w)
+{
+    const size_t used = w->Count * sizeof *w->Entries;
+    const size_t len = used ? (used + w->ClusterSize - 1) / w->ClusterSize * w->ClusterSize : w->ClusterSize;
+    memset((uint8_t *)w->Entries + used, 0, len - used);
 
-    // /EFI/BOOT Directory entries
-    fseek(image, (dataLBA + 2) * lbaSize, SEEK_SET);
+    const bool ok = ioSubmit(w->Io, w->Entries, len, w->Offset);
+    ioRelease(w->Io, w->Entries);
+    w->Entries = NULL;
+    w->Offset += len;
+    w->Count = 0;
 
-    memcpy(dirEnt.DIR_Name, ".          ", 11);
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+    return ok;
+}
+
+static bool putDirEntries(DirWriter *w, const FAT32_DirEntryShort *entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (!w->Entries && !(w->Entries = ioAcquire(w->Io, w->PerBuffer * sizeof *w->Entries))) return false;
 
-    memcpy(dirEnt.DIR_Name, "..         ", 11); // ".." dir entry, parent dir (/EFI dir)
-    dirEnt.DIR_FstClusLO = 3;                  // /EFI directory cluster
-    fwrite(&dirEnt, sizeof dirEnt, 1, image);
+        w->Entries[w->Count++] = entries[i];
+        if (w->Count == w->PerBuffer && !flushDirEntries(w)) return false;
+    }
 
     return true;
 }
+
+static bool writeDirEntries(const ImageContext *ctx, ImageIO *io, const FAT32_Node *node, uint64_t offset,
+                            uint32_t clusterSize)
+{
+    DirWriter w = {
+        .Io = io,
+        .PerBuffer = IO_BUFFER_SIZE / clusterSize * clusterSize / sizeof(FAT32_DirEntryShort),
+        .ClusterSize = clusterSize,
+        .Offset = offset,
+    };
+
+    if (node->Parent) {
+        // "." entry, this directory itself; ".." entry, parent dir (root does not have a cluster value)
+        const FAT32_Node *parent = node->Parent;
+        FAT32_DirEntryShort dots[2] = {
+            makeDirEntry(ctx, node, ".          ", node->FirstCluster),
+            makeDirEntry(ctx, parent, "..         ", parent->Parent ? parent->FirstCluster : 0),
+        };
+        dots[0].DIR_NTRes = dots[1].DIR_NTRes = 0;   // Case flags belong to the real names
+        if (!putDirEntries(&w, dots, 2)) return false;
+    }
+
+    for (const FAT32_Node *child = node->Child; child; child = child->Next) {
+        FAT32_DirEntryShort entries[LFN_MAX_ENTRIES + 1];
+        const size_t count = makeNodeLongEntries(child, (FAT32_DirEntryLong *)entries);
+        entries[count] = makeDirEntry(ctx, child, (const char *)child->Name, child->FirstCluster);
+
+        if (!putDirEntries(&w, entries, count + 1)) return false;
+    }
+
+    // Partly filled buffer, or a zeroed cluster for a directory without entries
+    if (!w.Entries && w.Offset == offset && !(w.Entries = ioAcquire(io, w.PerBuffer * sizeof *w.Entries)))
+        return false;
+
+    return !w.Entries || flushDirEntries(&w);
+}
+
+static bool writeNodeData(const ImageContext *ctx, ImageIO *io, const FAT32_Node *node, uint64_t dataRegionLBA,
+                          uint8_t secPerClus)
+{
+    const uint64_t offset = (dataRegionLBA + (uint64_t)(node->FirstCluster - 2) * secPerClus) * ctx->LbaSize;
+
+    if (node->Attr & ATTR_DIRECTORY) {
+        if (!writeDirEntries(ctx, io, node, offset, secPerClus * ctx->LbaSize)) return false;
+
+        for (const FAT32_Node *child = node->Child; child; child = child->Next)
+            if (!writeNodeData(ctx, io, child, dataRegionLBA, secPerClus)) return false;
+
+        return true;
+    }
+
+    if (node->Size == 0) return true;
+
+    return copyFileToImage(io, node->HostPath, offset, node->Size);
+}
+
+// Volume templates ---------------------
+// Geometry independent parts of the VBR and FSInfo, shared by every image built in this process
+
+static const Vbr vbrTemplate =
+{
+
+    .BS_jmpBoot = {   0xEB, 0x00, 0x90 },
+    .BS_OEMName = {   "THISDISK"       },
+    .BPB_BytsPerSec = 0,            // LbaSize
+    .BPB_SecPerClus = 0,            // By volume size, see setVolumeGeometry()
+    .BPB_RsvdSecCnt = 32,           // FAT32 Count, at least; padded so the data region is aligned
+
+    .BPB_NumFATs = 2,
+    .BPB_RootEntCnt = 0,
+    .BPB_TotSec16 = 0,
+    .BPB_Media = 0xF8,              // "Fixed" non-removable media; Could also be 0xF0 for e.g. flash driver
+    .BPB_FATSz16 = 0,
+    .BPB_SecPerTrk = 0,
+    .BPB_NumHeads = 0,
+    .BPB_HiddSec = 0,               // of sectors before this partition/volume
+    .BPB_TotSec32 = 0,              // Size of this volume
+
+    .BPB_FATSz32 = 0,               // Solved from the volume size
+    .BPB_ExtFlags = 0,              // Mirrored FATs
+    .BPB_FSVer = 0,
+    .BPB_RootClus = 2,              // Cluster 0 & 1 are reserved; root dir cluster starts at 2
+    .BPB_FSInfo = 1,                // Sector 0 = this Vbr, FS info sector follow it
+    .BPB_BkBootSec = 6,             // 
+    .BPB_Reserved = { 0 },
+    .BS_DrvNum = 0x80,              // 1st hard drive
+    .BS_Reserved1 = 0,
+
+    .BS_BootSig = 0x29,
+    .BS_VolID = {0},
+    .BS_VolLab = {"NO NAME    "},
+    .BS_FilSysType = {"FAT32   "},
+
+    .BootCode = {0},
+    .BootSecT_Sig = 0xAA55              //0xAA55
+};
+
+static const FSInfo fsinfoTemplate = {
+
+    .FSI_LeadSigOffset = 0x41615252,
+    .FSI_Reserved1 = {0},
+    .FSI_StrucSig = 0x61417272,
+    .FSI_Free_Count = 0xFFFFFFFF,
+    .FSI_Nxt_Free = 0xFFFFFFFF,
+    .FSI_Reserved2 = {0},
+    .FSI_TrailSig = 0xAA550000
+};
+
+// Cluster size by volume size, FAT32 table of the Microsoft FAT specification (fatgen103).
+//   The table is in 512 byte sectors; here in bytes, so it holds for every lbaSize
+static const struct {
+
+    uint64_t    VolumeBytes;    // Up to and including
+    uint32_t    ClusterBytes;
+
+} clusterSizes[] = {
+    { 260ull << 20, 512 },
+    { 8ull << 30,   4096 },
+    { 16ull << 30,  8192 },
+    { 32ull << 30,  16384 },
+    { UINT64_MAX,   32768 },
+};
+
+// Sectors per cluster, FAT size and reserved sectors for a volume of EspSizeLBAs.
+//   The reserved region is padded so the data region starts on an ALIGNMENT boundary
+static bool setVolumeGeometry(const ImageContext *ctx, Vbr *vbr)
+{
+    const uint64_t lbaSize = ctx->LbaSize, espSizeLBAs = ctx->EspSizeLBAs, alignLBA = ctx->AlignLBA;
+
+    if (espSizeLBAs > UINT32_MAX) {
+        fprintf(stderr, "Error: ESP of %llu sectors does not fit BPB_TotSec32, use a larger LBA size\n",
+                (unsigned long long)espSizeLBAs);
+        return false;
+    }
+
+    const uint64_t volumeBytes = espSizeLBAs * lbaSize;
+    size_t row = 0;
+    while (volumeBytes > clusterSizes[row].VolumeBytes) row++;
+
+    uint32_t secPerClus = clusterSizes[row].ClusterBytes > lbaSize ? clusterSizes[row].ClusterBytes / lbaSize : 1;
+    uint32_t rsvdSecCnt = vbrTemplate.BPB_RsvdSecCnt, fatSz = 0;
+    uint64_t clusters = 0;
+
+    for (;;) {
+        // fatgen103: FATSz = (DskSize - RsvdSecCnt) / (EntriesPerSector * SecPerClus + NumFATs), rounded up;
+        //   two extra clusters cover FAT entries 0 and 1
+        const uint64_t entriesPerSector = lbaSize / sizeof(uint32_t);
+        const uint64_t divisor = entriesPerSector * secPerClus + vbr->BPB_NumFATs;
+        fatSz = (espSizeLBAs - vbrTemplate.BPB_RsvdSecCnt + 2 * secPerClus + divisor - 1) / divisor;
+
+        // Data region on the next ALIGNMENT boundary, the gap goes to the reserved sectors
+        const uint64_t fatEnd = vbrTemplate.BPB_RsvdSecCnt + (uint64_t)vbr->BPB_NumFATs * fatSz;
+        const uint64_t dataStart = (fatEnd + alignLBA - 1) / alignLBA * alignLBA;
+        rsvdSecCnt = dataStart - (uint64_t)vbr->BPB_NumFATs * fatSz;
+        clusters = dataStart < espSizeLBAs ? (espSizeLBAs - dataStart) / secPerClus : 0;
+
+        // Too many clusters for 28 bit entries: bigger clusters (beyond the table, 4 TiB+ volumes)
+        if (clusters <= 0x0FFFFFF5 - 2 || secPerClus >= 128) break;
+        secPerClus *= 2;
+    }
+
+    if (clusters > 0x0FFFFFF5 - 2 || rsvdSecCnt > UINT16_MAX) {
+        fprintf(stderr, "Error: ESP of %llu bytes is too large for FAT32\n", (unsigned long long)volumeBytes);
+        return false;
+    }
+
+    // FAT type follows from the cluster count alone: the smallest FAT32 volume has the smallest
+    //   clusters (one sector at least), so 4096 byte LBAs need an ESP of about 256 MiB
+    if (clusters < FAT32_MIN_CLUSTERS) {
+        const uint64_t minSecPerClus = clusterSizes[0].ClusterBytes > lbaSize ? clusterSizes[0].ClusterBytes / lbaSize : 1;
+        const uint64_t minFatSz = ((uint64_t)FAT32_MIN_CLUSTERS + 2) * sizeof(uint32_t) / lbaSize + 1;
+        const uint64_t minFatEnd = vbrTemplate.BPB_RsvdSecCnt + (uint64_t)vbr->BPB_NumFATs * minFatSz;
+        const uint64_t minLBAs = (minFatEnd + alignLBA - 1) / alignLBA * alignLBA + FAT32_MIN_CLUSTERS * minSecPerClus;
+        const uint64_t minMiB = (minLBAs * lbaSize + (1 << 20) - 1) >> 20;
+
+        fprintf(stderr, "Error: ESP of %llu bytes has %llu clusters, FAT32 needs at least %d\n",
+                (unsigned long long)volumeBytes, (unsigned long long)clusters, FAT32_MIN_CLUSTERS);
+        fprintf(stderr, "Error: with %llu byte LBAs the ESP must be at least %lluM\n",
+                (unsigned long long)lbaSize, (unsigned long long)minMiB);
+        return false;
+    }
+
+    vbr->BPB_SecPerClus = secPerClus;
+    vbr->BPB_RsvdSecCnt = rsvdSecCnt;
+    vbr->BPB_FATSz32 = fatSz;
+
+    return true;
+}
+
+bool checkESPGeometry(const ImageContext *ctx)
+{
+    Vbr vbr = vbrTemplate;
+    vbr.BPB_BytsPerSec = ctx->LbaSize;
+    return setVolumeGeometry(ctx, &vbr);
+}
+
+static bool writeVolume(ImageContext *ctx, ImageIO *io, FAT32_Node *root)
+{
+    const uint64_t lbaSize = ctx->LbaSize, espSizeLBAs = ctx->EspSizeLBAs, espLBA = ctx->EspLBA;
+
+    // Reserved sectors region ----------------
+    // Fill out Volume Boot Record(VBR), geometry dependent fields on top of the shared template
+    Vbr vbr = vbrTemplate;
+    vbr.BPB_BytsPerSec = lbaSize;
+    vbr.BPB_HiddSec = espLBA;                                     // of sectors before this partition/volume
+    vbr.BPB_TotSec32 = espSizeLBAs;                               // Size of this volume
+    if (!setVolumeGeometry(ctx, &vbr)) return false;                   // Cluster size, FAT size, aligned data region
+
+    const Guid volumeID = new_guid(ctx);                             // Random serial number of the volume
+    memcpy(vbr.BS_VolID, &volumeID.TimeLow, sizeof vbr.BS_VolID);
+
+    // Hand out clusters to the tree, the FAT can only address as many clusters as fit in it
+    const uint32_t clusterSize = vbr.BPB_SecPerClus * lbaSize;
+    const uint64_t dataClusters = (espSizeLBAs - vbr.BPB_RsvdSecCnt - vbr.BPB_NumFATs * vbr.BPB_FATSz32)
+                                  / vbr.BPB_SecPerClus;
+    const uint64_t fatEntries = (uint64_t)vbr.BPB_FATSz32 * lbaSize / sizeof(uint32_t);
+    const uint64_t lastCluster = (dataClusters + 1 < fatEntries - 1) ? dataClusters + 1 : fatEntries - 1;
+
+    uint64_t nextCluster = vbr.BPB_RootClus;
+    if (!allocateClusters(root, &nextCluster, lastCluster, clusterSize)) return false;
+
+    // Fill out file system info sector: the tree takes clusters from the front, everything
+    //   after it is one free run, so the free count and the hint are exact
+    FSInfo fsinfo = fsinfoTemplate;
+    fsinfo.FSI_Free_Count = lastCluster + 1 - nextCluster;
+    fsinfo.FSI_Nxt_Free = nextCluster <= lastCluster ? nextCluster : 0xFFFFFFFF;
+
+    // Write VBR and FSInfo, then the backup boot sector copies of both
+    const uint64_t backupLBA = espLBA + vbr.BPB_BkBootSec;
+    statsBegin(ctx, "vbr");
+    const bool vbrWritten = ioWriteLBA(io, &vbr, sizeof vbr, espLBA) && ioWriteLBA(io, &vbr, sizeof vbr, backupLBA);
+    const bool fsinfoWritten = vbrWritten && ioWriteLBA(io, &fsinfo, sizeof fsinfo, espLBA + vbr.BPB_FSInfo) &&
+                               ioWriteLBA(io, &fsinfo, sizeof fsinfo, backupLBA + vbr.BPB_FSInfo);
+    statsEnd(ctx);
+
+    if (!vbrWritten)
+    {
+        fprintf(stderr, "Error: Could not write ESP Volume Boot Record to image\n");
+        return false;
+    }
+
+    if (!fsinfoWritten)
+    {
+        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
+        return false;
+    }
+
+    // FAT32 region ---------------------------
+    // Write FATs(NOTE: Fats will me mirrored), all copies from one chunk buffer
+    const uint64_t fatLBA = espLBA + vbr.BPB_RsvdSecCnt;
+    FAT32_ExtentList extents = { NULL, 0, 0 };
+    statsBegin(ctx, "fat");
+    const bool fatWritten = collectExtents(root, &extents) && writeFAT(io, &vbr, fatLBA, &extents);
+    statsEnd(ctx);
+    free(extents.Items);
+    if (!fatWritten) {
+        fprintf(stderr, "Error: Could not write ESP FAT to image\n");
+        return false;
+    }
+
+    // Data region ----------------------------
+    // Write directories and copy file data from the host
+    const uint64_t dataRegionLBA = fatLBA + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
+    statsBegin(ctx, "data");
+    const bool dataWritten = writeNodeData(ctx, io, root, dataRegionLBA, vbr.BPB_SecPerClus);
+    statsEnd(ctx);
+    if (!dataWritten) {
+        fprintf(stderr, "Error: Could not write ESP directories and files to image\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool writeESP(ImageContext *ctx, ImageIO *io)
+{
+    // Build the tree of the ESP: root '/', then host directory contents or '/EFI/BOOT'
+    FAT32_Node *root = newNode(NULL, (const uint8_t *)"           ", ATTR_DIRECTORY, buildTime(ctx));
+    if (!root) return false;
+
+    statsBegin(ctx, "scan");
+    bool ok = ctx->EspDir ? scanHostDir(ctx, root, ctx->EspDir) : buildSkeleton(ctx, root);
+    statsEnd(ctx);
+    if (ok) ok = writeVolume(ctx, io, root);
+
+    freeTree(root);
+    return ok;
+}
@@ -0,0 +1,507 @@
+#include <uefi_fatname.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Name parsing ---------------------------
+
+// UTF-8 to UTF-16, characters outside the BMP become surrogate pairs
+static bool decodeUtf8(const char *name, uint16_t *out, uint8_t *len)
+{
+    const uint8_t *p = (const uint8_t *)name;
+    size_t n = 0;
+
+    while (*p) {
+        uint32_t cp;
+        int extra;
+        if      (*p < 0x80)           { cp = *p;        extra = 0; }
+        else if ((*p & 0xE0) == 0xC0) { cp = *p & 0x1F; extra = 1; }
+        else if ((*p & 0xF0) == 0xE0) { cp = *p & 0x0F; extra = 2; }
+        else if ((*p & 0xF8) == 0xF0) { cp = *p & 0x07; extra = 3; }
+        else return false;
+        p++;
+
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) return false;
+            cp = cp << 6 | (*p & 0x3F);
+        }
+
+        // Overlong forms, surrogates and code points past Unicode are not characters
+        static const uint32_t minimum[] = { 0, 0x80, 0x800, 0x10000 };
+        if (cp < minimum[extra] || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) return false;
+
+        if (cp >= 0x10000) {
+            if (n + 2 > LFN_MAX_CHARS) return false;
+            cp -= 0x10000;
+            out[n++] = 0xD800 | cp >> 10;
+            out[n++] = 0xDC00 | (cp & 0x3FF);
+        } else {
+            if (n + 1 > LFN_MAX_CHARS) return false;
+            out[n++] = cp;
+        }
+    }
+
+    *len = n;
+    return true;
+}
+
+// Character of a basis name: upper case, '_' for what 8.3 names cannot hold
+static uint8_t shortChar(uint16_t c)
+{
+    static const char special[] = "$%'-_@~`!(){}^#&";
+
+    if (c >= 0x80) return '_';
+    if (isalnum(c) || strchr(special, c)) return toupper(c);
+    return '_';
+}
+
+// Case of the letters of name[from, to): bit 0 - lower case seen, bit 1 - upper case seen
+static unsigned letterCase(const char *name, size_t from, size_t to)
+{
+    unsigned seen = 0;
+    for (size_t i = from; i < to; i++) {
+        if (islower((unsigned char)name[i])) seen |= 1;
+        if (isupper((unsigned char)name[i])) seen |= 2;
+    }
+
+    return seen;
+}
+
+bool makeFatName(const char *name, FAT32_Name *out)
+{
+    memset(out, 0, sizeof *out);
+    if (!decodeUtf8(name, out->Long, &out->LongLen) || out->LongLen == 0) return false;
+
+    const uint8_t len = out->LongLen;
+    for (size_t i = 0; i < len; i++)
+        if (out->Long[i] < 0x20 || out->Long[i] == 0x7F || (out->Long[i] < 0x80 && strchr("\"*/:<>?\\|", out->Long[i])))
+            return false;
+    if (out->Long[len - 1] == '.' || out->Long[len - 1] == ' ') return false;   // Also rejects "." and ".."
+
+    // Exact 8.3 name: short entry only, unless the case of one part is mixed
+    if (toShortName(name, out->Short)) {
+        const char *dot = strrchr(name, '.');
+        const size_t baseLen = dot ? (size_t)(dot - name) : strlen(name);
+        const unsigned base = letterCase(name, 0, baseLen);
+        const unsigned ext = letterCase(name, baseLen, strlen(name));
+
+        out->HasLong = base == 3 || ext == 3;
+        if (!out->HasLong) out->NTRes = (base == 1 ? NTRES_LOWER_BASE : 0) | (ext == 1 ? NTRES_LOWER_EXT : 0);
+        return true;
+    }
+
+    // Basis name: spaces and leading dots dropped, extension after the last dot
+    out->HasLong = out->Lossy = true;
+    memset(out->Short, ' ', sizeof out->Short);
+
+    size_t start = 0, lastDot = len;
+    while (start < len && (out->Long[start] == '.' || out->Long[start] == ' ')) start++;
+    for (size_t i = start; i < len; i++)
+        if (out->Long[i] == '.') lastDot = i;
+
+    size_t n = 0;
+    for (size_t i = start; i < lastDot && n < 8; i++)
+        if (out->Long[i] != ' ' && out->Long[i] != '.') out->Short[n++] = shortChar(out->Long[i]);
+    if (n == 0) out->Short[0] = '_';
+
+    n = 0;
+    for (size_t i = lastDot + 1; i < len && n < 3; i++)
+        if (out->Long[i] != ' ') out->Short[8 + n++] = shortChar(out->Long[i]);
+
+    return true;
+}
+
+// Long entries ---------------------------
+
+uint8_t lfnChecksum(const uint8_t shortName[11])
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+
+    return sum;
+}
+
+size_t lfnEntryCount(const FAT32_Name *name)
+{
+    return name->HasLong ? ((size_t)name->LongLen + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY : 0;
+}
+
+// The 13 characters of an entry live in three fields
+static void setLongChar(FAT32_DirEntryLong *entry, size_t i, uint16_t c)
+{
+    if      (i < 5)  entry->LDIR_Name1[i] = c;
+    else if (i < 11) entry->LDIR_Name2[i - 5] = c;
+    else             entry->LDIR_Name3[i - 11] = c;
+}
+
+static uint16_t getLongChar(const FAT32_DirEntryLong *entry, size_t i)
+{
+    if (i < 5)  return entry->LDIR_Name1[i];
+    if (i < 11) return entry->LDIR_Name2[i - 5];
+    return entry->LDIR_Name3[i - 11];
+}
+
+size_t makeLongEntries(const FAT32_Name *name, FAT32_DirEntryLong *entries)
+{
+    const size_t count = lfnEntryCount(name);
+    const uint8_t checksum = lfnChecksum(name->Short);
+
+    // Last part of the name first; the name ends with 0x0000 if there is room, then 0xFFFF padding
+    for (size_t k = 0; k < count; k++) {
+        const size_t ord = count - k;
+        FAT32_DirEntryLong *entry = &entries[k];
+
+        memset(entry, 0, sizeof *entry);
+        entry->LDIR_Ord = ord | (k == 0 ? LFN_LAST_ENTRY : 0);
+        entry->LDIR_Attr = ATTR_LONG_NAME;
+        entry->LDIR_Chksum = checksum;
+
+        for (size_t i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+            const size_t at = (ord - 1) * LFN_CHARS_PER_ENTRY + i;
+            setLongChar(entry, i, at < name->LongLen ? name->Long[at] : at == name->LongLen ? 0x0000 : 0xFFFF);
+        }
+    }
+
+    return count;
+}
+
+void readLongEntry(FAT32_LfnReader *reader, const FAT32_DirEntryLong *entry)
+{
+    const uint8_t ord = entry->LDIR_Ord & ~LFN_LAST_ENTRY;
+
+    if (entry->LDIR_Ord & LFN_LAST_ENTRY) {
+        // Entry with the end of the name: its length is known from here on
+        size_t tail = 0;
+        while (tail < LFN_CHARS_PER_ENTRY && getLongChar(entry, tail) != 0x0000) tail++;
+
+        const size_t len = (size_t)(ord - 1) * LFN_CHARS_PER_ENTRY + tail;
+        if (ord < 1 || ord > LFN_MAX_ENTRIES || len == 0 || len > LFN_MAX_CHARS) {
+            reader->LongLen = reader->Expect = 0;
+            return;
+        }
+        reader->LongLen = len;
+        reader->Checksum = entry->LDIR_Chksum;
+    } else if (reader->LongLen == 0 || ord != reader->Expect || entry->LDIR_Chksum != reader->Checksum) {
+        reader->LongLen = reader->Expect = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+        const size_t at = (size_t)(ord - 1) * LFN_CHARS_PER_ENTRY + i;
+        if (at < reader->LongLen) reader->Long[at] = getLongChar(entry, i);
+    }
+    reader->Expect = ord - 1;
+}
+
+bool readShortEntry(FAT32_LfnReader *reader, const FAT32_DirEntryShort *entry, FAT32_Name *name)
+{
+    memset(name, 0, sizeof *name);
+    memcpy(name->Short, entry->DIR_Name, sizeof name->Short);
+    name->NTRes = entry->DIR_NTRes & (NTRES_LOWER_BASE | NTRES_LOWER_EXT);
+
+    name->HasLong = reader->LongLen > 0 && reader->Expect == 0 && reader->Checksum == lfnChecksum(entry->DIR_Name);
+    if (name->HasLong) {
+        memcpy(name->Long, reader->Long, reader->LongLen * sizeof *reader->Long);
+        name->LongLen = reader->LongLen;
+    }
+
+    reader->LongLen = reader->Expect = 0;
+    return name->HasLong;
+}
+
+void formatFatName(const FAT32_Name *name, char *out, size_t size)
+{
+    size_t n = 0;
+
+    if (!name->HasLong) {
+        for (int i = 0; i < 11 && n + 2 < size; i++) {
+            if (name->Short[i] == ' ') continue;
+            if (i == 8) out[n++] = '.';
+
+            const bool lower = name->NTRes & (i < 8 ? NTRES_LOWER_BASE : NTRES_LOWER_EXT);
+            out[n++] = lower ? tolower(name->Short[i]) : name->Short[i];
+        }
+        if (size > 0) out[n] = '\0';
+        return;
+    }
+
+    // UTF-16 to UTF-8, a lone surrogate becomes U+FFFD
+    for (size_t i = 0; i < name->LongLen; i++) {
+        uint32_t cp = name->Long[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < name->LongLen &&
+            name->Long[i + 1] >= 0xDC00 && name->Long[i + 1] <= 0xDFFF)
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (name->Long[++i] - 0xDC00);
+        else if (cp >= 0xD800 && cp <= 0xDFFF)
+            cp = 0xFFFD;
+
+        uint8_t bytes[4];
+        size_t len;
+        if      (cp < 0x80)    { bytes[0] = cp; len = 1; }
+        else if (cp < 0x800)   { bytes[0] = 0xC0 | cp >> 6;  bytes[1] = 0x80 | (cp & 0x3F); len = 2; }
+        else if (cp < 0x10000) { bytes[0] = 0xE0 | cp >> 12; bytes[1] = 0x80 | (cp >> 6 & 0x3F);
+                                 bytes[2] = 0x80 | (cp & 0x3F); len = 3; }
+        else                   { bytes[0] = 0xF0 | cp >> 18; bytes[1] = 0x80 | (cp >> 12 & 0x3F);
+                                 bytes[2] = 0x80 | (cp >> 6 & 0x3F); bytes[3] = 0x80 | (cp & 0x3F); len = 4; }
+
+        if (n + len >= size) break;
+        memcpy(out + n, bytes, len);
+        n += len;
+    }
+    if (size > 0) out[n] = '\0';
+}
+
+// Name index -----------------------------
+// Open addressing with linear probing. Every item has a slot for its short name and, with a long
+//   name, one for the long name upper-cased (ASCII only, FAT has no case table of its own)
+
+enum {
+    INDEX_MIN_SLOTS = 64,
+};
+
+typedef struct {
+
+    uint8_t     Short[11];
+    uint8_t     LongLen;        // 0 - short name only
+    uint16_t   *Long;           // Upper-cased long name
+    uint64_t    Value;
+    bool        Removed;
+
+} NameItem;
+
+// Ref: 0 - empty slot, otherwise (item << 1 | is long name key) + 1
+typedef struct {
+
+    uint32_t    Hash;
+    uint32_t    Ref;
+
+} NameSlot;
+
+struct FAT32_NameIndex {
+
+    NameSlot   *Slots;
+    size_t      SlotCount;      // Power of two
+    size_t      UsedSlots;
+    NameItem   *Items;
+    size_t      ItemCount;
+    size_t      ItemCapacity;
+    size_t      Live;           // Items not removed
+
+};
+
+static uint16_t foldChar(uint16_t c)
+{
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+// FNV-1a; the key kind is mixed in so a short and a long key of the same bytes differ
+static uint32_t hashShort(const uint8_t name[11])
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 11; i++) h = (h ^ name[i]) * 16777619u;
+
+    return h;
+}
+
+static uint32_t hashLong(const uint16_t *name, size_t len)
+{
+    uint32_t h = 2166136261u ^ 0x4C;
+    for (size_t i = 0; i < len; i++) {
+        const uint16_t c = foldChar(name[i]);
+        h = (h ^ (c & 0xFF)) * 16777619u;
+        h = (h ^ (c >> 8)) * 16777619u;
+    }
+
+    return h;
+}
+
+static bool sameLong(const NameItem *item, const uint16_t *name, size_t len)
+{
+    if (item->LongLen != len) return false;
+    for (size_t i = 0; i < len; i++)
+        if (item->Long[i] != foldChar(name[i])) return false;
+
+    return true;
+}
+
+FAT32_NameIndex *newNameIndex(void)
+{
+    FAT32_NameIndex *index = calloc(1, sizeof *index);
+    if (!index) return NULL;
+
+    index->SlotCount = INDEX_MIN_SLOTS;
+    index->Slots = calloc(index->SlotCount, sizeof *index->Slots);
+    if (!index->Slots) {
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void freeNameIndex(FAT32_NameIndex *index)
+{
+    if (!index) return;
+
+    for (size_t i = 0; i < index->ItemCount; i++) free(index->Items[i].Long);
+    free(index->Items);
+    free(index->Slots);
+    free(index);
+}
+
+static void putSlot(NameSlot *slots, size_t count, uint32_t hash, uint32_t ref)
+{
+    size_t i = hash & (count - 1);
+    while (slots[i].Ref) i = (i + 1) & (count - 1);
+
+    slots[i] = (NameSlot){ hash, ref };
+}
+
+// Keep at most half of the slots in use, so probe runs stay short
+static bool reserveSlots(FAT32_NameIndex *index, size_t extra)
+{
+    if ((index->UsedSlots + extra) * 2 <= index->SlotCount) return true;
+
+    size_t count = index->SlotCount * 2;
+    while ((index->UsedSlots + extra) * 2 > count) count *= 2;
+
+    NameSlot *slots = calloc(count, sizeof *slots);
+    if (!slots) return false;
+    for (size_t i = 0; i < index->SlotCount; i++)
+        if (index->Slots[i].Ref) putSlot(slots, count, index->Slots[i].Hash, index->Slots[i].Ref);
+
+    free(index->Slots);
+    index->Slots = slots;
+    index->SlotCount = count;
+    return true;
+}
+
+bool addIndexName(FAT32_NameIndex *index, const FAT32_Name *name, uint64_t value)
+{
+    if (!reserveSlots(index, 2)) return false;
+
+    if (index->ItemCount == index->ItemCapacity) {
+        const size_t capacity = index->ItemCapacity ? index->ItemCapacity * 2 : 64;
+        NameItem *items = realloc(index->Items, capacity * sizeof *items);
+        if (!items) return false;
+        index->Items = items;
+        index->ItemCapacity = capacity;
+    }
+
+    NameItem item = { .Value = value };
+    memcpy(item.Short, name->Short, sizeof item.Short);
+    if (name->HasLong) {
+        item.Long = malloc(name->LongLen * sizeof *item.Long);
+        if (!item.Long) return false;
+        for (size_t i = 0; i < name->LongLen; i++) item.Long[i] = foldChar(name->Long[i]);
+        item.LongLen = name->LongLen;
+    }
+
+    const uint32_t ref = index->ItemCount << 1;
+    index->Items[index->ItemCount++] = item;
+    index->Live++;
+
+    putSlot(index->Slots, index->SlotCount, hashShort(item.Short), ref + 1);
+    index->UsedSlots++;
+    if (item.Long) {
+        putSlot(index->Slots, index->SlotCount, hashLong(item.Long, item.LongLen), (ref | 1) + 1);
+        index->UsedSlots++;
+    }
+
+    return true;
+}
+
+// Item whose short name, or long name if isLong, equals the key; removed items stay in their
+//   slots and are skipped, so probe runs are never broken
+static NameItem *probe(const FAT32_NameIndex *index, const uint8_t *shortName, const uint16_t *longName, size_t len)
+{
+    const uint32_t hash = longName ? hashLong(longName, len) : hashShort(shortName);
+
+    for (size_t i = hash & (index->SlotCount - 1); index->Slots[i].Ref; i = (i + 1) & (index->SlotCount - 1)) {
+        const NameSlot *slot = &index->Slots[i];
+        const bool isLong = (slot->Ref - 1) & 1;
+        NameItem *item = &index->Items[(slot->Ref - 1) >> 1];
+
+        if (slot->Hash != hash || isLong != (longName != NULL) || item->Removed) continue;
+        if (longName ? sameLong(item, longName, len) : memcmp(item->Short, shortName, sizeof item->Short) == 0)
+            return item;
+    }
+
+    return NULL;
+}
+
+// A name matches another file's long name, or its short name if the name is an exact 8.3 name
+static NameItem *lookup(const FAT32_NameIndex *index, const FAT32_Name *name)
+{
+    NameItem *item = probe(index, NULL, name->Long, name->LongLen);
+    if (!item && !name->Lossy) item = probe(index, name->Short, NULL, 0);
+
+    return item;
+}
+
+bool findIndexName(const FAT32_NameIndex *index, const FAT32_Name *name, uint64_t *value)
+{
+    const NameItem *item = lookup(index, name);
+    if (item && value) *value = item->Value;
+
+    return item != NULL;
+}
+
+bool removeIndexName(FAT32_NameIndex *index, const FAT32_Name *name)
+{
+    NameItem *item = lookup(index, name);
+    if (!item) return false;
+
+    item->Removed = true;
+    index->Live--;
+    return true;
+}
+
+size_t indexNameCount(const FAT32_NameIndex *index)
+{
+    return index->Live;
+}
+
+// Short alias ----------------------------
+
+bool makeShortAlias(const FAT32_NameIndex *index, FAT32_Name *name)
+{
+    if (!name->Lossy && !probe(index, name->Short, NULL, 0)) return true;
+
+    size_t baseLen = 0;
+    while (baseLen < 8 && name->Short[baseLen] != ' ') baseLen++;
+
+    // Prefix of the basis name: up to six characters for ~1..~4, then two plus a hash of the long name
+    uint8_t prefix[8];
+    memcpy(prefix, name->Short, baseLen);
+    size_t prefixLen = baseLen;
+
+    const uint32_t h = hashLong(name->Long, name->LongLen);
+    const uint16_t hash = h ^ h >> 16;
+
+    // n counts every try; the hashed prefix starts its own tails at ~1
+    for (uint32_t n = 1; n <= 4 + 999999; n++) {
+        if (n == 5) {
+            static const char digits[] = "0123456789ABCDEF";
+            prefixLen = baseLen < 2 ? baseLen : 2;
+            for (int i = 0; i < 4; i++) prefix[prefixLen++] = digits[hash >> (12 - 4 * i) & 0xF];
+        }
+
+        char tail[8];
+        const size_t tailLen = snprintf(tail, sizeof tail, "~%u", n <= 4 ? n : n - 4);
+        const size_t keep = prefixLen < 8 - tailLen ? prefixLen : 8 - tailLen;
+
+        uint8_t candidate[11];
+        memset(candidate, ' ', 8);
+        memcpy(candidate, prefix, keep);
+        memcpy(candidate + keep, tail, tailLen);
+        memcpy(candidate + 8, name->Short + 8, 3);
+
+        if (!probe(index, candidate, NULL, 0)) {
+            memcpy(name->Short, candidate, sizeof candidate);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -1,10 +1,34 @@
 #include <uefi_gpt.h>
 
-Guid new_guid(void) {
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+// Per-context generator (splitmix64), seeded from the kernel unless seedGuids() was called
+void seedGuids(ImageContext *ctx, uint64_t seed)
+{
+    ctx->GuidState = seed;
+    ctx->GuidSeeded = true;
+}
+
+static uint64_t nextRandom(ImageContext *ctx)
+{
+    if (!ctx->GuidSeeded && getrandom(&ctx->GuidState, sizeof ctx->GuidState, 0) != sizeof ctx->GuidState)
+        ctx->GuidState = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)ctx;
+    ctx->GuidSeeded = true;
+
+    uint64_t z = (ctx->GuidState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+Guid new_guid(ImageContext *ctx) {
     uint8_t rand_arr[16] = { 0 };
 
-    for (uint8_t i = 0; i < sizeof rand_arr; i++)
-        rand_arr[i] = rand() % (UINT8_MAX + 1);
+    const uint64_t random[2] = { nextRandom(ctx), nextRandom(ctx) };
+    memcpy(rand_arr, random, sizeof rand_arr);
 
     // Fill out GUID
     Guid result = {
@@ -31,40 +55,6 @@ Guid new_guid(void) {
     return result;
 }
 
-uint32_t crcTable[256];
-void createCRC32Table(void) {
-    uint32_t c = 0;
-
-    for (int32_t n = 0; n < 256; n++) {
-        c = (uint32_t)n;
-        for (uint8_t k = 0; k < 8; k++) {
-            if (c & 1) 
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crcTable[n] = c;
-    }
-}
-
-uint32_t calculateCRC32(void *buf, int32_t len) {
-    static bool made_crc_table = false;
-
-    uint8_t *bufp = buf;
-    uint32_t c = 0xFFFFFFFFL;
-
-    if (!made_crc_table) {
-        createCRC32Table();
-        made_crc_table = true;
-    }
-
-    for (int32_t n = 0; n < len; n++) 
-        c = crcTable[(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
-
-    // Invert bits for return value
-    return c ^ 0xFFFFFFFFL;
-}
-
 const Guid EFI_GUID = { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B, 
                         { 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B } };
 
@@ -72,7 +62,8 @@ const Guid EFI_GUID = { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B,
 const Guid BASIC_DATA_GUID = { 0xEBD0A0A2, 0xB9E5, 0x4433, 0x87, 0xC0,
                                 { 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 } };
 
-bool writeGPTs(FILE *image) {
+bool writeGPTs(ImageContext *ctx, ImageIO *io, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES]) {
+
     // Fill out primary GPT header
     GptHeader primary_gpt = {
         .Signature = { "EFI PART" },
@@ -81,10 +72,10 @@ bool writeGPTs(FILE *image) {
         .HeaderCRC32 = 0,      // Will calculate later
         .Reversed = 0,
         .MyLBA = 1,            // LBA 1 is right after MBR
-        .AlternateLBA = imageSizeLBAs - 1,
-        .FirstUsableLBA = 1 + 1 + gptTableLBAs, // MBR + GPT header + primary gpt table
-        .LastUsableLBA = imageSizeLBAs - 1 - gptTableLBAs - 1, // 2nd GPT header + table
-        .DiskGuid = new_guid(),
+        .AlternateLBA = ctx->ImageSizeLBAs - 1,
+        .FirstUsableLBA = 1 + 1 + ctx->GptTableLBAs, // MBR + GPT header + primary gpt table
+        .LastUsableLBA = ctx->ImageSizeLBAs - 1 - ctx->GptTableLBAs - 1, // 2nd GPT header + table
+        .DiskGuid = new_guid(ctx),
         .PartitionEntryLBA = 2,   // After MBR + GPT header
         .NumberOfPartitionEntries = 128,   
         .SizeOfPartition = 128,
@@ -92,40 +83,13 @@ bool writeGPTs(FILE *image) {
         .ReversedSecond = { 0 },
     };
 
-    // Fill out primary table partition entries
-    GptPartitionEntry gpt_table[NUMBER_OF_GPT_TABLE_ENTRIES] = {
-        // EFI System Paritition
-        {
-            .PartitionTypeGUID = EFI_GUID,
-            .UniquePartitionGUID = new_guid(),
-            .StartingLBA = espLBA,
-            .EndingLBA = espLBA + espSizeLBAs,
-            .Attributes = 0,
-            .PartitionName = u"EFI SYSTEM",
-        },
-
-        // Basic Data Paritition
-        {
-            .PartitionTypeGUID = BASIC_DATA_GUID,
-            .UniquePartitionGUID = new_guid(),
-            .StartingLBA = dataLBA,
-            .EndingLBA = dataLBA + dataSizeLBAs,
-            .Attributes = 0,
-            .PartitionName = u"BASIC DATA",
-        },
-    };
-
     // Fill out primary header CRC values
-    primary_gpt.PartitionEntryArrayCRC32 = calculateCRC32(gpt_table, sizeof gpt_table);
+    primary_gpt.PartitionEntryArrayCRC32 = calculateCRC32(table, GPT_TABLE_SIZE);
     primary_gpt.HeaderCRC32 = calculateCRC32(&primary_gpt, primary_gpt.HeaderSize);
 
-    // Write primary gpt header to file
-    if (fwrite(&primary_gpt, 1, sizeof primary_gpt, image) != sizeof primary_gpt)
-        return false;
-    writeFullLBASize(image);
-
-    // Write primary gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table)
+    // Write primary gpt header and table to file
+    if (!ioWriteLBA(io, &primary_gpt, sizeof primary_gpt, primary_gpt.MyLBA) ||
+        !ioWrite(io, table, GPT_TABLE_SIZE, primary_gpt.PartitionEntryLBA * ctx->LbaSize))
         return false;
 
     // Fill out secondary GPT header
@@ -135,23 +99,57 @@ bool writeGPTs(FILE *image) {
     secondary_gpt.PartitionEntryArrayCRC32 = 0;
     secondary_gpt.MyLBA = primary_gpt.AlternateLBA;
     secondary_gpt.AlternateLBA = primary_gpt.MyLBA;
-    secondary_gpt.PartitionEntryLBA = imageSizeLBAs - 1 - gptTableLBAs;
+    secondary_gpt.PartitionEntryLBA = ctx->ImageSizeLBAs - 1 - ctx->GptTableLBAs;
 
     // Fill out secondary header CRC values
-    secondary_gpt.PartitionEntryArrayCRC32 = calculateCRC32(gpt_table, sizeof gpt_table);
-    secondary_gpt.HeaderCRC32 = calculateCRC32(&secondary_gpt, secondary_gpt.HeaderCRC32);
+    secondary_gpt.PartitionEntryArrayCRC32 = calculateCRC32(table, GPT_TABLE_SIZE);
+    secondary_gpt.HeaderCRC32 = calculateCRC32(&secondary_gpt, secondary_gpt.HeaderSize);
 
-    // Go to position of secondary table
-    fseek(image, secondary_gpt.PartitionEntryLBA * lbaSize, SEEK_SET);
+    // Write secondary gpt table and header to file
+    return ioWrite(io, table, GPT_TABLE_SIZE, secondary_gpt.PartitionEntryLBA * ctx->LbaSize) &&
+           ioWriteLBA(io, &secondary_gpt, sizeof secondary_gpt, secondary_gpt.MyLBA);
+}
 
-    // Write secondary gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table)
-        return false;
+uint64_t detectImageLBASize(int fd)
+{
+    for (uint64_t size = 512; size <= 4096; size *= 2) {
+        char signature[8];
+        if (pread(fd, signature, sizeof signature, size) == sizeof signature &&
+            memcmp(signature, "EFI PART", sizeof signature) == 0)
+            return size;
+    }
 
-    // Write secondary gpt header to file
-    if (fwrite(&secondary_gpt, 1, sizeof secondary_gpt, image) != sizeof secondary_gpt)
-        return false;
-    writeFullLBASize(image);
+    return 0;
+}
+
+bool readGptHeader(int fd, uint64_t lba, uint64_t lbaBytes, GptHeader *header)
+{
+    if (pread(fd, header, sizeof *header, lba * lbaBytes) != sizeof *header) return false;
+    if (memcmp(header->Signature, "EFI PART", sizeof header->Signature) != 0) return false;
+    if (header->HeaderSize < 92 || header->HeaderSize > sizeof *header) return false;
 
-    return true;
-}
\ No newline at end of file
+    // CRC is calculated with the CRC field itself zeroed
+    GptHeader copy = *header;
+    copy.HeaderCRC32 = 0;
+
+    return calculateCRC32(&copy, copy.HeaderSize) == header->HeaderCRC32;
+}
+
+uint8_t *readGptEntries(int fd, const GptHeader *header, uint64_t lbaBytes, size_t *size)
+{
+    if (header->SizeOfPartition < sizeof(GptPartitionEntry) || header->SizeOfPartition > 4096 ||
+        header->NumberOfPartitionEntries > 65536)
+        return NULL;
+
+    *size = (size_t)header->NumberOfPartitionEntries * header->SizeOfPartition;
+    uint8_t *entries = malloc(*size ? *size : 1);
+    if (!entries) return NULL;
+
+    if (pread(fd, entries, *size, header->PartitionEntryLBA * lbaBytes) != (ssize_t)*size ||
+        calculateCRC32(entries, *size) != header->PartitionEntryArrayCRC32) {
+        free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
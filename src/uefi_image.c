@@ -0,0 +1,324 @@
+#include <uefi_image.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <uefi_mbr.h>
+#include <uefi_gpt.h>
+#include <uefi_lba.h>
+#include <uefi_io.h>
+#include <uefi_fat32.h>
+#include <uefi_copy.h>
+#include <uefi_cache.h>
+#include <uefi_stats.h>
+#include <uefi_verity.h>
+
+bool parseSize(const char *str, uint64_t *bytes)
+{
+    char *end = NULL;
+    errno = 0;
+    const unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || !isdigit((unsigned char)*str)) return false;
+
+    uint64_t shift = 0;
+    switch (toupper((unsigned char)*end)) {
+        case '\0':              break;
+        case 'K': shift = 10;   break;
+        case 'M': shift = 20;   break;
+        case 'G': shift = 30;   break;
+        case 'T': shift = 40;   break;
+        default:  return false;
+    }
+    if (*end && end[1] != '\0') return false;
+    if (value > (UINT64_MAX >> shift)) return false;
+
+    *bytes = (uint64_t)value << shift;
+    return true;
+}
+
+bool setImageOption(ImageContext *ctx, const char *key, char *value)
+{
+    if (strcmp(key, "sparse") == 0 && !value) {
+        ctx->Sparse = true;
+        return true;
+    }
+
+    if (strcmp(key, "stats") == 0 && !value) {
+        ctx->Stats = STATS_TABLE;
+        return true;
+    }
+
+    if (!value) {
+        fprintf(stderr, "Error: option %s needs a value\n", key);
+        return false;
+    }
+
+    if (strcmp(key, "image") == 0) {
+        ctx->ImageName = value;
+    } else if (strcmp(key, "esp-dir") == 0) {
+        ctx->EspDir = value;
+    } else if (strcmp(key, "sparse") == 0) {
+        ctx->Sparse = strcmp(value, "0") != 0 && strcmp(value, "no") != 0;
+    } else if (strcmp(key, "lba") == 0) {
+        uint64_t size = 0;
+        if (!parseSize(value, &size) || (size != 512 && size != 1024 && size != 2048 && size != 4096)) {
+            fprintf(stderr, "Error: LBA size must be 512, 1024, 2048 or 4096, got %s\n", value);
+            return false;
+        }
+        ctx->LbaSize = size;
+    } else if (strcmp(key, "esp-size") == 0 || strcmp(key, "data-size") == 0 || strcmp(key, "disk-size") == 0) {
+        uint64_t size = 0;
+        if (!parseSize(value, &size)) {
+            fprintf(stderr, "Error: invalid size %s for %s\n", value, key);
+            return false;
+        }
+        if (key[0] == 'e')      ctx->EspSize = size;
+        else if (key[1] == 'a') ctx->DataSize = size;
+        else                    ctx->DiskSize = size;
+        if (key[1] != 'i') ctx->PairOption = key[0] == 'e' ? "esp-size" : "data-size";
+    } else if (strcmp(key, "data-source") == 0) {
+        // Data partition grows to at least the payload; a smaller data-size given after this fails the build
+        uint64_t size = 0;
+        if (!hostFileSize(value, &size)) return false;
+        if (size > ctx->DataSize) ctx->DataSize = size;
+        ctx->DataSource = value;
+        ctx->PairOption = "data-source";
+    } else if (strcmp(key, "seed") == 0 || strcmp(key, "source-date-epoch") == 0) {
+        char *end = NULL;
+        errno = 0;
+        const unsigned long long number = strtoull(value, &end, key[1] == 'e' ? 0 : 10);
+        if (errno != 0 || end == value || *end != '\0' || (key[1] == 'o' && number > INT64_MAX)) {
+            fprintf(stderr, "Error: invalid %s %s\n", key, value);
+            return false;
+        }
+        if (key[1] == 'e') ctx->Seed = number;
+        else               ctx->Epoch = number;
+        ctx->Reproducible = true;
+    } else if (strcmp(key, "cache") == 0) {
+        ctx->CacheDir = value;
+    } else if (strcmp(key, "format") == 0) {
+        if (strcmp(value, "raw") == 0)        ctx->Format = IMAGE_FORMAT_RAW;
+        else if (strcmp(value, "qcow2") == 0) ctx->Format = IMAGE_FORMAT_QCOW2;
+        else {
+            fprintf(stderr, "Error: image format must be raw or qcow2, got %s\n", value);
+            return false;
+        }
+    } else if (strcmp(key, "io") == 0) {
+        if (strcmp(value, "auto") == 0)       ctx->IoBackend = IO_BACKEND_AUTO;
+        else if (strcmp(value, "sync") == 0)  ctx->IoBackend = IO_BACKEND_SYNC;
+        else if (strcmp(value, "uring") == 0) ctx->IoBackend = IO_BACKEND_URING;
+        else {
+            fprintf(stderr, "Error: I/O backend must be auto, sync or uring, got %s\n", value);
+            return false;
+        }
+    } else if (strcmp(key, "stats") == 0) {
+        if (strcmp(value, "table") == 0)     ctx->Stats = STATS_TABLE;
+        else if (strcmp(value, "json") == 0) ctx->Stats = STATS_JSON;
+        else if (strcmp(value, "off") == 0)  ctx->Stats = STATS_OFF;
+        else {
+            fprintf(stderr, "Error: stats format must be table, json or off, got %s\n", value);
+            return false;
+        }
+    } else if (strcmp(key, "io-depth") == 0) {
+        char *end = NULL;
+        const unsigned long depth = strtoul(value, &end, 10);
+        if (end == value || *end != '\0' || depth == 0 || depth > 1024) {
+            fprintf(stderr, "Error: I/O queue depth must be 1..1024, got %s\n", value);
+            return false;
+        }
+        ctx->IoDepth = depth;
+    } else if (strcmp(key, "verity") == 0) {
+        // N or N:M, partition numbers as in the layout, counting from 1
+        char *end = NULL;
+        const unsigned long data = strtoul(value, &end, 10);
+        const unsigned long hash = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+        if (data == 0 || data > NUMBER_OF_GPT_TABLE_ENTRIES || hash > NUMBER_OF_GPT_TABLE_ENTRIES ||
+            hash == data || *end != '\0') {
+            fprintf(stderr, "Error: verity must be a partition number, optionally :hash partition, got %s\n", value);
+            return false;
+        }
+        ctx->VerityData = data;
+        ctx->VerityHash = hash;
+    } else if (strcmp(key, "verity-block") == 0) {
+        uint64_t size = 0;
+        // dm-verity refuses blocks larger than the page size, 4096 on most hosts
+        if (!parseSize(value, &size) || size < 512 || size > VERITY_MAX_BLOCK || (size & (size - 1)) != 0) {
+            fprintf(stderr, "Error: verity block size must be a power of two from 512 to %d, got %s\n",
+                    VERITY_MAX_BLOCK, value);
+            return false;
+        }
+        ctx->VerityBlock = size;
+    } else if (strcmp(key, "verity-salt") == 0) {
+        return setVeritySalt(ctx, value);
+    } else if (strcmp(key, "part") == 0) {
+        // Copy on append: the array may be shared with the context this one was copied from
+        PartitionSpec *grown = malloc((ctx->PartitionCount + 1) * sizeof *grown);
+        if (!grown) return false;
+        if (ctx->PartitionCount) memcpy(grown, ctx->Partitions, ctx->PartitionCount * sizeof *grown);
+
+        if (!parsePartitionSpec(value, &grown[ctx->PartitionCount])) {
+            free(grown);
+            return false;
+        }
+
+        if (ctx->OwnsPartitions) free(ctx->Partitions);
+        ctx->Partitions = grown;
+        ctx->PartitionCount++;
+        ctx->OwnsPartitions = true;
+    } else {
+        fprintf(stderr, "Error: unknown option %s\n", key);
+        return false;
+    }
+
+    return true;
+}
+
+// Logical size vs. blocks the filesystem actually allocated for the image
+static void printSparseSummary(const ImageContext *ctx)
+{
+    const char *path = ctx->ImageName;
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+
+    const bool qcow2 = ctx->Format == IMAGE_FORMAT_QCOW2;
+    const uint64_t allocated = (uint64_t)st.st_blocks * 512;
+    const uint64_t logical = qcow2 ? ctx->ImageSize : (uint64_t)st.st_size;
+    printf("%s: %llu bytes %s, %llu bytes allocated (%.2f%%)\n", path, (unsigned long long)logical,
+           qcow2 ? "virtual (qcow2)" : "logical", (unsigned long long)allocated,
+           logical ? 100.0 * allocated / logical : 0.0);
+}
+
+// Block device target: GPT must use its logical block size and end where the device ends
+static bool checkDeviceTarget(ImageContext *ctx, const ImageTarget *target)
+{
+    if (ctx->LbaSize != target->LogicalBlockSize) {
+        fprintf(stderr, "Error: device %s has %u byte logical blocks, use --lba %u\n",
+                ctx->ImageName, target->LogicalBlockSize, target->LogicalBlockSize);
+        return false;
+    }
+
+    // Holes would leave stale device contents in the FAT and directories
+    if (ctx->Sparse) {
+        fprintf(stderr, "Error: sparse mode needs an image file, %s is a device\n", ctx->ImageName);
+        return false;
+    }
+
+    if (ctx->DiskSize > target->Size) {
+        fprintf(stderr, "Error: disk-size %llu is larger than device %s (%llu bytes)\n",
+                (unsigned long long)ctx->DiskSize, ctx->ImageName, (unsigned long long)target->Size);
+        return false;
+    }
+
+    if (!ctx->DiskSize) ctx->DiskSize = target->Size;
+    return true;
+}
+
+static bool writeImage(ImageContext *ctx)
+{
+    // Reproducible: GUIDs follow from the spec, the same spec always gives the same image
+    if (ctx->Reproducible) seedGuids(ctx, reproducibleSeed(ctx));
+
+    ImageTarget target;
+    if (!probeImageTarget(ctx->ImageName, &target)) return false;
+    if (target.IsBlockDevice && !checkDeviceTarget(ctx, &target)) return false;
+
+    // --stats: one phase per step below, reported once the image is closed
+    statsBegin(ctx, "writeImage");
+
+    // Set sizes & LBA values, one partition entry array for both GPT tables; the whole spec is
+    //   checked before the target is opened (and an existing file truncated)
+    GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES];
+    bool ok = planLayout(ctx, table);
+
+    if (ok && ctx->EspDir && !ctx->EspLBA) {
+        fprintf(stderr, "Error: esp-dir is set, but the layout has no EFI System Partition\n");
+        ok = false;
+    }
+    if (ok && ctx->EspLBA && !checkESPGeometry(ctx)) ok = false;
+    if (ok && ctx->VerityData && !checkVerity(ctx, table)) ok = false;
+
+    ImageIO *io = ok ? openImageIO(ctx) : NULL;
+    if (!io) {
+        statsEnd(ctx);
+        statsReport(ctx);
+        return false;
+    }
+    const bool sparse = ioSparse(io);
+
+    // Sparse image: final size up front, everything not written stays a hole
+    if (ok && sparse && !ioResize(io, ctx->ImageSize)) {
+        fprintf(stderr, "Error: could not resize file %s\n", ctx->ImageName);
+        ok = false;
+    }
+
+    // Write protective MBR
+    statsBegin(ctx, "writeMBR");
+    if (ok && !writeMBR(ctx, io)) {
+        fprintf(stderr, "Error: could not write protective MBR for file %s\n", ctx->ImageName);
+        ok = false;
+    }
+    statsEnd(ctx);
+
+    // Write GPT headers & tables
+    statsBegin(ctx, "writeGPTs");
+    if (ok && !writeGPTs(ctx, io, table)) {
+        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", ctx->ImageName);
+        ok = false;
+    }
+    statsEnd(ctx);
+
+    // Write EFI System Partition w/FAT32 filesystem
+    statsBegin(ctx, "writeESP");
+    if (ok && ctx->EspLBA && !writeESP(ctx, io)) {
+        fprintf(stderr, "Error: could not write ESP for file %s\n", ctx->ImageName);
+        ok = false;
+    }
+    statsEnd(ctx);
+
+    // dm-verity: the leaves are hashed on worker threads while the payloads are copied
+    VerityJob *verity = NULL;
+    if (ok && ctx->VerityData && !(verity = startVerity(ctx, io, table))) ok = false;
+
+    // Copy filesystem images into the partitions that have one
+    statsBegin(ctx, "writePartitionPayloads");
+    if (ok && !writePartitionPayloads(ctx, io, table)) {
+        fprintf(stderr, "Error: could not write partition contents for file %s\n", ctx->ImageName);
+        ok = false;
+    }
+    statsEnd(ctx);
+
+    if (verity) {
+        statsBegin(ctx, "finishVerity");
+        if (!finishVerity(verity, io, ok)) ok = false;
+        statsEnd(ctx);
+    }
+
+    // Queued writes finish here, their errors included
+    statsBegin(ctx, "closeImageIO");
+    if (!closeImageIO(io) && ok) {
+        fprintf(stderr, "Error: could not write file %s\n", ctx->ImageName);
+        ok = false;
+    }
+    statsEnd(ctx);
+    statsEnd(ctx);
+    statsReport(ctx);
+
+    if (ok && sparse && !isImageStream(ctx->ImageName)) printSparseSummary(ctx);
+
+    return ok;
+}
+
+bool buildImage(ImageContext *ctx)
+{
+    // A cached image would come back without its hash tree and root hash files
+    if (ctx->CacheDir && ctx->VerityData) {
+        fprintf(stderr, "Error: verity cannot be combined with cache\n");
+        return false;
+    }
+
+    return ctx->CacheDir ? buildCachedImage(ctx, writeImage) : writeImage(ctx);
+}
@@ -0,0 +1,845 @@
+#include <uefi_io.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#include <uefi_lba.h>
+#include <uefi_copy.h>
+#include <uefi_qcow2.h>
+#include <uefi_stats.h>
+
+enum {
+    IO_BUFFER_ALIGN = 4096,
+};
+
+// Pool buffer: the owner that acquired it plus one reference per queued operation
+typedef struct {
+
+    uint8_t    *Data;
+    unsigned    Refs;
+    int         InFd;       // Source file of a queued read, closed with the last reference
+
+} IOSlot;
+
+// io_uring set up with raw syscalls: submission and completion rings shared with the kernel
+typedef struct {
+
+    int                     Fd;
+    unsigned                Entries;
+    unsigned               *SqHead, *SqTail, *SqMask, *SqArray;
+    struct io_uring_sqe    *Sqes;
+    unsigned               *CqHead, *CqTail, *CqMask;
+    struct io_uring_cqe    *Cqes;
+
+    void                   *SqMap, *CqMap;
+    size_t                  SqMapSize, CqMapSize, SqesSize;
+
+    unsigned                Queued;     // SQEs filled in but not yet passed to io_uring_enter
+    unsigned                InFlight;   // Operations passed to the kernel, not completed yet
+
+} IOUring;
+
+// Streaming: one planned piece of the output, kept until the whole image is known
+typedef struct {
+
+    uint64_t    Offset;
+    uint64_t    Length;
+    uint8_t    *Data;       // Copy of the written bytes, NULL for a payload range
+    int         InFd;       // Payload source (Data == NULL), read at InOffset
+    uint64_t    InOffset;
+    size_t      Order;      // Submission order, keeps the sort stable
+
+} IORegion;
+
+// Idle ring and pool buffers of images closed on one thread, waiting for its next image
+struct IOCache {
+
+    IOUring     Ring;
+    unsigned    RingDepth;      // Depth the ring was set up for, 0 - no ring
+    uint8_t   **Buffers;
+    unsigned    BufferCount, BufferCapacity;
+    size_t      BufferSize, BufferAlign;
+
+};
+
+struct ImageIO {
+
+    int         Fd;
+    IOBackend   Backend;    // IO_BACKEND_SYNC or IO_BACKEND_URING once opened
+    unsigned    Depth;
+    bool        Direct;     // Block device opened with O_DIRECT: aligned buffers, lengths and offsets
+    uint64_t    LbaSize;    // Logical block of the image: ioWriteLBA and O_DIRECT padding
+    bool        Sparse;     // Zero regions are left out (--sparse, qcow2 and streams always)
+    Qcow2Map   *Qcow2;      // qcow2 output: virtual offsets mapped to file clusters, NULL for raw
+    bool        Stream;     // stdout: writes are planned as regions and emitted in offset order on close
+    IORegion   *Regions;
+    size_t      RegionCount, RegionCapacity;
+    uint64_t    StreamSize;
+    size_t      BufferSize; // IO_BUFFER_SIZE rounded up to the optimal I/O size of the target
+    size_t      BufferAlign;
+    IOSlot     *Slots;
+    bool        Failed;
+    IOUring     Ring;
+    IOCache    *Cache;      // Ring and buffers go back here on close, NULL - freed
+
+};
+
+// io_uring -------------------------------
+
+static bool uringSetup(IOUring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    memset(ring, 0, sizeof *ring);
+
+    ring->Fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->Fd < 0) return false;
+
+    ring->Entries = params.sq_entries;
+    ring->SqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->CqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings with one mmap
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->CqMapSize > ring->SqMapSize) ring->SqMapSize = ring->CqMapSize;
+
+    ring->SqMap = mmap(NULL, ring->SqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->Fd, IORING_OFF_SQ_RING);
+    ring->CqMap = single ? ring->SqMap
+                         : mmap(NULL, ring->CqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring->Fd, IORING_OFF_CQ_RING);
+    ring->Sqes = mmap(NULL, ring->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->Fd, IORING_OFF_SQES);
+
+    if (ring->SqMap == MAP_FAILED || ring->CqMap == MAP_FAILED || ring->Sqes == MAP_FAILED) {
+        if (ring->Sqes != MAP_FAILED) munmap(ring->Sqes, ring->SqesSize);
+        if (!single && ring->CqMap != MAP_FAILED) munmap(ring->CqMap, ring->CqMapSize);
+        if (ring->SqMap != MAP_FAILED) munmap(ring->SqMap, ring->SqMapSize);
+        close(ring->Fd);
+        return false;
+    }
+
+    uint8_t *sq = ring->SqMap, *cq = ring->CqMap;
+    ring->SqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->SqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->SqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->SqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->CqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->CqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->CqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->Cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+static void uringTeardown(IOUring *ring)
+{
+    munmap(ring->Sqes, ring->SqesSize);
+    if (ring->CqMap != ring->SqMap) munmap(ring->CqMap, ring->CqMapSize);
+    munmap(ring->SqMap, ring->SqMapSize);
+    close(ring->Fd);
+}
+
+// Hand queued SQEs to the kernel, optionally waiting for at least one completion
+static bool uringEnter(IOUring *ring, bool wait)
+{
+    for (;;) {
+        const long n = syscall(__NR_io_uring_enter, ring->Fd, ring->Queued, wait ? 1 : 0,
+                               wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        countWrites(1, 0);
+        if (n >= 0) {
+            ring->Queued -= n;
+            ring->InFlight += n;
+            if (ring->Queued == 0) return true;
+            wait = false;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static void releaseSlot(IOSlot *slot)
+{
+    if (--slot->Refs > 0) return;
+
+    if (slot->InFd >= 0) close(slot->InFd);
+    slot->InFd = -1;
+}
+
+// Retire every completion in the CQ ring. user_data: slot index in the low half, expected bytes above
+static void uringReap(ImageIO *io)
+{
+    IOUring *ring = &io->Ring;
+    unsigned head = *ring->CqHead;
+    const unsigned tail = __atomic_load_n(ring->CqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ring->Cqes[head & *ring->CqMask];
+        const uint32_t slot = (uint32_t)cqe->user_data, expected = (uint32_t)(cqe->user_data >> 32);
+
+        if (cqe->res < 0 || (uint32_t)cqe->res != expected) {
+            if (!io->Failed)
+                fprintf(stderr, "Error: image write failed: %s\n",
+                        cqe->res < 0 ? strerror(-cqe->res) : "short read or write");
+            io->Failed = true;
+        }
+
+        releaseSlot(&io->Slots[slot]);
+        ring->InFlight--;
+    }
+
+    __atomic_store_n(ring->CqHead, head, __ATOMIC_RELEASE);
+}
+
+// Next free SQE; count SQEs are needed back to back (a linked pair must go in one submission)
+static struct io_uring_sqe *uringSqe(ImageIO *io, unsigned count)
+{
+    IOUring *ring = &io->Ring;
+    const unsigned head = __atomic_load_n(ring->SqHead, __ATOMIC_ACQUIRE);
+    if (*ring->SqTail - head + count > ring->Entries && !uringEnter(ring, false)) return NULL;
+
+    const unsigned tail = *ring->SqTail;
+    const unsigned index = tail & *ring->SqMask;
+    struct io_uring_sqe *sqe = &ring->Sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+
+    ring->SqArray[index] = index;
+    __atomic_store_n(ring->SqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->Queued++;
+
+    return sqe;
+}
+
+static bool uringQueue(ImageIO *io, uint8_t opcode, int fd, size_t slot, size_t delta, size_t len,
+                       uint64_t offset, uint8_t flags)
+{
+    struct io_uring_sqe *sqe = uringSqe(io, flags & IOSQE_IO_LINK ? 2 : 1);
+    if (!sqe) return false;
+
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(io->Slots[slot].Data + delta);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)len << 32 | slot;
+    if (opcode == IORING_OP_WRITE) countWrites(0, len);
+
+    io->Slots[slot].Refs++;
+    return true;
+}
+
+// Cache ----------------------------------
+
+IOCache *newIOCache(void)
+{
+    return calloc(1, sizeof(IOCache));
+}
+
+static void dropCachedRing(IOCache *cache)
+{
+    if (cache->RingDepth) uringTeardown(&cache->Ring);
+    cache->RingDepth = 0;
+}
+
+static void dropCachedBuffers(IOCache *cache)
+{
+    for (unsigned i = 0; i < cache->BufferCount; i++)
+        free(cache->Buffers[i]);
+    cache->BufferCount = 0;
+}
+
+void freeIOCache(IOCache *cache)
+{
+    if (!cache) return;
+
+    dropCachedRing(cache);
+    dropCachedBuffers(cache);
+    free(cache->Buffers);
+    free(cache);
+}
+
+// A ring set up for depth, the cached one when it matches
+static bool acquireRing(IOCache *cache, IOUring *ring, unsigned depth)
+{
+    if (cache && cache->RingDepth == depth) {
+        *ring = cache->Ring;
+        cache->RingDepth = 0;
+        return true;
+    }
+
+    if (cache) dropCachedRing(cache);
+    return uringSetup(ring, 2 * depth);
+}
+
+// Only an idle ring can be handed to the next image, one with lost operations is closed
+static void releaseRing(IOCache *cache, IOUring *ring, unsigned depth)
+{
+    if (!cache || ring->Queued + ring->InFlight > 0) {
+        uringTeardown(ring);
+        return;
+    }
+
+    dropCachedRing(cache);
+    cache->Ring = *ring;
+    cache->RingDepth = depth;
+}
+
+static uint8_t *acquireBuffer(IOCache *cache, size_t size, size_t align)
+{
+    if (cache && cache->BufferCount > 0 && cache->BufferSize == size && cache->BufferAlign == align)
+        return cache->Buffers[--cache->BufferCount];
+
+    uint8_t *data = NULL;
+    return posix_memalign((void **)&data, align, size) == 0 ? data : NULL;
+}
+
+static void releaseBuffer(IOCache *cache, uint8_t *data, size_t size, size_t align)
+{
+    if (!cache || !data) {
+        free(data);
+        return;
+    }
+
+    // Buffers of another size or alignment (a device) replace what is cached
+    if (cache->BufferSize != size || cache->BufferAlign != align) {
+        dropCachedBuffers(cache);
+        cache->BufferSize = size;
+        cache->BufferAlign = align;
+    }
+
+    if (cache->BufferCount == cache->BufferCapacity) {
+        const unsigned capacity = cache->BufferCapacity ? 2 * cache->BufferCapacity : IO_DEFAULT_DEPTH;
+        uint8_t **buffers = realloc(cache->Buffers, capacity * sizeof *buffers);
+        if (!buffers) {
+            free(data);
+            return;
+        }
+        cache->Buffers = buffers;
+        cache->BufferCapacity = capacity;
+    }
+
+    cache->Buffers[cache->BufferCount++] = data;
+}
+
+// Image ----------------------------------
+
+bool probeImageTarget(const char *path, ImageTarget *target)
+{
+    memset(target, 0, sizeof *target);
+    if (isImageStream(path)) return true;
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode)) return true;   // Regular file, created or truncated
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open device %s\n", path);
+        return false;
+    }
+
+    int logical = 0;
+    unsigned int physical = 0, optimal = 0;
+    uint64_t size = 0;
+    const bool ok = ioctl(fd, BLKSSZGET, &logical) == 0 && ioctl(fd, BLKGETSIZE64, &size) == 0;
+
+    // Physical and optimal sizes are hints, 0 when the driver does not report them
+    if (ioctl(fd, BLKPBSZGET, &physical) != 0) physical = 0;
+    if (ioctl(fd, BLKIOOPT, &optimal) != 0) optimal = 0;
+    close(fd);
+
+    if (!ok || logical <= 0) {
+        fprintf(stderr, "Error: could not query block sizes of device %s\n", path);
+        return false;
+    }
+
+    target->IsBlockDevice = true;
+    target->LogicalBlockSize = logical;
+    target->PhysicalBlockSize = physical > (unsigned)logical ? physical : (unsigned)logical;
+    target->OptimalIOSize = optimal;
+    target->Size = size;
+
+    return true;
+}
+
+ImageIO *openImageIO(const ImageContext *ctx)
+{
+    const char *path = ctx->ImageName;
+    const ImageFormat format = ctx->Format;
+    IOBackend backend = ctx->IoBackend;
+
+    ImageTarget target;
+    if (!probeImageTarget(path, &target)) return NULL;
+
+    if ((target.IsBlockDevice || isImageStream(path)) && format != IMAGE_FORMAT_RAW) {
+        fprintf(stderr, "Error: %s can only be written as a raw image\n", path);
+        return NULL;
+    }
+
+    if (isImageStream(path) && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Error: refusing to write a disk image to a terminal\n");
+        return NULL;
+    }
+
+    ImageIO *io = calloc(1, sizeof *io);
+    if (!io) return NULL;
+
+    // A device is written in place, bypassing the page cache; O_EXCL fails while it is mounted.
+    //   A stream is only written on close, strictly front to back
+    io->Direct = target.IsBlockDevice;
+    io->Stream = isImageStream(path);
+    if (io->Stream) backend = IO_BACKEND_SYNC;
+    io->LbaSize = ctx->LbaSize;
+    io->Cache = ctx->IoCache;
+
+    // qcow2 is sparse by construction: zero regions are clusters that were never allocated.
+    //   A stream generates its zero runs, nothing needs to be written for them either
+    io->Sparse = ctx->Sparse || format == IMAGE_FORMAT_QCOW2 || io->Stream;
+
+    io->Fd = io->Stream ? STDOUT_FILENO
+           : io->Direct ? open(path, O_RDWR | O_DIRECT | O_EXCL)
+                        : open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (io->Fd < 0) {
+        fprintf(stderr, "Error: could not open %s %s: %s\n", io->Direct ? "device" : "file", path, strerror(errno));
+        free(io);
+        return NULL;
+    }
+
+    // Whole optimal I/O units per buffer, aligned for the device's physical blocks
+    io->BufferSize = IO_BUFFER_SIZE;
+    if (target.OptimalIOSize > 0)
+        io->BufferSize = (io->BufferSize + target.OptimalIOSize - 1) / target.OptimalIOSize * target.OptimalIOSize;
+    io->BufferAlign = target.PhysicalBlockSize > IO_BUFFER_ALIGN ? target.PhysicalBlockSize : IO_BUFFER_ALIGN;
+
+    // Ring sized for every buffer in a linked read/write pair; no io_uring, no problem
+    io->Depth = ctx->IoDepth ? ctx->IoDepth : IO_DEFAULT_DEPTH;
+    io->Backend = IO_BACKEND_SYNC;
+    if (backend != IO_BACKEND_SYNC) {
+        if (acquireRing(io->Cache, &io->Ring, io->Depth)) {
+            io->Backend = IO_BACKEND_URING;
+        } else if (backend == IO_BACKEND_URING) {
+            fprintf(stderr, "Error: io_uring is not available: %s\n", strerror(errno));
+            close(io->Fd);
+            free(io);
+            return NULL;
+        }
+    }
+
+    // A blocking writer never has more than one buffer in use
+    if (io->Backend == IO_BACKEND_SYNC) io->Depth = 1;
+
+    io->Slots = calloc(io->Depth, sizeof *io->Slots);
+    for (unsigned i = 0; io->Slots && i < io->Depth; i++) {
+        io->Slots[i].InFd = -1;
+        if (!(io->Slots[i].Data = acquireBuffer(io->Cache, io->BufferSize, io->BufferAlign))) io->Failed = true;
+    }
+
+    if (format == IMAGE_FORMAT_QCOW2 && !(io->Qcow2 = newQcow2Map())) io->Failed = true;
+
+    if (!io->Slots || io->Failed) {
+        fprintf(stderr, "Error: could not allocate I/O buffers for %s\n", path);
+        closeImageIO(io);
+        return NULL;
+    }
+
+    return io;
+}
+
+// Streaming ------------------------------
+
+static bool writeAll(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        const ssize_t n = write(fd, data, len);
+        countWrites(1, n > 0 ? n : 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static IORegion *addRegion(ImageIO *io, uint64_t offset, uint64_t len)
+{
+    if (io->RegionCount == io->RegionCapacity) {
+        const size_t capacity = io->RegionCapacity ? io->RegionCapacity * 2 : 256;
+        IORegion *grown = realloc(io->Regions, capacity * sizeof *grown);
+        if (!grown) return NULL;
+        io->Regions = grown;
+        io->RegionCapacity = capacity;
+    }
+
+    IORegion *region = &io->Regions[io->RegionCount];
+    *region = (IORegion) { .Offset = offset, .Length = len, .InFd = -1, .Order = io->RegionCount };
+    io->RegionCount++;
+
+    if (offset + len > io->StreamSize) io->StreamSize = offset + len;
+    return region;
+}
+
+static int compareRegions(const void *a, const void *b)
+{
+    const IORegion *x = a, *y = b;
+    if (x->Offset != y->Offset) return x->Offset < y->Offset ? -1 : 1;
+
+    return (x->Order > y->Order) - (x->Order < y->Order);
+}
+
+// Zero run of len bytes from the (zeroed) pool buffer
+static bool emitZeros(ImageIO *io, uint64_t len)
+{
+    while (len > 0) {
+        const size_t n = len < io->BufferSize ? len : io->BufferSize;
+        if (!writeAll(io->Fd, io->Slots[0].Data, n)) return false;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Payload range: sendfile, or read through the pool buffer where the kernel can not
+static bool emitFile(ImageIO *io, int in, uint64_t inOffset, uint64_t len)
+{
+    while (len > 0) {
+        off_t from = inOffset;
+        ssize_t n = sendfile(io->Fd, in, &from, len < io->BufferSize ? len : io->BufferSize);
+        countWrites(1, n > 0 ? n : 0);
+
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            n = pread(in, io->Slots[0].Data, len < io->BufferSize ? len : io->BufferSize, inOffset);
+            if (n > 0 && !writeAll(io->Fd, io->Slots[0].Data, n)) return false;
+            memset(io->Slots[0].Data, 0, n > 0 ? n : 0);
+        }
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        inOffset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Every region in ascending offset order, the gaps between them as generated zeros
+static bool emitStream(ImageIO *io)
+{
+    qsort(io->Regions, io->RegionCount, sizeof *io->Regions, compareRegions);
+    memset(io->Slots[0].Data, 0, io->BufferSize);
+
+    uint64_t position = 0;
+    for (size_t i = 0; i < io->RegionCount; i++) {
+        const IORegion *region = &io->Regions[i];
+        const uint64_t end = region->Offset + region->Length;
+        if (end <= position) continue;
+
+        // Regions do not overlap; if one ever does, the part already emitted is kept
+        const uint64_t skip = position > region->Offset ? position - region->Offset : 0;
+        if (!emitZeros(io, region->Offset + skip - position)) return false;
+
+        const bool ok = region->Data ? writeAll(io->Fd, region->Data + skip, region->Length - skip)
+                                     : emitFile(io, region->InFd, region->InOffset + skip, region->Length - skip);
+        if (!ok) return false;
+        position = end;
+    }
+
+    return emitZeros(io, io->StreamSize - position);
+}
+
+bool closeImageIO(ImageIO *io)
+{
+    bool ok = ioFlush(io);
+
+    if (io->Backend == IO_BACKEND_URING) releaseRing(io->Cache, &io->Ring, io->Depth);
+
+    // qcow2: tables and header once every data cluster is in place
+    if (io->Qcow2 && ok && !writeQcow2Metadata(io->Qcow2, io->Fd)) ok = false;
+    freeQcow2Map(io->Qcow2);
+
+    if (io->Stream && ok && !emitStream(io)) ok = false;
+    for (size_t i = 0; i < io->RegionCount; i++) {
+        free(io->Regions[i].Data);
+        if (io->Regions[i].InFd >= 0) close(io->Regions[i].InFd);
+    }
+    free(io->Regions);
+
+    // Device: flush its write cache, then let the kernel pick up the new partition table (best effort)
+    if (io->Direct && fsync(io->Fd) != 0) ok = false;
+    if (io->Direct && ok) ioctl(io->Fd, BLKRRPART);
+
+    if (!io->Stream && close(io->Fd) != 0) ok = false;
+
+    for (unsigned i = 0; io->Slots && i < io->Depth; i++)
+        releaseBuffer(io->Cache, io->Slots[i].Data, io->BufferSize, io->BufferAlign);
+    free(io->Slots);
+    free(io);
+
+    return ok;
+}
+
+bool ioResize(ImageIO *io, uint64_t size)
+{
+    if (io->Stream) {
+        if (size > io->StreamSize) io->StreamSize = size;
+        return true;
+    }
+
+    if (io->Qcow2) {
+        setQcow2Size(io->Qcow2, size);
+        return true;
+    }
+
+    return ftruncate(io->Fd, size) == 0;
+}
+
+const char *ioBackendName(const ImageIO *io)
+{
+    return io->Backend == IO_BACKEND_URING ? "io_uring" : "sync";
+}
+
+bool ioSparse(const ImageIO *io)
+{
+    return io->Sparse;
+}
+
+static size_t slotOf(const ImageIO *io, const void *buf)
+{
+    size_t slot = 0;
+    while (io->Slots[slot].Data != buf) slot++;
+
+    return slot;
+}
+
+void *ioAcquire(ImageIO *io, size_t size)
+{
+    if (size > io->BufferSize) return NULL;
+
+    for (;;) {
+        for (unsigned i = 0; i < io->Depth; i++) {
+            if (io->Slots[i].Refs == 0) {
+                io->Slots[i].Refs = 1;
+                return io->Slots[i].Data;
+            }
+        }
+
+        // Every buffer is queued: submit what is pending and wait for one to come back
+        if (io->Backend != IO_BACKEND_URING || io->Ring.Queued + io->Ring.InFlight == 0 ||
+            !uringEnter(&io->Ring, true))
+            return NULL;
+        uringReap(io);
+    }
+}
+
+void ioRelease(ImageIO *io, void *buf)
+{
+    releaseSlot(&io->Slots[slotOf(io, buf)]);
+}
+
+// Write one contiguous piece of a pool buffer to the file
+static bool submitPiece(ImageIO *io, size_t slot, size_t delta, size_t len, uint64_t offset)
+{
+    if (io->Backend == IO_BACKEND_URING) return uringQueue(io, IORING_OP_WRITE, io->Fd, slot, delta, len, offset, 0);
+
+    const uint8_t *data = io->Slots[slot].Data + delta;
+    while (len > 0) {
+        const ssize_t n = pwrite(io->Fd, data, len, offset);
+        countWrites(1, n > 0 ? n : 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            io->Failed = true;
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+bool ioSubmit(ImageIO *io, void *buf, size_t len, uint64_t offset)
+{
+    if (io->Failed) return false;
+
+    // Stream: keep a copy, the buffer goes back to the pool
+    if (io->Stream) {
+        IORegion *region = addRegion(io, offset, len);
+        if (!region || !(region->Data = malloc(len))) {
+            io->Failed = true;
+            return false;
+        }
+        memcpy(region->Data, buf, len);
+        return true;
+    }
+
+    const size_t slot = slotOf(io, buf);
+
+    // qcow2: one write per run of contiguous file clusters, raw: the offset is the file offset
+    for (size_t done = 0; done < len;) {
+        uint64_t at = offset + done;
+        size_t piece = len - done;
+
+        if (io->Qcow2 && (piece = mapQcow2Range(io->Qcow2, offset + done, len - done, &at)) == 0) {
+            io->Failed = true;
+            return false;
+        }
+
+        if (!submitPiece(io, slot, done, piece, at)) return false;
+        done += piece;
+    }
+
+    return true;
+}
+
+bool ioWrite(ImageIO *io, const void *data, size_t len, uint64_t offset)
+{
+    void *buf = ioAcquire(io, len);
+    if (!buf) return false;
+
+    memcpy(buf, data, len);
+    const bool ok = ioSubmit(io, buf, len, offset);
+    ioRelease(io, buf);
+
+    return ok;
+}
+
+bool ioWriteLBA(ImageIO *io, const void *data, size_t len, uint64_t lba)
+{
+    void *buf = ioAcquire(io, io->LbaSize);
+    if (!buf) return false;
+
+    memcpy(buf, data, len);
+    memset((uint8_t *)buf + len, 0, io->LbaSize - len);
+    const bool ok = ioSubmit(io, buf, io->LbaSize, lba * io->LbaSize);
+    ioRelease(io, buf);
+
+    return ok;
+}
+
+// Copy through a pool buffer: read the chunk, then write it like any other buffer.
+//   O_DIRECT pads the write with zeros to whole LBAs
+static bool bufferedCopy(ImageIO *io, int in, uint64_t inOffset, uint64_t outOffset, size_t chunk)
+{
+    uint8_t *buf = ioAcquire(io, io->BufferSize);
+    if (!buf) return false;
+
+    const size_t padded = io->Direct ? bytesToLBAs(chunk, io->LbaSize) * io->LbaSize : chunk;
+    memset(buf + chunk, 0, padded - chunk);
+
+    size_t done = 0;
+    while (done < chunk) {
+        const ssize_t n = pread(in, buf + done, chunk - done, inOffset + done);
+        if (n <= 0 && !(n < 0 && errno == EINTR)) break;
+        if (n > 0) done += n;
+    }
+
+    const bool ok = done == chunk && ioSubmit(io, buf, padded, outOffset);
+    ioRelease(io, buf);
+
+    return ok;
+}
+
+bool ioCopy(ImageIO *io, int in, uint64_t inOffset, uint64_t outOffset, uint64_t len)
+{
+    if (io->Failed) return false;
+
+    // Stream: small ranges are read now, large ones keep a descriptor of their own until close
+    if (io->Stream) {
+        IORegion *region = addRegion(io, outOffset, len);
+        if (region && len <= IO_BUFFER_SIZE) {
+            region->Data = malloc(len);
+            if (region->Data && pread(in, region->Data, len, inOffset) == (ssize_t)len) return true;
+        } else if (region) {
+            region->InFd = dup(in);
+            region->InOffset = inOffset;
+            if (region->InFd >= 0) return true;
+        }
+        io->Failed = true;
+        return false;
+    }
+
+    if (io->Backend == IO_BACKEND_SYNC && !io->Direct && !io->Qcow2)
+        return copyRangeToImage(in, io->Fd, inOffset, outOffset, len);
+
+    // io_uring: one linked read -> write pair per buffer; each pair owns a duplicate of the source descriptor.
+    //   For a device the write covers whole LBAs, the tail past the read is zeroed up front.
+    //   qcow2 may split a write into several runs, those only go out once the read is done
+    while (len > 0) {
+        const size_t chunk = len < io->BufferSize ? len : io->BufferSize;
+        const size_t written = io->Direct ? bytesToLBAs(chunk, io->LbaSize) * io->LbaSize : chunk;
+
+        if (io->Backend == IO_BACKEND_SYNC || io->Qcow2) {
+            if (!bufferedCopy(io, in, inOffset, outOffset, chunk)) return false;
+        } else {
+            uint8_t *buf = ioAcquire(io, io->BufferSize);
+            if (!buf) return false;
+            memset(buf + chunk, 0, written - chunk);
+
+            const size_t slot = slotOf(io, buf);
+            io->Slots[slot].InFd = dup(in);
+
+            const bool ok = io->Slots[slot].InFd >= 0 &&
+                            uringQueue(io, IORING_OP_READ, io->Slots[slot].InFd, slot, 0, chunk, inOffset, IOSQE_IO_LINK) &&
+                            uringQueue(io, IORING_OP_WRITE, io->Fd, slot, 0, written, outOffset, 0);
+            ioRelease(io, buf);
+            if (!ok) return false;
+        }
+
+        len -= chunk;
+        inOffset += chunk;
+        outOffset += chunk;
+    }
+
+    return true;
+}
+
+bool ioClone(ImageIO *io, int in, uint64_t inOffset, uint64_t outOffset, uint64_t len)
+{
+    if (io->Failed) return false;
+    if (io->Stream || io->Direct || io->Qcow2) return ioCopy(io, in, inOffset, outOffset, len);
+
+    // Reflink shares the source extents, no data is read or written. Queued writes never
+    //   overlap the range, so the clone does not have to wait for them
+    struct file_clone_range range = {
+        .src_fd = in, .src_offset = inOffset, .src_length = len, .dest_offset = outOffset,
+    };
+    countWrites(1, 0);
+    if (ioctl(io->Fd, FICLONERANGE, &range) == 0) {
+        countWrites(0, len);
+        return true;
+    }
+
+    return copyRangeToImage(in, io->Fd, inOffset, outOffset, len);
+}
+
+bool ioFlush(ImageIO *io)
+{
+    if (io->Backend == IO_BACKEND_URING) {
+        while (io->Ring.Queued + io->Ring.InFlight > 0) {
+            if (!uringEnter(&io->Ring, true)) {
+                io->Failed = true;
+                break;
+            }
+            uringReap(io);
+        }
+    }
+
+    return !io->Failed;
+}
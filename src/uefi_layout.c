@@ -0,0 +1,304 @@
+#include <uefi_layout.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <uefi_copy.h>
+#include <uefi_image.h>
+
+// Partition type aliases (Discoverable Partitions Specification / UEFI)
+static const struct {
+
+    const char     *Alias;
+    const char     *Type;
+    const char16_t *Name;   // Default partition name
+
+} partitionTypes[] = {
+    { "esp",               "C12A7328-F81F-11D2-BA4B-00A0C93EC93B", u"EFI SYSTEM" },
+    { "data",              "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", u"BASIC DATA" },
+    { "linux",             "0FC63DAF-8483-4772-8E79-3D69D8477DE4", u"linux" },
+    { "linux-root-x86-64", "4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709", u"root-x86-64" },
+    { "linux-root-arm64",  "B921B045-1DF0-41C3-AF44-4C6F280D3FAE", u"root-arm64" },
+    { "linux-usr-x86-64",  "8484680C-9521-48C6-9C11-B0720656F69E", u"usr-x86-64" },
+    { "linux-usr-arm64",   "B0E01050-EE5F-4390-949A-9101B17104E9", u"usr-arm64" },
+    { "swap",              "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", u"swap" },
+    { "home",              "933AC7E1-2EB4-4F13-B844-0E14E2AEF915", u"home" },
+    { "srv",               "3B8F8425-20E0-4F3B-907F-1A25A76F98E8", u"srv" },
+    { "var",               "4D21B016-B534-45C2-A9FB-5C16E091FD2D", u"var" },
+    { "bios-boot",         "21686148-6449-6E6F-744E-656564454649", u"BIOS BOOT" },
+};
+
+// "C12A7328-F81F-11D2-BA4B-00A0C93EC93B": first three groups are little-endian fields, the rest bytes
+static bool parseGuid(const char *str, Guid *guid)
+{
+    int n = 0;
+    const int fields = sscanf(str, "%8x-%4hx-%4hx-%2hhx%2hhx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%n",
+                              &guid->TimeLow, &guid->TimeMid, &guid->TimeHighAndVersion,
+                              &guid->ClockSeqHighAndReversed, &guid->ClockSeqLow,
+                              &guid->Node[0], &guid->Node[1], &guid->Node[2],
+                              &guid->Node[3], &guid->Node[4], &guid->Node[5], &n);
+
+    return fields == 11 && n == 36 && str[n] == '\0';
+}
+
+bool parsePartitionSpec(const char *str, PartitionSpec *part)
+{
+    // TYPE:SIZE[:NAME[:ATTRIBUTES]][=FILE], the file path may hold ':' itself
+    const char *source = strchr(str, '=');
+    const size_t len = source ? (size_t)(source - str) : strlen(str);
+
+    char buf[256];
+    if (len >= sizeof buf) {
+        fprintf(stderr, "Error: partition spec %s is too long\n", str);
+        return false;
+    }
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    char *fields[4] = { buf, NULL, NULL, NULL };
+    for (int i = 1; i < 4; i++) {
+        fields[i] = fields[i - 1] ? strchr(fields[i - 1], ':') : NULL;
+        if (fields[i]) *fields[i]++ = '\0';
+    }
+
+    memset(part, 0, sizeof *part);
+
+    const char16_t *name = u"";
+    bool known = false;
+    for (size_t i = 0; i < sizeof partitionTypes / sizeof partitionTypes[0] && !known; i++) {
+        if (strcasecmp(fields[0], partitionTypes[i].Alias) == 0) {
+            known = parseGuid(partitionTypes[i].Type, &part->Type);
+            name = partitionTypes[i].Name;
+        }
+    }
+    if (!known && !parseGuid(fields[0], &part->Type)) {
+        fprintf(stderr, "Error: unknown partition type %s\n", fields[0]);
+        return false;
+    }
+
+    if (source) {
+        part->Source = source + 1;
+        if (memcmp(&part->Type, &EFI_GUID, sizeof EFI_GUID) == 0) {
+            fprintf(stderr, "Error: the ESP is filled from esp-dir, not from %s\n", part->Source);
+            return false;
+        }
+    }
+
+    // "auto": exactly the payload, rounded up to whole LBAs by the layout
+    if (source && fields[1] && strcmp(fields[1], "auto") == 0) {
+        if (!hostFileSize(part->Source, &part->Size)) return false;
+        if (part->Size == 0) {
+            fprintf(stderr, "Error: payload %s is empty, partition %s needs a size\n", part->Source, str);
+            return false;
+        }
+    } else if (!fields[1] || (strcmp(fields[1], "rest") != 0 && (!parseSize(fields[1], &part->Size) || part->Size == 0))) {
+        fprintf(stderr, "Error: partition %s needs a size, \"rest\" or, with a file, \"auto\"\n", str);
+        return false;
+    }
+
+    if (fields[2] && *fields[2]) {
+        // ASCII only, widened to UTF-16
+        size_t len = strlen(fields[2]);
+        if (len >= sizeof part->Name / sizeof part->Name[0]) {
+            fprintf(stderr, "Error: partition name %s is longer than 35 characters\n", fields[2]);
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if ((unsigned char)fields[2][i] > 0x7F) {
+                fprintf(stderr, "Error: partition name %s is not ASCII\n", fields[2]);
+                return false;
+            }
+            part->Name[i] = (unsigned char)fields[2][i];
+        }
+    } else {
+        for (size_t i = 0; name[i] && i + 1 < sizeof part->Name / sizeof part->Name[0]; i++)
+            part->Name[i] = name[i];
+    }
+
+    if (fields[3]) {
+        char *end = NULL;
+        part->Attributes = strtoull(fields[3], &end, 0);
+        if (end == fields[3] || *end != '\0') {
+            fprintf(stderr, "Error: invalid partition attributes %s\n", fields[3]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t alignUp(const ImageContext *ctx, uint64_t lba)
+{
+    return (lba + ctx->AlignLBA - 1) / ctx->AlignLBA * ctx->AlignLBA;
+}
+
+// Place partitions one after another on ALIGNMENT boundaries; the "rest" partition gets restLBAs.
+//   Returns the LBA right after the last partition, a zero-sized one ending where it starts
+static uint64_t placePartitions(ImageContext *ctx, const PartitionSpec *parts, size_t count, uint64_t restLBAs,
+                                GptPartitionEntry *table)
+{
+    uint64_t next = 2 + ctx->GptTableLBAs;   // MBR, GPT header, primary table
+    uint64_t end = next;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t start = alignUp(ctx, next);
+        const uint64_t size = parts[i].Size ? bytesToLBAs(parts[i].Size, ctx->LbaSize) : restLBAs;
+
+        if (table && size) {
+            table[i].PartitionTypeGUID = parts[i].Type;
+            table[i].UniquePartitionGUID = new_guid(ctx);
+            table[i].StartingLBA = start;
+            table[i].EndingLBA = start + size - 1;
+            table[i].Attributes = parts[i].Attributes;
+            memcpy(table[i].PartitionName, parts[i].Name, sizeof table[i].PartitionName);
+        }
+
+        next = end = start + size;
+    }
+
+    return end;
+}
+
+// Partitions of the current image; no explicit layout is the classic ESP + basic data pair
+static const PartitionSpec *currentPartitions(const ImageContext *ctx, PartitionSpec defaults[2], size_t *count)
+{
+    defaults[0] = (PartitionSpec){ .Type = EFI_GUID, .Size = ctx->EspSize, .Name = u"EFI SYSTEM" };
+    defaults[1] = (PartitionSpec){ .Type = BASIC_DATA_GUID, .Size = ctx->DataSize, .Name = u"BASIC DATA",
+                                   .Source = ctx->DataSource };
+
+    *count = ctx->PartitionCount ? ctx->PartitionCount : 2;
+    return ctx->PartitionCount ? ctx->Partitions : defaults;
+}
+
+// Payload of partition index against the size it was given; its byte count in *size
+static bool payloadFits(const ImageContext *ctx, const PartitionSpec *part, size_t index,
+                        const GptPartitionEntry *entry, uint64_t *size)
+{
+    if (!hostFileSize(part->Source, size)) return false;
+
+    const uint64_t partBytes = (entry->EndingLBA - entry->StartingLBA + 1) * ctx->LbaSize;
+    if (*size > partBytes) {
+        fprintf(stderr, "Error: payload %s (%llu bytes) does not fit in partition %zu (%llu bytes)\n",
+                part->Source, (unsigned long long)*size, index + 1, (unsigned long long)partBytes);
+        return false;
+    }
+
+    return true;
+}
+
+bool planLayout(ImageContext *ctx, GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES])
+{
+    const uint64_t lbaSize = ctx->LbaSize, diskSize = ctx->DiskSize;
+    ctx->GptTableLBAs = GPT_TABLE_SIZE / lbaSize;
+    ctx->AlignLBA = ALIGNMENT / lbaSize;
+    memset(table, 0, NUMBER_OF_GPT_TABLE_ENTRIES * sizeof *table);
+
+    // Sizes and payload of the default pair would be dropped without a word
+    if (ctx->PartitionCount && ctx->PairOption) {
+        fprintf(stderr, "Error: %s only applies to the default ESP + data layout, not with part\n", ctx->PairOption);
+        return false;
+    }
+
+    PartitionSpec defaults[2];
+    size_t count = 0;
+    const PartitionSpec *parts = currentPartitions(ctx, defaults, &count);
+
+    if (count > NUMBER_OF_GPT_TABLE_ENTRIES) {
+        fprintf(stderr, "Error: %zu partitions, GPT holds at most %d\n", count, NUMBER_OF_GPT_TABLE_ENTRIES);
+        return false;
+    }
+
+    size_t rest = count;
+    for (size_t i = 0; i < count; i++) {
+        if (parts[i].Size) continue;
+        if (rest != count) {
+            fprintf(stderr, "Error: only one partition can take the rest of the disk\n");
+            return false;
+        }
+        rest = i;
+    }
+
+    if (diskSize) ctx->ImageSizeLBAs = diskSize / lbaSize;
+
+    // Everything but the "rest" partition decides how much is left for it
+    uint64_t restLBAs = 0;
+    if (rest < count) {
+        if (!diskSize) {
+            fprintf(stderr, "Error: a partition sized \"rest\" needs disk-size\n");
+            return false;
+        }
+
+        const uint64_t end = placePartitions(ctx, parts, count, 0, NULL);
+        const uint64_t lastUsable = ctx->ImageSizeLBAs > ctx->GptTableLBAs + 2
+                                  ? ctx->ImageSizeLBAs - 2 - ctx->GptTableLBAs : 0;
+        restLBAs = lastUsable + 1 > end ? lastUsable + 1 - end : 0;
+        if (rest + 1 < count) restLBAs -= restLBAs % ctx->AlignLBA;
+
+        if (restLBAs == 0) {
+            fprintf(stderr, "Error: no space left on a %llu byte disk for the \"rest\" partition\n",
+                    (unsigned long long)diskSize);
+            return false;
+        }
+    }
+
+    const uint64_t end = placePartitions(ctx, parts, count, restLBAs, table);
+
+    // Backup table and header follow the last partition, the disk ends on an ALIGNMENT boundary
+    const uint64_t needed = end + ctx->GptTableLBAs + 1;
+    if (!diskSize) {
+        ctx->ImageSizeLBAs = alignUp(ctx, needed);
+    } else if (ctx->ImageSizeLBAs < needed) {
+        fprintf(stderr, "Error: partitions need %llu bytes, disk-size is %llu\n",
+                (unsigned long long)(needed * lbaSize), (unsigned long long)diskSize);
+        return false;
+    }
+    ctx->ImageSize = ctx->ImageSizeLBAs * lbaSize;
+
+    // Payloads are checked here, before the target is opened and an existing file truncated
+    for (size_t i = 0; i < count; i++) {
+        uint64_t size = 0;
+        if (parts[i].Source && !payloadFits(ctx, &parts[i], i, &table[i], &size)) return false;
+    }
+
+    ctx->EspLBA = ctx->EspSizeLBAs = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(&table[i].PartitionTypeGUID, &EFI_GUID, sizeof EFI_GUID) == 0) {
+            ctx->EspLBA = table[i].StartingLBA;
+            ctx->EspSizeLBAs = table[i].EndingLBA - table[i].StartingLBA + 1;
+            break;
+        }
+    }
+
+    return true;
+}
+
+const char *partitionSource(const ImageContext *ctx, size_t index)
+{
+    PartitionSpec defaults[2];
+    size_t count = 0;
+    const PartitionSpec *parts = currentPartitions(ctx, defaults, &count);
+
+    return index < count ? parts[index].Source : NULL;
+}
+
+bool writePartitionPayloads(const ImageContext *ctx, ImageIO *io,
+                            const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES])
+{
+    const uint64_t lbaSize = ctx->LbaSize;
+    PartitionSpec defaults[2];
+    size_t count = 0;
+    const PartitionSpec *parts = currentPartitions(ctx, defaults, &count);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!parts[i].Source) continue;
+
+        // Again, the file may have grown since planLayout
+        uint64_t size = 0;
+        if (!payloadFits(ctx, &parts[i], i, &table[i], &size)) return false;
+
+        if (!copyPayloadToImage(io, parts[i].Source, table[i].StartingLBA * lbaSize, size)) return false;
+    }
+
+    return true;
+}
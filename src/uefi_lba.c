@@ -1,7 +1,5 @@
 #include <uefi_lba.h>
 
-void writeFullLBASize(FILE *image) {
-    uint8_t zero_sector[512];
-    for (uint8_t i = 0; i < (lbaSize - sizeof zero_sector) / sizeof zero_sector; i++)
-        fwrite(zero_sector, sizeof zero_sector, 1, image);
-}
+// External definitions of the inline helpers, for the calls the compiler does not inline
+extern inline uint64_t bytesToLBAs(const uint64_t bytes, const uint64_t lbaSize);
+extern inline uint64_t nextAlignedLBA(const uint64_t LBA, const uint64_t alignLBA);
@@ -1,8 +1,8 @@
 #include <uefi_mbr.h>
 
-bool writeMBR(FILE *image)
+bool writeMBR(const ImageContext *ctx, ImageIO *io)
 {
-    uint64_t mbrSizeLBAs = imageSizeLBAs;
+    uint64_t mbrSizeLBAs = ctx->ImageSizeLBAs;
     if(mbrSizeLBAs > 0xFFFFFFFF) mbrSizeLBAs = 0x100000000;
 
     Mbr mbr = {
@@ -23,10 +23,6 @@ bool writeMBR(FILE *image)
 
     };
 
-    // Write to file
-    if(fwrite(&mbr, 1, sizeof mbr, image) != sizeof mbr) return false;
-
-    writeFullLBASize(image);
-
-    return true;
+    // Write to LBA 0
+    return ioWriteLBA(io, &mbr, sizeof mbr, 0);
 }
@@ -0,0 +1,191 @@
+#include <uefi_qcow2.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+
+#include <uefi_stats.h>
+
+enum {
+    L2_ENTRIES = QCOW2_CLUSTER_SIZE / sizeof(uint64_t),                             // Clusters mapped by one L2 table
+    REFCOUNTS_PER_BLOCK = QCOW2_CLUSTER_SIZE / ((1 << QCOW2_REFCOUNT_ORDER) / 8),   // Clusters counted by one refcount block
+};
+
+#define QCOW_OFLAG_COPIED (1ULL << 63)      // Refcount is exactly 1, the cluster may be written in place
+
+struct Qcow2Map {
+
+    uint64_t    Size;           // Virtual disk size
+    uint64_t  **L2;             // In-memory L2 tables by L1 index, host offsets (0 - unallocated)
+    size_t      L1Count;        // Length of L2
+    uint64_t    NextCluster;    // Next free host cluster, 0 is the header
+
+};
+
+Qcow2Map *newQcow2Map(void)
+{
+    Qcow2Map *map = calloc(1, sizeof *map);
+    if (map) map->NextCluster = 1;
+
+    return map;
+}
+
+void freeQcow2Map(Qcow2Map *map)
+{
+    if (!map) return;
+
+    for (size_t i = 0; i < map->L1Count; i++) free(map->L2[i]);
+    free(map->L2);
+    free(map);
+}
+
+void setQcow2Size(Qcow2Map *map, uint64_t size)
+{
+    if (size > map->Size) map->Size = size;
+}
+
+// L2 entry of a virtual cluster, the table is created on first use
+static uint64_t *l2Entry(Qcow2Map *map, uint64_t cluster)
+{
+    const size_t index = cluster / L2_ENTRIES;
+
+    if (index >= map->L1Count) {
+        size_t count = map->L1Count ? map->L1Count : 16;
+        while (count <= index) count *= 2;
+
+        uint64_t **grown = realloc(map->L2, count * sizeof *grown);
+        if (!grown) return NULL;
+        memset(grown + map->L1Count, 0, (count - map->L1Count) * sizeof *grown);
+        map->L2 = grown;
+        map->L1Count = count;
+    }
+
+    if (!map->L2[index] && !(map->L2[index] = calloc(L2_ENTRIES, sizeof(uint64_t)))) return NULL;
+
+    return &map->L2[index][cluster % L2_ENTRIES];
+}
+
+uint64_t mapQcow2Range(Qcow2Map *map, uint64_t offset, uint64_t len, uint64_t *hostOffset)
+{
+    uint64_t done = 0;
+
+    // Extend the run while the next virtual cluster sits right after the previous one in the file
+    while (done < len) {
+        const uint64_t at = offset + done;
+        uint64_t *entry = l2Entry(map, at >> QCOW2_CLUSTER_BITS);
+        if (!entry) break;
+        if (*entry == 0) *entry = map->NextCluster++ << QCOW2_CLUSTER_BITS;
+
+        const uint64_t within = at & (QCOW2_CLUSTER_SIZE - 1);
+        if (done == 0) *hostOffset = *entry + within;
+        else if (*entry + within != *hostOffset + done) break;
+
+        const uint64_t piece = QCOW2_CLUSTER_SIZE - within;
+        done += piece < len - done ? piece : len - done;
+    }
+
+    setQcow2Size(map, offset + done);
+    return done;
+}
+
+static bool writeAt(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    const uint8_t *data = buf;
+    while (len > 0) {
+        const ssize_t n = pwrite(fd, data, len, offset);
+        countWrites(1, n > 0 ? n : 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+static uint64_t clustersFor(uint64_t bytes)
+{
+    return (bytes + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+}
+
+bool writeQcow2Metadata(const Qcow2Map *map, int fd)
+{
+    // Metadata goes after the data clusters: L2 tables, L1 table, refcount table, refcount blocks
+    const uint64_t l2PerL1 = (uint64_t)L2_ENTRIES * QCOW2_CLUSTER_SIZE;
+    const uint64_t l1Size = (map->Size + l2PerL1 - 1) / l2PerL1;
+    size_t l2Tables = 0;
+    for (size_t i = 0; i < map->L1Count; i++) l2Tables += map->L2[i] != NULL;
+
+    const uint64_t l2Cluster = map->NextCluster;
+    const uint64_t l1Cluster = l2Cluster + l2Tables;
+    const uint64_t l1Clusters = l1Size ? clustersFor(l1Size * sizeof(uint64_t)) : 1;
+    const uint64_t tableCluster = l1Cluster + l1Clusters;
+
+    // The refcount blocks count themselves and the table that points at them
+    uint64_t blocks = 0, tableClusters = 0, total = 0;
+    for (;;) {
+        total = tableCluster + tableClusters + blocks;
+        const uint64_t needBlocks = (total + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+        const uint64_t needTable = clustersFor(needBlocks * sizeof(uint64_t));
+        if (needBlocks == blocks && needTable == tableClusters) break;
+        blocks = needBlocks;
+        tableClusters = needTable;
+    }
+    const uint64_t blockCluster = tableCluster + tableClusters;
+
+    const uint64_t l1Bytes = l1Clusters * QCOW2_CLUSTER_SIZE;
+    const uint64_t tableBytes = tableClusters * QCOW2_CLUSTER_SIZE;
+    const uint64_t blockBytes = blocks * QCOW2_CLUSTER_SIZE;
+    uint64_t *l2 = malloc(QCOW2_CLUSTER_SIZE);
+    uint64_t *l1 = calloc(1, l1Bytes);
+    uint64_t *table = calloc(1, tableBytes);
+    uint16_t *refcounts = calloc(1, blockBytes);
+    bool ok = l2 && l1 && table && refcounts;
+
+    // Every cluster of the file is used exactly once, so every mapping carries the COPIED flag
+    uint64_t next = l2Cluster;
+    for (size_t i = 0; ok && i < map->L1Count; i++) {
+        if (!map->L2[i]) continue;
+
+        for (size_t j = 0; j < L2_ENTRIES; j++)
+            l2[j] = map->L2[i][j] ? htobe64(map->L2[i][j] | QCOW_OFLAG_COPIED) : 0;
+
+        l1[i] = htobe64((next << QCOW2_CLUSTER_BITS) | QCOW_OFLAG_COPIED);
+        ok = writeAt(fd, l2, QCOW2_CLUSTER_SIZE, next << QCOW2_CLUSTER_BITS);
+        next++;
+    }
+
+    for (uint64_t i = 0; ok && i < blocks; i++) table[i] = htobe64((blockCluster + i) << QCOW2_CLUSTER_BITS);
+    for (uint64_t i = 0; ok && i < total; i++) refcounts[i] = htobe16(1);
+
+    const Qcow2Header header = {
+        .Magic = htobe32(QCOW2_MAGIC),
+        .Version = htobe32(QCOW2_VERSION),
+        .ClusterBits = htobe32(QCOW2_CLUSTER_BITS),
+        .Size = htobe64(map->Size),
+        .L1Size = htobe32(l1Size),
+        .L1TableOffset = htobe64(l1Cluster << QCOW2_CLUSTER_BITS),
+        .RefcountTableOffset = htobe64(tableCluster << QCOW2_CLUSTER_BITS),
+        .RefcountTableClusters = htobe32(tableClusters),
+        .RefcountOrder = htobe32(QCOW2_REFCOUNT_ORDER),
+        .HeaderLength = htobe32(sizeof header),
+    };
+
+    // Header last, the rest of cluster 0 stays zero: no header extensions
+    ok = ok && writeAt(fd, l1, l1Bytes, l1Cluster << QCOW2_CLUSTER_BITS) &&
+         writeAt(fd, table, tableBytes, tableCluster << QCOW2_CLUSTER_BITS) &&
+         writeAt(fd, refcounts, blockBytes, blockCluster << QCOW2_CLUSTER_BITS) &&
+         writeAt(fd, &header, sizeof header, 0);
+
+    free(l2);
+    free(l1);
+    free(table);
+    free(refcounts);
+
+    return ok;
+}
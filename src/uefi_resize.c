@@ -0,0 +1,184 @@
+#include <uefi_resize.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <uefi_mbr.h>
+#include <uefi_gpt.h>
+#include <uefi_io.h>
+
+// Header with a fresh CRC, padded with zeros to its whole LBA
+static bool writeHeader(int fd, GptHeader *header, uint64_t lbaBytes)
+{
+    header->HeaderCRC32 = 0;
+    header->HeaderCRC32 = calculateCRC32(header, header->HeaderSize);
+
+    uint8_t sector[4096] = { 0 };
+    memcpy(sector, header, sizeof *header);
+    return pwrite(fd, sector, lbaBytes, header->MyLBA * lbaBytes) == (ssize_t)lbaBytes;
+}
+
+// Protective MBR covers the whole disk, capped like writeMBR; anything else (hybrid MBR) is left alone
+static bool updateProtectiveMBR(int fd, uint64_t diskLBAs)
+{
+    Mbr mbr;
+    if (pread(fd, &mbr, sizeof mbr, 0) != sizeof mbr) return false;
+    if (mbr.Signature != 0xAA55 || mbr.PartitionRecord[0].OSType != 0xEE) return true;
+
+    mbr.PartitionRecord[0].SizeInLBA = diskLBAs - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : diskLBAs - 1;
+    return pwrite(fd, &mbr, sizeof mbr, 0) == sizeof mbr;
+}
+
+// Stale backup GPT in the middle of the disk: a hole in a file, zeros on a device
+static bool clearRange(int fd, bool device, uint64_t offset, uint64_t len)
+{
+    if (!device && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) return true;
+
+    static const uint8_t zeros[4096];
+    while (len > 0) {
+        const size_t chunk = len < sizeof zeros ? len : sizeof zeros;
+        if (pwrite(fd, zeros, chunk, offset) != (ssize_t)chunk) return false;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+// Used entry with the highest EndingLBA, -1 if the table is empty
+static long lastPartition(const uint8_t *array, const GptHeader *header)
+{
+    static const Guid unused = { 0 };
+    long last = -1;
+    uint64_t end = 0;
+
+    for (uint32_t i = 0; i < header->NumberOfPartitionEntries; i++) {
+        const GptPartitionEntry *entry = (const GptPartitionEntry *)(array + (size_t)i * header->SizeOfPartition);
+        if (memcmp(&entry->PartitionTypeGUID, &unused, sizeof unused) == 0) continue;
+        if (last < 0 || entry->EndingLBA > end) {
+            last = i;
+            end = entry->EndingLBA;
+        }
+    }
+
+    return last;
+}
+
+bool resizeImage(const char *path, uint64_t size, bool growLast)
+{
+    ImageTarget target;
+    if (!probeImageTarget(path, &target)) return false;
+
+    // A device grows to its full size unless told otherwise
+    if (target.IsBlockDevice && size == 0) size = target.Size;
+    if (size == 0) {
+        fprintf(stderr, "Error: resizing image file %s needs --disk-size\n", path);
+        return false;
+    }
+    if (target.IsBlockDevice && size > target.Size) {
+        fprintf(stderr, "Error: disk-size %llu is larger than device %s (%llu bytes)\n",
+                (unsigned long long)size, path, (unsigned long long)target.Size);
+        return false;
+    }
+
+    const int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    const uint64_t lbaBytes = detectImageLBASize(fd);
+    GptHeader primary;
+    uint8_t *array = NULL;
+    size_t arraySize = 0;
+
+    bool ok = fstat(fd, &st) == 0 && lbaBytes && readGptHeader(fd, 1, lbaBytes, &primary) &&
+              (array = readGptEntries(fd, &primary, lbaBytes, &arraySize)) != NULL;
+    if (!ok) {
+        fprintf(stderr, "Error: %s is not a valid raw GPT image\n", path);
+        free(array);
+        close(fd);
+        return false;
+    }
+
+    // Backup array and header end the disk; everything in between is the usable area
+    const uint64_t tableLBAs = (arraySize + lbaBytes - 1) / lbaBytes;
+    const uint64_t diskLBAs = size / lbaBytes;
+    const uint64_t oldHeaderLBA = primary.AlternateLBA, oldArrayLBA = oldHeaderLBA - tableLBAs;
+    const uint64_t newHeaderLBA = diskLBAs - 1, newArrayLBA = newHeaderLBA - tableLBAs;
+    const uint64_t lastUsable = newArrayLBA - 1;
+
+    const uint64_t fileSize = target.IsBlockDevice ? 0 : (uint64_t)st.st_size;
+    if (diskLBAs == 0 || newHeaderLBA < oldHeaderLBA || diskLBAs * lbaBytes < fileSize) {
+        fprintf(stderr, "Error: %s can only grow, %llu bytes is smaller than the image\n",
+                path, (unsigned long long)size);
+        ok = false;
+    }
+
+    // Optionally the last partition takes all the new space
+    const long last = ok && growLast ? lastPartition(array, &primary) : -1;
+    GptPartitionEntry *grown = last >= 0 ? (GptPartitionEntry *)(array + (size_t)last * primary.SizeOfPartition)
+                                         : NULL;
+    if (ok && growLast && !grown) {
+        fprintf(stderr, "Error: %s has no partition to grow\n", path);
+        ok = false;
+    }
+
+    if (!ok) {
+        free(array);
+        close(fd);
+        return false;
+    }
+    if (grown && grown->EndingLBA < lastUsable) grown->EndingLBA = lastUsable;
+
+    primary.AlternateLBA = newHeaderLBA;
+    primary.LastUsableLBA = lastUsable;
+    primary.PartitionEntryArrayCRC32 = calculateCRC32(array, arraySize);
+
+    GptHeader backup = primary;
+    backup.MyLBA = newHeaderLBA;
+    backup.AlternateLBA = primary.MyLBA;
+    backup.PartitionEntryLBA = newArrayLBA;
+
+    // New backup first, so the primary never points at a missing one; the file grows as a hole
+    if (!target.IsBlockDevice && diskLBAs * lbaBytes > fileSize) ok = ftruncate(fd, diskLBAs * lbaBytes) == 0;
+
+    ok = ok && pwrite(fd, array, arraySize, newArrayLBA * lbaBytes) == (ssize_t)arraySize &&
+         writeHeader(fd, &backup, lbaBytes) && fdatasync(fd) == 0;
+
+    const uint64_t primaryArray = primary.PartitionEntryLBA * lbaBytes;
+    ok = ok && (!grown || pwrite(fd, array, arraySize, primaryArray) == (ssize_t)arraySize) &&
+         writeHeader(fd, &primary, lbaBytes) && updateProtectiveMBR(fd, diskLBAs);
+
+    // Old backup area up to where the new one starts (a small growth overlaps it)
+    if (ok && newHeaderLBA != oldHeaderLBA) {
+        const uint64_t end = oldHeaderLBA + 1 < newArrayLBA ? oldHeaderLBA + 1 : newArrayLBA;
+        if (end > oldArrayLBA)
+            ok = clearRange(fd, target.IsBlockDevice, oldArrayLBA * lbaBytes, (end - oldArrayLBA) * lbaBytes);
+    }
+
+    // Device: flush its write cache, then let the kernel pick up the new partition table (best effort)
+    if (ok && fsync(fd) != 0) ok = false;
+    if (ok && target.IsBlockDevice) ioctl(fd, BLKRRPART);
+
+    if (close(fd) != 0) ok = false;
+
+    if (!ok) {
+        fprintf(stderr, "Error: could not resize %s\n", path);
+    } else {
+        printf("%s: %llu bytes, backup GPT at LBA %llu\n", path,
+               (unsigned long long)(diskLBAs * lbaBytes), (unsigned long long)newHeaderLBA);
+        if (grown)
+            printf("%s: partition %ld ends at LBA %llu\n", path, last + 1, (unsigned long long)grown->EndingLBA);
+    }
+
+    free(array);
+    return ok;
+}
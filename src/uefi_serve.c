@@ -0,0 +1,346 @@
+#include <uefi_serve.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <uefi_batch.h>
+#include <uefi_io.h>
+
+enum {
+    SERVE_LINE_MAX = 4096,      // Longest request line
+    SERVE_FDS_MAX = 16,         // Descriptors received and not yet taken by a request
+    SERVE_BACKLOG = 128,
+};
+
+typedef struct {
+
+    const ImageContext *Base;
+    int                 Listen;
+    atomic_bool         Stopping;
+    pthread_mutex_t     Lock;       // Guards Clients
+    int                *Clients;    // Connection of each worker, -1 while it waits in accept
+    atomic_size_t       Built;
+    atomic_size_t       Failed;
+
+} Server;
+
+typedef struct {
+
+    Server     *Server;
+    unsigned    Index;
+
+} Worker;
+
+// One client: bytes not cut into lines yet and the descriptors that came with them
+typedef struct {
+
+    int     Fd;
+    char    Buffer[SERVE_LINE_MAX + 1];
+    size_t  Used;
+    int     Fds[SERVE_FDS_MAX];
+    size_t  FdCount;
+
+} Connection;
+
+static uint64_t nowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+// More request bytes plus any SCM_RIGHTS descriptors; 0 at the end of the connection, -1 on error
+static ssize_t receive(Connection *c)
+{
+    union {
+        struct cmsghdr  Align;
+        char            Data[CMSG_SPACE(SERVE_FDS_MAX * sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = c->Buffer + c->Used, .iov_len = SERVE_LINE_MAX - c->Used };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.Data,
+                          .msg_controllen = sizeof control.Data };
+
+    ssize_t n;
+    do n = recvmsg(c->Fd, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) return n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof fd, sizeof fd);
+            if (c->FdCount < SERVE_FDS_MAX) c->Fds[c->FdCount++] = fd;
+            else                            close(fd);
+        }
+    }
+
+    c->Used += n;
+    return n;
+}
+
+static bool reply(int fd, const char *text)
+{
+    size_t len = strlen(text);
+    while (len > 0) {
+        const ssize_t n = send(fd, text, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        text += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Build one request line; false if the client is gone and the answer could not be sent
+static bool serveRequest(Server *s, IOCache *cache, Connection *c, char *line)
+{
+    const uint64_t start = nowUs();
+
+    ImageContext ctx;
+    copyImageContext(&ctx, s->Base);
+    ctx.ImageName = NULL;
+    ctx.IoCache = cache;
+
+    bool ok = parseManifestLine(line, &ctx);
+
+    // No image=: the image goes into the next descriptor the client passed, a file or a device
+    //   (the build seeks and resizes, a pipe or socket cannot take it)
+    int out = -1;
+    char outPath[32];
+    if (ok && !ctx.ImageName && c->FdCount > 0) {
+        out = c->Fds[0];
+        memmove(c->Fds, c->Fds + 1, --c->FdCount * sizeof *c->Fds);
+        snprintf(outPath, sizeof outPath, "/proc/self/fd/%d", out);
+        ctx.ImageName = outPath;
+
+        struct stat st;
+        if (fstat(out, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+            fprintf(stderr, "Error: passed descriptor must be a file or block device, not a pipe or socket\n");
+            ok = false;
+        }
+    }
+    if (ok && !ctx.ImageName) {
+        fprintf(stderr, "Error: request needs image= or a passed descriptor\n");
+        ok = false;
+    }
+
+    if (ok) ok = buildImage(&ctx);
+    if (out >= 0) close(out);
+    atomic_fetch_add(ok ? &s->Built : &s->Failed, 1);
+
+    // The /proc path only means something inside the service, the client knows its descriptor
+    const char *image = out >= 0 ? "fd" : ctx.ImageName ? ctx.ImageName : "-";
+    const size_t len = strlen(image) + 64;
+    char *text = malloc(len);
+    bool sent = false;
+    if (text) {
+        if (ok) snprintf(text, len, "OK %s %llu\n", image, (unsigned long long)(nowUs() - start));
+        else    snprintf(text, len, "ERROR %s\n", image);
+        sent = reply(c->Fd, text);
+    }
+
+    free(text);
+    freeImageContext(&ctx);
+    return sent;
+}
+
+// Requests of one connection in order, until the client closes it
+static void serveConnection(Server *s, IOCache *cache, int fd)
+{
+    Connection *c = calloc(1, sizeof *c);
+    if (!c) return;
+    c->Fd = fd;
+
+    bool open = true;
+    while (open) {
+        char *end;
+        while (open && (end = memchr(c->Buffer, '\n', c->Used))) {
+            *end = '\0';
+            const char *p = c->Buffer + strspn(c->Buffer, " \t\r");
+            if (*p != '\0' && *p != '#') open = serveRequest(s, cache, c, c->Buffer);
+
+            const size_t rest = c->Used - (end + 1 - c->Buffer);
+            memmove(c->Buffer, end + 1, rest);
+            c->Used = rest;
+        }
+        if (!open) break;
+
+        if (c->Used == SERVE_LINE_MAX) {
+            reply(fd, "ERROR request line too long\n");
+            break;
+        }
+
+        const ssize_t n = receive(c);
+        if (n > 0) continue;
+
+        // The last request may come without its newline, unless the server is stopping
+        if (n == 0 && c->Used > 0 && !atomic_load(&s->Stopping)) {
+            c->Buffer[c->Used] = '\0';
+            const char *p = c->Buffer + strspn(c->Buffer, " \t\r");
+            if (*p != '\0' && *p != '#') serveRequest(s, cache, c, c->Buffer);
+        }
+        open = false;
+    }
+
+    for (size_t i = 0; i < c->FdCount; i++)
+        close(c->Fds[i]);
+    free(c);
+}
+
+static void *serveWorker(void *arg)
+{
+    Worker *w = arg;
+    Server *s = w->Server;
+    IOCache *cache = newIOCache();      // NULL: every image sets up its own ring and buffers
+
+    while (!atomic_load(&s->Stopping)) {
+        const int client = accept4(s->Listen, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            // Out of descriptors or memory: back off instead of spinning
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 10000000 }, NULL);
+            continue;
+        }
+
+        // Registered under the lock, so a stop either sees this connection or is seen here
+        pthread_mutex_lock(&s->Lock);
+        s->Clients[w->Index] = client;
+        const bool stopping = atomic_load(&s->Stopping);
+        pthread_mutex_unlock(&s->Lock);
+
+        if (!stopping) serveConnection(s, cache, client);
+
+        pthread_mutex_lock(&s->Lock);
+        s->Clients[w->Index] = -1;
+        pthread_mutex_unlock(&s->Lock);
+        close(client);
+    }
+
+    freeIOCache(cache);
+    return NULL;
+}
+
+// Listening socket at path; a socket file nobody accepts on is left over and replaced
+static int listenOn(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    bool bound = bind(fd, (const struct sockaddr *)&addr, sizeof addr) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        struct stat st;
+        const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const bool live = probe >= 0 && connect(probe, (const struct sockaddr *)&addr, sizeof addr) == 0;
+        if (probe >= 0) close(probe);
+
+        if (live) {
+            fprintf(stderr, "Error: %s is already served by another process\n", path);
+            close(fd);
+            return -1;
+        }
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) == 0)
+            bound = bind(fd, (const struct sockaddr *)&addr, sizeof addr) == 0;
+        else
+            errno = EADDRINUSE;
+    }
+
+    if (!bound || listen(fd, SERVE_BACKLOG) != 0) {
+        fprintf(stderr, "Error: could not listen on socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool serveImages(const ImageContext *base, const char *socketPath, unsigned jobs)
+{
+    if (jobs == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    // The signals that stop the service are taken by sigwait below, workers never see them
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+    Server s = { .Base = base, .Listen = listenOn(socketPath) };
+    if (s.Listen < 0) return false;
+
+    atomic_init(&s.Stopping, false);
+    atomic_init(&s.Built, 0);
+    atomic_init(&s.Failed, 0);
+    pthread_mutex_init(&s.Lock, NULL);
+
+    s.Clients = malloc(jobs * sizeof *s.Clients);
+    Worker *workers = calloc(jobs, sizeof *workers);
+    pthread_t *threads = calloc(jobs, sizeof *threads);
+    unsigned started = 0;
+    if (s.Clients && workers && threads) {
+        for (; started < jobs; started++) {
+            s.Clients[started] = -1;
+            workers[started] = (Worker){ .Server = &s, .Index = started };
+            if (pthread_create(&threads[started], NULL, serveWorker, &workers[started]) != 0) break;
+        }
+    }
+
+    if (started == 0) {
+        fprintf(stderr, "Error: could not start service threads\n");
+    } else {
+        printf("Serving %s using %u threads\n", socketPath, started);
+        fflush(stdout);
+
+        int sig;
+        sigwait(&stop, &sig);
+
+        // No new connections; open ones finish the request in progress, then see end of input
+        atomic_store(&s.Stopping, true);
+        shutdown(s.Listen, SHUT_RDWR);
+        pthread_mutex_lock(&s.Lock);
+        for (unsigned i = 0; i < started; i++)
+            if (s.Clients[i] >= 0) shutdown(s.Clients[i], SHUT_RD);
+        pthread_mutex_unlock(&s.Lock);
+
+        for (unsigned i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+
+        const size_t built = atomic_load(&s.Built), failed = atomic_load(&s.Failed);
+        printf("Served %zu of %zu images\n", built, built + failed);
+    }
+
+    close(s.Listen);
+    unlink(socketPath);
+    pthread_mutex_destroy(&s.Lock);
+    free(threads);
+    free(workers);
+    free(s.Clients);
+
+    return started > 0;
+}
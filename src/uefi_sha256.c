@@ -0,0 +1,222 @@
+#include <uefi_sha256.h>
+
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*SHA256BlocksFn)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static const uint32_t K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static uint32_t loadBE32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t rotr(uint32_t x, unsigned n)
+{
+    return x >> n | x << (32 - n);
+}
+
+// Portable path -------------------------
+
+static void sha256Portable(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) w[i] = loadBE32(data + 4 * i);
+        for (int i = 16; i < 64; i++) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+// x86-64: SHA extensions ----------------
+//   Four rounds per iteration, two per sha256rnds2; state kept as ABEF / CDGH
+
+#if defined(__x86_64__)
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256ShaNi(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);   // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                      // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                           // CDGH
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE) {
+        const __m128i abef = state0, cdgh = state1;
+        __m128i m[4];
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+
+            __m128i msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+            // Message schedule: words 4(i+1).. from the four previous groups
+            if (i >= 3 && i < 15) {
+                const __m128i next = _mm_add_epi32(m[(i + 1) & 3], _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4));
+                m[(i + 1) & 3] = _mm_sha256msg2_epu32(next, m[i & 3]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (i >= 1 && i < 13) m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);               // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);            // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);               // HGFE
+
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+// Runtime dispatch ----------------------
+
+static SHA256BlocksFn sha256Select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+        return sha256ShaNi;
+#endif
+    return sha256Portable;
+}
+
+static void sha256Resolve(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+// Starts at the resolver, which swaps itself out on first use; racing threads pick the same engine
+static _Atomic(SHA256BlocksFn) sha256Impl = sha256Resolve;
+
+static void sha256Resolve(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const SHA256BlocksFn fn = sha256Select();
+    atomic_store(&sha256Impl, fn);
+    fn(state, data, blocks);
+}
+
+static void sha256Blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    atomic_load_explicit(&sha256Impl, memory_order_relaxed)(state, data, blocks);
+}
+
+// Streaming API -------------------------
+
+void sha256Init(Sha256 *ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+    };
+
+    memcpy(ctx->State, initial, sizeof ctx->State);
+    ctx->Length = 0;
+    ctx->Used = 0;
+}
+
+void sha256Update(Sha256 *ctx, const void *buf, size_t len)
+{
+    const uint8_t *data = buf;
+    ctx->Length += len;
+
+    // Top up a partial block first, then whole blocks straight from the caller's buffer
+    if (ctx->Used > 0) {
+        const size_t take = len < SHA256_BLOCK_SIZE - ctx->Used ? len : SHA256_BLOCK_SIZE - ctx->Used;
+        memcpy(ctx->Block + ctx->Used, data, take);
+        ctx->Used += take;
+        data += take;
+        len -= take;
+
+        if (ctx->Used < SHA256_BLOCK_SIZE) return;
+        sha256Blocks(ctx->State, ctx->Block, 1);
+        ctx->Used = 0;
+    }
+
+    if (len >= SHA256_BLOCK_SIZE) {
+        const size_t blocks = len / SHA256_BLOCK_SIZE;
+        sha256Blocks(ctx->State, data, blocks);
+        data += blocks * SHA256_BLOCK_SIZE;
+        len -= blocks * SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->Block, data, len);
+    ctx->Used = len;
+}
+
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    // 0x80, zeros, then the message length in bits, big-endian, ending a block
+    const uint64_t bits = ctx->Length * 8;
+    uint8_t pad[SHA256_BLOCK_SIZE * 2] = { 0x80 };
+    const size_t padLen = (ctx->Used < 56 ? 56 : 120) - ctx->Used;
+
+    for (int i = 0; i < 8; i++) pad[padLen + i] = bits >> (56 - 8 * i);
+    sha256Update(ctx, pad, padLen + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->State[i] >> 24;
+        digest[4 * i + 1] = ctx->State[i] >> 16;
+        digest[4 * i + 2] = ctx->State[i] >> 8;
+        digest[4 * i + 3] = ctx->State[i];
+    }
+}
+
+void sha256Hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    hex[2 * SHA256_DIGEST_SIZE] = '\0';
+}
+
+const char *sha256Engine(void)
+{
+    uint32_t state[8] = { 0 };
+    uint8_t block[SHA256_BLOCK_SIZE] = { 0 };
+    sha256Blocks(state, block, 1);   // Make sure the engine has been selected
+
+    const SHA256BlocksFn fn = atomic_load(&sha256Impl);
+#if defined(__x86_64__)
+    if (fn == sha256ShaNi) return "sha-ni";
+#endif
+    return fn == sha256Portable ? "portable" : "unknown";
+}
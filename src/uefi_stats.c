@@ -0,0 +1,201 @@
+#include <uefi_stats.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+enum {
+    STATS_MAX_PHASES = 32,      // Phases recorded per image
+    STATS_MAX_DEPTH = 8,        // Phases open at once
+};
+
+typedef struct {
+
+    const char *Name;
+    unsigned    Depth;
+    uint64_t    StartNs;
+    uint64_t    Ns;
+    IOCounters  Start;          // ioCounters at statsBegin, the difference at statsEnd
+    IOCounters  Delta;
+    long        PeakRssKiB;
+
+} PhaseRecord;
+
+// Phases of one image, owned by its context from the first statsBegin to statsReport
+struct BuildPhases {
+
+    PhaseRecord Records[STATS_MAX_PHASES];
+    size_t      Count;
+    size_t      Open[STATS_MAX_DEPTH];
+    unsigned    Depth;
+
+};
+
+_Thread_local IOCounters ioCounters;
+
+// One trace file for the whole process, events of every thread go through the lock
+static FILE *traceFile;
+static bool traceFirst = true;
+static uint64_t traceStartNs;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void statsBegin(ImageContext *ctx, const char *name)
+{
+    if (ctx->Stats == STATS_OFF && !traceFile) return;
+    if (!ctx->Phases && !(ctx->Phases = calloc(1, sizeof *ctx->Phases))) return;
+
+    // Past the limits the phase is not recorded, statsEnd still pairs up through the depth
+    struct BuildPhases *p = ctx->Phases;
+    if (p->Depth < STATS_MAX_DEPTH) {
+        p->Open[p->Depth] = p->Count;
+        if (p->Count < STATS_MAX_PHASES)
+            p->Records[p->Count++] = (PhaseRecord){ .Name = name, .Depth = p->Depth, .StartNs = nowNs(),
+                                                    .Start = ioCounters };
+    }
+    p->Depth++;
+}
+
+void statsEnd(ImageContext *ctx)
+{
+    struct BuildPhases *p = ctx->Phases;
+    if (!p || p->Depth == 0) return;
+
+    p->Depth--;
+    if (p->Depth >= STATS_MAX_DEPTH || p->Open[p->Depth] >= p->Count) return;
+
+    PhaseRecord *phase = &p->Records[p->Open[p->Depth]];
+    phase->Ns = nowNs() - phase->StartNs;
+    phase->Delta = (IOCounters){
+        .Bytes = ioCounters.Bytes - phase->Start.Bytes,
+        .Writes = ioCounters.Writes - phase->Start.Writes,
+        .Seeks = ioCounters.Seeks - phase->Start.Seeks,
+    };
+
+    // Linux reports the peak of the whole process, threads share it
+    struct rusage usage;
+    phase->PeakRssKiB = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+static void printTable(FILE *out, const char *image, const struct BuildPhases *p)
+{
+    fprintf(out, "%s: build phases\n", image);
+    fprintf(out, "  %-24s %12s %16s %10s %8s %12s\n", "phase", "ms", "bytes", "writes", "seeks", "peak RSS KiB");
+
+    for (size_t i = 0; i < p->Count; i++) {
+        const PhaseRecord *phase = &p->Records[i];
+        fprintf(out, "  %*s%-*s %12.3f %16llu %10llu %8llu %12ld\n", (int)(2 * phase->Depth), "",
+                (int)(24 - 2 * phase->Depth), phase->Name, phase->Ns / 1e6,
+                (unsigned long long)phase->Delta.Bytes, (unsigned long long)phase->Delta.Writes,
+                (unsigned long long)phase->Delta.Seeks, phase->PeakRssKiB);
+    }
+}
+
+// JSON string literal: quotes, backslashes and control characters of a path escaped
+static void writeJsonString(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\')  fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)           fprintf(out, "\\u%04x", *c);
+        else                          fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void printJson(FILE *out, const char *image, const struct BuildPhases *p)
+{
+    fprintf(out, "{\"image\": ");
+    writeJsonString(out, image);
+    fprintf(out, ", \"phases\": [");
+
+    for (size_t i = 0; i < p->Count; i++) {
+        const PhaseRecord *phase = &p->Records[i];
+        fprintf(out, "%s{\"name\": \"%s\", \"depth\": %u, \"seconds\": %.6f, \"bytes\": %llu, "
+                     "\"writes\": %llu, \"seeks\": %llu, \"peak_rss_kib\": %ld}",
+                i ? ", " : "", phase->Name, phase->Depth, phase->Ns / 1e9,
+                (unsigned long long)phase->Delta.Bytes, (unsigned long long)phase->Delta.Writes,
+                (unsigned long long)phase->Delta.Seeks, phase->PeakRssKiB);
+    }
+
+    fprintf(out, "]}\n");
+}
+
+// Complete events ("ph": "X") of this thread, timestamps and durations in microseconds
+static void writeTraceEvents(const char *image, const struct BuildPhases *p)
+{
+    const int pid = getpid(), tid = gettid();
+
+    pthread_mutex_lock(&traceLock);
+    for (size_t i = 0; i < p->Count; i++) {
+        const PhaseRecord *phase = &p->Records[i];
+        fprintf(traceFile, "%s{\"name\": \"%s\", \"cat\": \"build\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                           "\"pid\": %d, \"tid\": %d, \"args\": {\"image\": ",
+                traceFirst ? "\n" : ",\n", phase->Name, (phase->StartNs - traceStartNs) / 1e3, phase->Ns / 1e3,
+                pid, tid);
+        writeJsonString(traceFile, image);
+        fprintf(traceFile, ", \"bytes\": %llu, \"writes\": %llu, \"seeks\": %llu, \"peak_rss_kib\": %ld}}",
+                (unsigned long long)phase->Delta.Bytes, (unsigned long long)phase->Delta.Writes,
+                (unsigned long long)phase->Delta.Seeks, phase->PeakRssKiB);
+        traceFirst = false;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void statsReport(ImageContext *ctx)
+{
+    struct BuildPhases *p = ctx->Phases;
+    if (!p) return;
+    ctx->Phases = NULL;
+
+    // One write to stderr, so reports of parallel batch builds do not interleave
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = p->Count && ctx->Stats != STATS_OFF ? open_memstream(&text, &size) : NULL;
+    if (out) {
+        if (ctx->Stats == STATS_JSON) printJson(out, ctx->ImageName, p);
+        else                          printTable(out, ctx->ImageName, p);
+        fclose(out);
+        fputs(text, stderr);
+        free(text);
+    }
+
+    if (traceFile) writeTraceEvents(ctx->ImageName, p);
+
+    free(p);
+}
+
+bool openTrace(const char *path)
+{
+    traceFile = fopen(path, "w");
+    if (!traceFile) {
+        fprintf(stderr, "Error: could not create trace file %s\n", path);
+        return false;
+    }
+
+    traceStartNs = nowNs();
+    fputs("[", traceFile);
+    return true;
+}
+
+bool closeTrace(void)
+{
+    if (!traceFile) return true;
+
+    fputs("\n]\n", traceFile);
+    const bool ok = !ferror(traceFile) && fclose(traceFile) == 0;
+    traceFile = NULL;
+
+    if (!ok) fprintf(stderr, "Error: could not write trace file\n");
+    return ok;
+}
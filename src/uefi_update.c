@@ -0,0 +1,1025 @@
+#include <uefi_update.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <uefi_mbr.h>
+#include <uefi_gpt.h>
+#include <uefi_copy.h>
+#include <uefi_fat32.h>
+#include <uefi_fatname.h>
+
+enum {
+    FAT_ENTRY_MASK = 0x0FFFFFFF,    // Upper 4 bits of a FAT32 entry are reserved
+    FAT_EOC        = 0x0FFFFFFF,
+    FAT_EOC_MIN    = 0x0FFFFFF8,
+    DIR_ENTRY_FREE = 0xE5,          // DIR_Name[0] of a deleted entry
+};
+
+// Directory entry found on disk and where it lives
+typedef struct {
+
+    FAT32_DirEntryShort Entry;
+    uint64_t            Slot;       // Index of the short entry in the directory
+    uint8_t             LongCount;  // LFN entries in the slots right before it
+
+} DirSlot;
+
+// Run of deleted slots that a new entry may take
+typedef struct {
+
+    uint64_t    Slot;
+    uint64_t    Count;
+
+} DirRun;
+
+// Directory read once while the update runs
+typedef struct DirCache {
+
+    uint32_t            First;          // First cluster, BPB_RootClus for the root
+    uint32_t           *Clusters;       // The chain, so a slot maps to its cluster without walking the FAT
+    uint32_t            ClusterCount;
+    uint64_t            EndSlot;        // Slot of the end marker, every slot after it is free
+    FAT32_NameIndex    *Names;          // Short and long names, value - index in Entries
+    DirSlot            *Entries;
+    size_t              EntryCount;
+    size_t              EntryCapacity;
+    DirRun             *Free;
+    size_t              FreeCount;
+    struct DirCache    *Next;
+
+} DirCache;
+
+// Run of free clusters
+typedef struct {
+
+    uint32_t    First;
+    uint32_t    Count;
+
+} FreeExtent;
+
+// ESP of an existing image, FAT #0 kept in memory while the update runs
+typedef struct {
+
+    int         Fd;
+    Vbr         Vbr;
+    uint64_t    VolumeOffset;   // Byte offsets in the image: ESP start, FAT #0, cluster 2
+    uint64_t    FatOffset;
+    uint64_t    DataOffset;
+    uint32_t    ClusterSize;
+    uint32_t    LastCluster;    // Highest cluster number usable for data
+    uint32_t   *Fat;
+    uint8_t    *DirtySectors;   // One bit per FAT sector changed, written to every FAT on flush
+    FreeExtent *Free;           // Free clusters as sorted, merged runs
+    size_t      FreeCount;
+    size_t      FreeCapacity;
+    uint64_t    FreeClusters;   // Sum of Free, for FSInfo
+    bool        FreeKnown;      // Free was built from the whole FAT
+    bool        DryRun;         // checkOps: allocations only change Free, the FAT stays as it is
+    DirCache   *Dirs;           // Directories read so far
+
+} FAT32_Volume;
+
+
+// Volume --------------------------------
+
+static bool openVolume(const char *path, FAT32_Volume *vol)
+{
+    memset(vol, 0, sizeof *vol);
+    vol->Fd = open(path, O_RDWR);
+    if (vol->Fd < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        return false;
+    }
+
+    // Protective MBR, then both GPT headers and the entry array with their CRCs
+    Mbr mbr;
+    if (pread(vol->Fd, &mbr, sizeof mbr, 0) != sizeof mbr || mbr.Signature != 0xAA55 ||
+        mbr.PartitionRecord[0].OSType != 0xEE) {
+        fprintf(stderr, "Error: %s has no protective MBR\n", path);
+        return false;
+    }
+
+    const uint64_t lbaBytes = detectImageLBASize(vol->Fd);
+    GptHeader primary, backup;
+    if (!lbaBytes || !readGptHeader(vol->Fd, 1, lbaBytes, &primary) ||
+        !readGptHeader(vol->Fd, primary.AlternateLBA, lbaBytes, &backup) ||
+        backup.PartitionEntryArrayCRC32 != primary.PartitionEntryArrayCRC32) {
+        fprintf(stderr, "Error: %s has no valid primary and backup GPT\n", path);
+        return false;
+    }
+
+    size_t arraySize = 0;
+    uint8_t *array = readGptEntries(vol->Fd, &primary, lbaBytes, &arraySize);
+    if (!array) {
+        fprintf(stderr, "Error: %s has a corrupt GPT partition entry array\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < primary.NumberOfPartitionEntries; i++) {
+        const GptPartitionEntry *entry = (const GptPartitionEntry *)(array + (size_t)i * primary.SizeOfPartition);
+        if (memcmp(&entry->PartitionTypeGUID, &EFI_GUID, sizeof EFI_GUID) == 0) {
+            vol->VolumeOffset = entry->StartingLBA * lbaBytes;
+            break;
+        }
+    }
+    free(array);
+
+    // ESP Volume Boot Record
+    Vbr *vbr = &vol->Vbr;
+    if (!vol->VolumeOffset || pread(vol->Fd, vbr, sizeof *vbr, vol->VolumeOffset) != sizeof *vbr ||
+        vbr->BootSecT_Sig != 0xAA55 || memcmp(vbr->BS_FilSysType, "FAT32   ", 8) != 0 ||
+        vbr->BPB_BytsPerSec < 512 || vbr->BPB_SecPerClus == 0 || vbr->BPB_NumFATs == 0 ||
+        vbr->BPB_FATSz32 == 0) {
+        fprintf(stderr, "Error: %s has no FAT32 EFI System Partition\n", path);
+        return false;
+    }
+
+    const uint64_t fatBytes = (uint64_t)vbr->BPB_FATSz32 * vbr->BPB_BytsPerSec;
+    const uint64_t dataSectors = vbr->BPB_TotSec32 - vbr->BPB_RsvdSecCnt - vbr->BPB_NumFATs * vbr->BPB_FATSz32;
+    const uint64_t lastCluster = dataSectors / vbr->BPB_SecPerClus + 1;
+
+    vol->ClusterSize = vbr->BPB_SecPerClus * vbr->BPB_BytsPerSec;
+    vol->FatOffset = vol->VolumeOffset + (uint64_t)vbr->BPB_RsvdSecCnt * vbr->BPB_BytsPerSec;
+    vol->DataOffset = vol->FatOffset + vbr->BPB_NumFATs * fatBytes;
+    vol->LastCluster = lastCluster < fatBytes / 4 - 1 ? lastCluster : fatBytes / 4 - 1;
+
+    vol->Fat = malloc(fatBytes);
+    vol->DirtySectors = calloc((vbr->BPB_FATSz32 + 7) / 8, 1);
+    if (!vol->Fat || !vol->DirtySectors ||
+        pread(vol->Fd, vol->Fat, fatBytes, vol->FatOffset) != (ssize_t)fatBytes) {
+        fprintf(stderr, "Error: could not read FAT of %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void setFat(FAT32_Volume *vol, uint32_t cluster, uint32_t value)
+{
+    if (vol->DryRun) return;
+
+    vol->Fat[cluster] = (vol->Fat[cluster] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+
+    const uint32_t sector = cluster * sizeof(uint32_t) / vol->Vbr.BPB_BytsPerSec;
+    vol->DirtySectors[sector / 8] |= 1 << (sector % 8);
+}
+
+static uint32_t nextCluster(const FAT32_Volume *vol, uint32_t cluster)
+{
+    return vol->Fat[cluster] & FAT_ENTRY_MASK;
+}
+
+static bool isDataCluster(const FAT32_Volume *vol, uint32_t cluster)
+{
+    return cluster >= 2 && cluster <= vol->LastCluster;
+}
+
+static uint64_t clusterOffset(const FAT32_Volume *vol, uint32_t cluster)
+{
+    return vol->DataOffset + (uint64_t)(cluster - 2) * vol->ClusterSize;
+}
+
+// Write the changed FAT sectors to every FAT copy, then both FSInfo copies
+static bool flushVolume(FAT32_Volume *vol)
+{
+    const Vbr *vbr = &vol->Vbr;
+    const uint64_t fatBytes = (uint64_t)vbr->BPB_FATSz32 * vbr->BPB_BytsPerSec;
+
+    for (uint32_t s = 0; s < vbr->BPB_FATSz32; s++) {
+        if (!(vol->DirtySectors[s / 8] & (1 << (s % 8)))) continue;
+
+        // Coalesce a run of dirty sectors into one write per FAT
+        uint32_t e = s;
+        while (e + 1 < vbr->BPB_FATSz32 && (vol->DirtySectors[(e + 1) / 8] & (1 << ((e + 1) % 8)))) e++;
+
+        const uint64_t at = (uint64_t)s * vbr->BPB_BytsPerSec;
+        const size_t len = (size_t)(e - s + 1) * vbr->BPB_BytsPerSec;
+        for (uint8_t i = 0; i < vbr->BPB_NumFATs; i++)
+            if (pwrite(vol->Fd, (uint8_t *)vol->Fat + at, len, vol->FatOffset + i * fatBytes + at) != (ssize_t)len)
+                return false;
+
+        s = e;
+    }
+
+    // The extents know the exact free space: FSInfo gets the real count and the first free
+    //   cluster as hint, also when the image had them unknown (0xFFFFFFFF) before
+    FSInfo fsinfo;
+    const uint64_t fsinfoOffset = vol->VolumeOffset + (uint64_t)vbr->BPB_FSInfo * vbr->BPB_BytsPerSec;
+    if (!vol->FreeKnown || pread(vol->Fd, &fsinfo, sizeof fsinfo, fsinfoOffset) != sizeof fsinfo ||
+        fsinfo.FSI_LeadSigOffset != 0x41615252 || fsinfo.FSI_StrucSig != 0x61417272)
+        return true;   // No FSInfo to keep up to date
+
+    const uint32_t nextFree = vol->FreeCount ? vol->Free[0].First : 0xFFFFFFFF;
+    if (fsinfo.FSI_Free_Count == vol->FreeClusters && fsinfo.FSI_Nxt_Free == nextFree) return true;
+    fsinfo.FSI_Free_Count = vol->FreeClusters;
+    fsinfo.FSI_Nxt_Free = nextFree;
+
+    if (pwrite(vol->Fd, &fsinfo, sizeof fsinfo, fsinfoOffset) != sizeof fsinfo) return false;
+    if (vbr->BPB_BkBootSec == 0) return true;
+
+    return pwrite(vol->Fd, &fsinfo, sizeof fsinfo,
+                  fsinfoOffset + (uint64_t)vbr->BPB_BkBootSec * vbr->BPB_BytsPerSec) == sizeof fsinfo;
+}
+
+static void freeDirectory(DirCache *dir)
+{
+    freeNameIndex(dir->Names);
+    free(dir->Clusters);
+    free(dir->Entries);
+    free(dir->Free);
+    free(dir);
+}
+
+static void closeVolume(FAT32_Volume *vol)
+{
+    if (vol->Fd >= 0) close(vol->Fd);
+    free(vol->Fat);
+    free(vol->DirtySectors);
+    free(vol->Free);
+
+    while (vol->Dirs) {
+        DirCache *next = vol->Dirs->Next;
+        freeDirectory(vol->Dirs);
+        vol->Dirs = next;
+    }
+}
+
+// Free extents --------------------------
+// Free space is kept as sorted runs, built from the FAT once. Allocation takes the largest run,
+//   freeing merges a run with its neighbours; the FAT itself is only written for chains
+
+static bool insertExtent(FAT32_Volume *vol, size_t at, uint32_t first, uint32_t count)
+{
+    if (vol->FreeCount == vol->FreeCapacity) {
+        const size_t capacity = vol->FreeCapacity ? vol->FreeCapacity * 2 : 64;
+        FreeExtent *grown = realloc(vol->Free, capacity * sizeof *grown);
+        if (!grown) return false;
+        vol->Free = grown;
+        vol->FreeCapacity = capacity;
+    }
+
+    memmove(&vol->Free[at + 1], &vol->Free[at], (vol->FreeCount - at) * sizeof *vol->Free);
+    vol->Free[at] = (FreeExtent){ first, count };
+    vol->FreeCount++;
+    return true;
+}
+
+static void removeExtent(FAT32_Volume *vol, size_t at)
+{
+    memmove(&vol->Free[at], &vol->Free[at + 1], (vol->FreeCount - at - 1) * sizeof *vol->Free);
+    vol->FreeCount--;
+}
+
+static bool buildFreeExtents(FAT32_Volume *vol)
+{
+    for (uint32_t c = 2; c <= vol->LastCluster; c++) {
+        if (nextCluster(vol, c) != 0) continue;
+
+        const uint32_t first = c;
+        while (c + 1 <= vol->LastCluster && nextCluster(vol, c + 1) == 0) c++;
+        if (!insertExtent(vol, vol->FreeCount, first, c - first + 1)) {
+            fprintf(stderr, "Error: out of memory for the ESP free space map\n");
+            return false;
+        }
+        vol->FreeClusters += c - first + 1;
+    }
+
+    vol->FreeKnown = true;
+    return true;
+}
+
+// First extent that starts after cluster
+static size_t extentAfter(const FAT32_Volume *vol, uint32_t cluster)
+{
+    size_t lo = 0, hi = vol->FreeCount;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (vol->Free[mid].First <= cluster) lo = mid + 1;
+        else                                 hi = mid;
+    }
+
+    return lo;
+}
+
+// Chain count clusters from the front of extent at, ending with EOC
+static uint32_t takeExtent(FAT32_Volume *vol, size_t at, uint32_t count)
+{
+    FreeExtent *extent = &vol->Free[at];
+    const uint32_t first = extent->First;
+
+    for (uint32_t i = 0; i < count; i++)
+        setFat(vol, first + i, i + 1 < count ? first + i + 1 : FAT_EOC);
+
+    extent->First += count;
+    extent->Count -= count;
+    if (extent->Count == 0) removeExtent(vol, at);
+    vol->FreeClusters -= count;
+
+    return first;
+}
+
+// Give a run of clusters back, merged with the free runs right before and after it
+static bool releaseRun(FAT32_Volume *vol, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) setFat(vol, first + i, 0);
+    vol->FreeClusters += count;
+
+    const size_t at = extentAfter(vol, first);
+    const bool joinPrev = at > 0 && vol->Free[at - 1].First + vol->Free[at - 1].Count == first;
+    const bool joinNext = at < vol->FreeCount && first + count == vol->Free[at].First;
+
+    if (joinPrev && joinNext) {
+        vol->Free[at - 1].Count += count + vol->Free[at].Count;
+        removeExtent(vol, at);
+    } else if (joinPrev) {
+        vol->Free[at - 1].Count += count;
+    } else if (joinNext) {
+        vol->Free[at].First = first;
+        vol->Free[at].Count += count;
+    } else {
+        return insertExtent(vol, at, first, count);
+    }
+
+    return true;
+}
+
+static size_t largestExtent(const FAT32_Volume *vol)
+{
+    size_t best = 0;
+    for (size_t i = 1; i < vol->FreeCount; i++)
+        if (vol->Free[i].Count > vol->Free[best].Count) best = i;
+
+    return best;
+}
+
+// Cluster chains ------------------------
+
+// Number of clusters in a chain and whether they are consecutive
+static uint32_t chainLength(const FAT32_Volume *vol, uint32_t first, bool *contiguous)
+{
+    uint32_t count = 0;
+    *contiguous = true;
+    for (uint32_t c = first; isDataCluster(vol, c) && count <= vol->LastCluster; c = nextCluster(vol, c)) {
+        if (count > 0 && c != first + count) *contiguous = false;
+        count++;
+    }
+
+    return count;
+}
+
+// Release a chain run by run of consecutive clusters
+static bool freeChain(FAT32_Volume *vol, uint32_t first)
+{
+    uint32_t c = first;
+    for (uint32_t count = 0; isDataCluster(vol, c) && count <= vol->LastCluster;) {
+        const uint32_t runStart = c;
+        uint32_t next = nextCluster(vol, c);
+        while (next == c + 1 && ++count <= vol->LastCluster) next = nextCluster(vol, c = next);
+        count++;
+
+        if (!releaseRun(vol, runStart, c - runStart + 1)) return false;
+        c = next;
+    }
+
+    return true;
+}
+
+// The whole chain from the largest free run. If no run is large enough, a contiguous request fails
+//   and any other takes the largest runs in turn, so the file gets as few fragments as possible
+static bool allocateChain(FAT32_Volume *vol, uint32_t count, bool contiguous, uint32_t *first)
+{
+    *first = 0;
+    if (count == 0) return true;
+
+    if (vol->FreeClusters < count) {
+        fprintf(stderr, "Error: ESP is full, need %u free clusters, have %llu\n", count,
+                (unsigned long long)vol->FreeClusters);
+        return false;
+    }
+
+    size_t best = largestExtent(vol);
+    if (vol->Free[best].Count >= count) {
+        *first = takeExtent(vol, best, count);
+        return true;
+    }
+
+    if (contiguous) {
+        fprintf(stderr, "Error: ESP has no free run of %u clusters, largest is %u\n", count, vol->Free[best].Count);
+        return false;
+    }
+
+    uint32_t last = 0;
+    while (count > 0) {
+        best = largestExtent(vol);
+        const uint32_t take = vol->Free[best].Count < count ? vol->Free[best].Count : count;
+        const uint32_t piece = takeExtent(vol, best, take);
+
+        if (last) setFat(vol, last, piece);
+        else      *first = piece;
+        last = piece + take - 1;
+        count -= take;
+    }
+
+    return true;
+}
+
+// Append count clusters to the chain ending at last: right after it when those are free, so a
+//   growing directory stays contiguous, otherwise wherever allocateChain puts them
+static bool extendChain(FAT32_Volume *vol, uint32_t last, uint32_t count, uint32_t *first)
+{
+    const size_t at = extentAfter(vol, last);
+    if (at < vol->FreeCount && vol->Free[at].First == last + 1 && vol->Free[at].Count >= count)
+        *first = takeExtent(vol, at, count);
+    else if (!allocateChain(vol, count, false, first))
+        return false;
+
+    setFat(vol, last, *first);
+    return true;
+}
+
+// Copy a host file into a chain, one copy per run of consecutive clusters
+static bool writeChainData(FAT32_Volume *vol, uint32_t first, int in, uint64_t size)
+{
+    uint64_t done = 0;
+    uint32_t c = first;
+
+    while (done < size && isDataCluster(vol, c)) {
+        const uint32_t runStart = c;
+        uint64_t runBytes = vol->ClusterSize;
+        uint32_t next = nextCluster(vol, c);
+        while (next == c + 1 && done + runBytes < size) {
+            c = next;
+            next = nextCluster(vol, c);
+            runBytes += vol->ClusterSize;
+        }
+
+        const uint64_t len = size - done < runBytes ? size - done : runBytes;
+        if (!copyRangeToImage(in, vol->Fd, done, clusterOffset(vol, runStart), len)) return false;
+
+        done += len;
+        c = next;
+    }
+
+    return done == size;
+}
+
+// Directories ---------------------------
+
+static uint32_t entryCluster(const FAT32_DirEntryShort *entry)
+{
+    return (uint32_t)entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+}
+
+static FAT32_DirEntryShort makeEntry(const uint8_t name[11], uint8_t attr, uint32_t cluster,
+                                     uint32_t size, time_t mtime)
+{
+    uint16_t writeTime = 0, writeDate = 0;
+    getFATTimeDateOf(mtime, false, &writeTime, &writeDate);
+
+    FAT32_DirEntryShort entry = {
+        .DIR_Attr = attr,
+        .DIR_CrtTime = writeTime,
+        .DIR_CrtDate = writeDate,
+        .DIR_LstAccDate = writeDate,
+        .DIR_FstClusHI = cluster >> 16,
+        .DIR_WrtTime = writeTime,
+        .DIR_WrtDate = writeDate,
+        .DIR_FstClusLO = cluster & 0xFFFF,
+        .DIR_FileSize = size,
+    };
+    memcpy(entry.DIR_Name, name, sizeof entry.DIR_Name);
+
+    return entry;
+}
+
+// Directory cache -----------------------
+// Each directory is read once per update; lookups and collision checks then go through its name index
+
+static uint64_t slotOffset(const FAT32_Volume *vol, const DirCache *dir, uint64_t slot)
+{
+    const uint32_t perCluster = vol->ClusterSize / sizeof(FAT32_DirEntryShort);
+
+    return clusterOffset(vol, dir->Clusters[slot / perCluster]) + slot % perCluster * sizeof(FAT32_DirEntryShort);
+}
+
+static uint64_t slotCount(const FAT32_Volume *vol, const DirCache *dir)
+{
+    return (uint64_t)dir->ClusterCount * (vol->ClusterSize / sizeof(FAT32_DirEntryShort));
+}
+
+static bool appendCluster(DirCache *dir, uint32_t cluster)
+{
+    if ((dir->ClusterCount & (dir->ClusterCount - 1)) == 0) {
+        uint32_t *grown = realloc(dir->Clusters, (dir->ClusterCount ? 2 * dir->ClusterCount : 1) * sizeof *grown);
+        if (!grown) return false;
+        dir->Clusters = grown;
+    }
+
+    dir->Clusters[dir->ClusterCount++] = cluster;
+    return true;
+}
+
+static bool appendFreeRun(DirCache *dir, uint64_t slot, uint64_t count)
+{
+    if ((dir->FreeCount & (dir->FreeCount - 1)) == 0) {
+        DirRun *grown = realloc(dir->Free, (dir->FreeCount ? 2 * dir->FreeCount : 1) * sizeof *grown);
+        if (!grown) return false;
+        dir->Free = grown;
+    }
+
+    dir->Free[dir->FreeCount++] = (DirRun){ slot, count };
+    return true;
+}
+
+static bool appendRecord(DirCache *dir, const FAT32_Name *name, const FAT32_DirEntryShort *entry,
+                         uint64_t slot, uint8_t longCount)
+{
+    if (dir->EntryCount == dir->EntryCapacity) {
+        const size_t capacity = dir->EntryCapacity ? dir->EntryCapacity * 2 : 64;
+        DirSlot *grown = realloc(dir->Entries, capacity * sizeof *grown);
+        if (!grown) return false;
+        dir->Entries = grown;
+        dir->EntryCapacity = capacity;
+    }
+
+    dir->Entries[dir->EntryCount] = (DirSlot){ *entry, slot, longCount };
+    return addIndexName(dir->Names, name, dir->EntryCount++);
+}
+
+// Parse every entry up to the end marker: names with their LFN runs, and runs of deleted slots
+static bool readDirectory(FAT32_Volume *vol, DirCache *dir)
+{
+    const uint32_t perCluster = vol->ClusterSize / sizeof(FAT32_DirEntryShort);
+    uint8_t *buf = malloc(vol->ClusterSize);
+    if (!buf) return false;
+
+    FAT32_LfnReader reader = { .LongLen = 0 };
+    uint64_t freeStart = 0, freeCount = 0;
+    bool ok = true, end = false;
+    dir->EndSlot = slotCount(vol, dir);
+
+    for (uint32_t k = 0; ok && !end && k < dir->ClusterCount; k++) {
+        ok = pread(vol->Fd, buf, vol->ClusterSize, clusterOffset(vol, dir->Clusters[k])) == (ssize_t)vol->ClusterSize;
+
+        for (uint32_t i = 0; ok && i < perCluster; i++) {
+            const FAT32_DirEntryShort *entry = (const FAT32_DirEntryShort *)buf + i;
+            const uint64_t slot = (uint64_t)k * perCluster + i;
+
+            if (entry->DIR_Name[0] == 0) {
+                dir->EndSlot = slot;
+                end = true;
+                break;
+            }
+
+            if (entry->DIR_Name[0] == DIR_ENTRY_FREE) {
+                if (freeCount++ == 0) freeStart = slot;
+                reader.LongLen = reader.Expect = 0;
+                continue;
+            }
+            if (freeCount) ok = appendFreeRun(dir, freeStart, freeCount);
+            freeCount = 0;
+
+            if ((entry->DIR_Attr & 0x3F) == ATTR_LONG_NAME) {
+                readLongEntry(&reader, (const FAT32_DirEntryLong *)entry);
+                continue;
+            }
+
+            FAT32_Name name;
+            const bool hasLong = readShortEntry(&reader, entry, &name);
+            if (entry->DIR_Name[0] == '.' || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+
+            ok = appendRecord(dir, &name, entry, slot, hasLong ? lfnEntryCount(&name) : 0);
+        }
+    }
+    if (ok && freeCount) ok = appendFreeRun(dir, freeStart, freeCount);
+
+    free(buf);
+    return ok;
+}
+
+// Cached directory starting at cluster first, read on first use
+static DirCache *openDirectory(FAT32_Volume *vol, uint32_t first)
+{
+    for (DirCache *dir = vol->Dirs; dir; dir = dir->Next)
+        if (dir->First == first) return dir;
+
+    DirCache *dir = calloc(1, sizeof *dir);
+    if (!dir) return NULL;
+    dir->First = first;
+    dir->Names = newNameIndex();
+
+    bool ok = dir->Names != NULL;
+    uint32_t count = 0;
+    for (uint32_t c = first; ok && isDataCluster(vol, c) && count++ <= vol->LastCluster; c = nextCluster(vol, c))
+        ok = appendCluster(dir, c);
+
+    if (!ok || dir->ClusterCount == 0 || !readDirectory(vol, dir)) {
+        fprintf(stderr, "Error: could not read directory at cluster %u\n", first);
+        freeDirectory(dir);
+        return NULL;
+    }
+
+    dir->Next = vol->Dirs;
+    vol->Dirs = dir;
+    return dir;
+}
+
+static void dropDirectory(FAT32_Volume *vol, uint32_t first)
+{
+    for (DirCache **link = &vol->Dirs; *link; link = &(*link)->Next) {
+        if ((*link)->First != first) continue;
+
+        DirCache *dir = *link;
+        *link = dir->Next;
+        freeDirectory(dir);
+        return;
+    }
+}
+
+// Zeroed cluster, optionally starting with the '.' and '..' entries of a new directory
+static bool writeDirCluster(FAT32_Volume *vol, uint32_t cluster, const FAT32_DirEntryShort *dots)
+{
+    uint8_t *buf = calloc(1, vol->ClusterSize);
+    if (!buf) return false;
+    if (dots) memcpy(buf, dots, 2 * sizeof *dots);
+
+    const bool ok = pwrite(vol->Fd, buf, vol->ClusterSize, clusterOffset(vol, cluster)) == (ssize_t)vol->ClusterSize;
+    free(buf);
+    return ok;
+}
+
+static bool writeSlots(FAT32_Volume *vol, const DirCache *dir, uint64_t slot, const void *entries, uint64_t count)
+{
+    const uint32_t perCluster = vol->ClusterSize / sizeof(FAT32_DirEntryShort);
+    const uint8_t *data = entries;
+
+    // One write per cluster the run touches
+    while (count > 0) {
+        const uint64_t piece = perCluster - slot % perCluster < count ? perCluster - slot % perCluster : count;
+        const size_t len = piece * sizeof(FAT32_DirEntryShort);
+        if (pwrite(vol->Fd, data, len, slotOffset(vol, dir, slot)) != (ssize_t)len) return false;
+
+        data += len;
+        slot += piece;
+        count -= piece;
+    }
+
+    return true;
+}
+
+// Run of count free slots: a deleted run that is long enough, otherwise after the last entry,
+//   growing the directory by zeroed clusters when it is full
+static bool reserveSlots(FAT32_Volume *vol, DirCache *dir, uint64_t count, uint64_t *slot)
+{
+    for (size_t i = 0; i < dir->FreeCount; i++) {
+        DirRun *run = &dir->Free[i];
+        if (run->Count < count) continue;
+
+        *slot = run->Slot;
+        run->Slot += count;
+        run->Count -= count;
+        if (run->Count == 0) *run = dir->Free[--dir->FreeCount];
+        return true;
+    }
+
+    const uint64_t perCluster = vol->ClusterSize / sizeof(FAT32_DirEntryShort);
+    const uint64_t end = dir->EndSlot + count;
+    if (end > FAT_DIR_MAX_ENTRIES) {
+        fprintf(stderr, "Error: directory would have more than %u entries\n", FAT_DIR_MAX_ENTRIES);
+        return false;
+    }
+
+    if (end > slotCount(vol, dir)) {
+        const uint32_t grow = (end - slotCount(vol, dir) + perCluster - 1) / perCluster;
+        uint32_t first = 0;
+        if (!extendChain(vol, dir->Clusters[dir->ClusterCount - 1], grow, &first)) return false;
+
+        for (uint32_t c = first, k = 0; k < grow; k++, c = nextCluster(vol, c))
+            if (!writeDirCluster(vol, c, NULL) || !appendCluster(dir, c)) return false;
+    }
+
+    // Slots after the old end marker may hold anything, a new marker ends the directory again
+    static const FAT32_DirEntryShort endMarker;
+    if (end < slotCount(vol, dir) && !writeSlots(vol, dir, end, &endMarker, 1)) return false;
+
+    *slot = dir->EndSlot;
+    dir->EndSlot = end;
+    return true;
+}
+
+static DirSlot *findEntry(DirCache *dir, const FAT32_Name *name)
+{
+    uint64_t value = 0;
+
+    return findIndexName(dir->Names, name, &value) ? &dir->Entries[value] : NULL;
+}
+
+// New entry named name: a unique ~N short name if it needs one, LFN entries, then the short entry
+static bool addEntry(FAT32_Volume *vol, DirCache *dir, FAT32_Name *name, FAT32_DirEntryShort entry)
+{
+    if (!makeShortAlias(dir->Names, name)) {
+        fprintf(stderr, "Error: no free short name left in the directory\n");
+        return false;
+    }
+    memcpy(entry.DIR_Name, name->Short, sizeof entry.DIR_Name);
+    entry.DIR_NTRes = name->NTRes;
+
+    FAT32_DirEntryShort entries[LFN_MAX_ENTRIES + 1];
+    const size_t longCount = makeLongEntries(name, (FAT32_DirEntryLong *)entries);
+    entries[longCount] = entry;
+
+    uint64_t slot = 0;
+    return reserveSlots(vol, dir, longCount + 1, &slot) && writeSlots(vol, dir, slot, entries, longCount + 1) &&
+           appendRecord(dir, name, &entry, slot + longCount, longCount);
+}
+
+// Mark the short entry and its LFN entries deleted
+static bool removeEntry(FAT32_Volume *vol, DirCache *dir, const FAT32_Name *name, const DirSlot *record)
+{
+    const uint64_t first = record->Slot - record->LongCount;
+    const uint8_t deleted = DIR_ENTRY_FREE;
+
+    for (uint64_t slot = first; slot <= record->Slot; slot++)
+        if (pwrite(vol->Fd, &deleted, 1, slotOffset(vol, dir, slot)) != 1) return false;
+
+    removeIndexName(dir->Names, name);
+    return appendFreeRun(dir, first, record->LongCount + 1);
+}
+
+static DirCache *makeDirectory(FAT32_Volume *vol, DirCache *parent, FAT32_Name *name)
+{
+    const time_t now = time(NULL);
+    uint32_t cluster = 0;
+    if (!allocateChain(vol, 1, false, &cluster)) return NULL;
+
+    // ".." of a directory in the root points at cluster 0
+    const uint32_t parentCluster = parent->First == vol->Vbr.BPB_RootClus ? 0 : parent->First;
+    const FAT32_DirEntryShort dots[2] = {
+        makeEntry((const uint8_t *)".          ", ATTR_DIRECTORY, cluster, 0, now),
+        makeEntry((const uint8_t *)"..         ", ATTR_DIRECTORY, parentCluster, 0, now),
+    };
+
+    if (!writeDirCluster(vol, cluster, dots) ||
+        !addEntry(vol, parent, name, makeEntry(name->Short, ATTR_DIRECTORY, cluster, 0, now)))
+        return NULL;
+
+    return openDirectory(vol, cluster);
+}
+
+// Resolve every directory of path, returning the last one and the name of the leaf. With missing
+//   set, absent directories are only counted there and *dir ends up NULL
+static bool walkPath(FAT32_Volume *vol, const char *path, bool create, DirCache **dir, FAT32_Name *leaf,
+                     unsigned *missing)
+{
+    *dir = openDirectory(vol, vol->Vbr.BPB_RootClus);
+    if (!*dir) return false;
+
+    const char *p = path + strspn(path, "/");
+    while (*p) {
+        char component[4 * LFN_MAX_CHARS + 1];
+        const size_t len = strcspn(p, "/");
+        if (len >= sizeof component) return false;
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+        p += strspn(p, "/");
+
+        FAT32_Name name;
+        if (!makeFatName(component, &name)) {
+            fprintf(stderr, "Error: %s is not a valid FAT file name in %s\n", component, path);
+            return false;
+        }
+
+        if (*p == '\0') {
+            *leaf = name;
+            return true;
+        }
+
+        const DirSlot *record = *dir ? findEntry(*dir, &name) : NULL;
+        if (!record && missing) {
+            (*missing)++;
+            *dir = NULL;
+            continue;
+        }
+        if (record) {
+            if (!(record->Entry.DIR_Attr & ATTR_DIRECTORY)) {
+                fprintf(stderr, "Error: %s in %s is not a directory\n", component, path);
+                return false;
+            }
+            *dir = openDirectory(vol, entryCluster(&record->Entry));
+        } else {
+            *dir = create ? makeDirectory(vol, *dir, &name) : NULL;
+        }
+
+        if (!*dir) {
+            fprintf(stderr, "Error: could not find directory %s in %s\n", component, path);
+            return false;
+        }
+    }
+
+    fprintf(stderr, "Error: empty ESP path\n");
+    return false;
+}
+
+// Operations ----------------------------
+
+// Files the firmware loads from the removable media path, /EFI/BOOT/*.EFI
+static bool isBootCritical(const char *path)
+{
+    while (*path == '/') path++;
+    if (strncasecmp(path, "EFI/BOOT/", 9) != 0) return false;
+
+    const char *leaf = path + 9;
+    const size_t len = strlen(leaf);
+    return !strchr(leaf, '/') && len > 4 && strcasecmp(leaf + len - 4, ".EFI") == 0;
+}
+
+// Same number of clusters: overwrite the data in place, the FAT stays as it is. A boot loader
+//   has to stay in one piece, so a fragmented one moves into a single free run instead
+static bool reusesChain(const FAT32_Volume *vol, const DirSlot *record, uint32_t count, bool critical)
+{
+    bool contiguous = true;
+    return record && chainLength(vol, entryCluster(&record->Entry), &contiguous) == count && (contiguous || !critical);
+}
+
+static bool addFile(FAT32_Volume *vol, const char *path, const char *hostPath)
+{
+    const int in = open(hostPath, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: %s is not a regular file of at most 4 GiB\n", hostPath);
+        if (in >= 0) close(in);
+        return false;
+    }
+
+    DirCache *dir = NULL;
+    FAT32_Name leaf;
+    if (!walkPath(vol, path, true, &dir, &leaf, NULL)) {
+        close(in);
+        return false;
+    }
+
+    DirSlot *record = findEntry(dir, &leaf);
+    if (record && (record->Entry.DIR_Attr & ATTR_DIRECTORY)) {
+        fprintf(stderr, "Error: %s is a directory\n", path);
+        close(in);
+        return false;
+    }
+
+    const bool critical = isBootCritical(path);
+    const uint32_t count = ((uint64_t)st.st_size + vol->ClusterSize - 1) / vol->ClusterSize;
+    const uint32_t oldFirst = record ? entryCluster(&record->Entry) : 0;
+    const bool reuse = reusesChain(vol, record, count, critical);
+
+    uint32_t first = oldFirst;
+    bool ok = reuse || allocateChain(vol, count, critical, &first);
+    if (ok) ok = writeChainData(vol, first, in, st.st_size);
+    close(in);
+
+    if (ok) {
+        FAT32_DirEntryShort entry = makeEntry(leaf.Short, ATTR_ARCHIVE, first, st.st_size, st.st_mtime);
+        if (record) {
+            // A replaced file keeps its names, whatever case the path was given in
+            memcpy(entry.DIR_Name, record->Entry.DIR_Name, sizeof entry.DIR_Name);
+            entry.DIR_NTRes = record->Entry.DIR_NTRes;
+            entry.DIR_CrtTime = record->Entry.DIR_CrtTime;
+            entry.DIR_CrtDate = record->Entry.DIR_CrtDate;
+            ok = writeSlots(vol, dir, record->Slot, &entry, 1);
+            if (ok) record->Entry = entry;
+        } else {
+            ok = addEntry(vol, dir, &leaf, entry);
+        }
+    }
+
+    // Old chain is released only after the entry points at the new one
+    if (ok && record && !reuse) ok = freeChain(vol, oldFirst);
+
+    if (!ok) fprintf(stderr, "Error: could not write %s to ESP\n", path);
+    return ok;
+}
+
+static bool deleteFile(FAT32_Volume *vol, const char *path)
+{
+    DirCache *dir = NULL;
+    FAT32_Name leaf;
+    if (!walkPath(vol, path, false, &dir, &leaf, NULL)) return false;
+
+    const DirSlot *record = findEntry(dir, &leaf);
+    if (!record) {
+        fprintf(stderr, "Error: %s not found in ESP\n", path);
+        return false;
+    }
+
+    const uint32_t first = entryCluster(&record->Entry);
+    if (record->Entry.DIR_Attr & ATTR_DIRECTORY) {
+        const DirCache *sub = openDirectory(vol, first);
+        if (!sub) return false;
+        if (indexNameCount(sub->Names) > 0) {
+            fprintf(stderr, "Error: directory %s is not empty\n", path);
+            return false;
+        }
+        dropDirectory(vol, first);
+    }
+
+    if (!removeEntry(vol, dir, &leaf, record)) return false;
+
+    return freeChain(vol, first);
+}
+
+static bool samePath(const char *a, const char *b)
+{
+    return strcasecmp(a + strspn(a, "/"), b + strspn(b, "/")) == 0;
+}
+
+// Clusters every operation takes and frees, in order, against a copy of the free runs: an update
+//   that runs out of space, or of a free run long enough for a boot loader, fails before it writes
+//   anything instead of after the operations in front of it. A path named again is counted as a
+//   new file and a directory it creates as new for every file, which can only overestimate the
+//   space; directories growing by a cluster are not counted
+static bool checkOps(FAT32_Volume *vol, const UpdateOp *ops, size_t count)
+{
+    FAT32_Volume dry = *vol;
+    dry.DryRun = true;
+    dry.Free = malloc((vol->FreeCapacity ? vol->FreeCapacity : 1) * sizeof *dry.Free);
+    if (!dry.Free) return false;
+    memcpy(dry.Free, vol->Free, vol->FreeCount * sizeof *dry.Free);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        const char *path = ops[i].Path;
+        DirCache *dir = NULL;
+        FAT32_Name leaf;
+        unsigned missing = 0;
+        if (!walkPath(&dry, path, false, &dir, &leaf, &missing)) {
+            ok = false;
+            break;
+        }
+
+        // Only the first operation on a path finds what is on disk
+        bool named = false;
+        for (size_t j = 0; j < i && !named; j++) named = samePath(ops[j].Path, path);
+        const DirSlot *record = dir && !named ? findEntry(dir, &leaf) : NULL;
+
+        // A missing file or a full directory is left to deleteFile to report
+        if (ops[i].Action == UPDATE_DELETE) {
+            if (record) ok = freeChain(&dry, entryCluster(&record->Entry));
+            continue;
+        }
+
+        struct stat st;
+        if (stat(ops[i].HostPath, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+            fprintf(stderr, "Error: %s is not a regular file of at most 4 GiB\n", ops[i].HostPath);
+            ok = false;
+            break;
+        }
+        if (record && (record->Entry.DIR_Attr & ATTR_DIRECTORY)) {
+            fprintf(stderr, "Error: %s is a directory\n", path);
+            ok = false;
+            break;
+        }
+
+        // Each new directory takes one cluster, the file its chain, a replaced chain comes back after
+        const bool critical = isBootCritical(path);
+        const uint32_t clusters = ((uint64_t)st.st_size + dry.ClusterSize - 1) / dry.ClusterSize;
+        const bool reuse = reusesChain(&dry, record, clusters, critical);
+        uint32_t first = 0;
+        ok = (missing == 0 || allocateChain(&dry, missing, false, &first)) &&
+             (reuse || allocateChain(&dry, clusters, critical, &first)) &&
+             (!record || reuse || freeChain(&dry, entryCluster(&record->Entry)));
+        if (!ok) fprintf(stderr, "Error: %s does not fit in the ESP, the image was not changed\n", path);
+    }
+
+    // Directories read on the way are as they are on disk, the update goes on with them cached
+    vol->Dirs = dry.Dirs;
+    free(dry.Free);
+    return ok;
+}
+
+bool updateImage(const char *path, const UpdateOp *ops, size_t count)
+{
+    FAT32_Volume vol;
+    bool ok = openVolume(path, &vol) && buildFreeExtents(&vol) && checkOps(&vol, ops, count);
+    const bool checked = ok;
+
+    for (size_t i = 0; ok && i < count; i++) {
+        if (ops[i].Action == UPDATE_ADD) ok = addFile(&vol, ops[i].Path, ops[i].HostPath);
+        else                             ok = deleteFile(&vol, ops[i].Path);
+    }
+
+    // FAT changes of the operations that succeeded are flushed even if a later one failed,
+    //   so directory entries written so far never point at free clusters
+    if (checked && !flushVolume(&vol)) {
+        fprintf(stderr, "Error: could not write FAT of %s\n", path);
+        ok = false;
+    }
+
+    closeVolume(&vol);
+    return ok;
+}
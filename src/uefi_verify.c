@@ -0,0 +1,575 @@
+#include <uefi_verify.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <uefi_mbr.h>
+#include <uefi_gpt.h>
+#include <uefi_crc32.h>
+#include <uefi_fat32.h>
+#include <uefi_fatname.h>
+
+enum {
+    MAX_REPORTED   = 64,            // Further errors are only counted
+    MAX_WORKERS    = 64,
+    MIN_RANGE      = 1 << 16,       // Smallest slice of clusters or bytes worth a thread
+
+    FAT_ENTRY_MASK = 0x0FFFFFFF,
+    FAT_BAD        = 0x0FFFFFF7,
+    FAT_EOC_MIN    = 0x0FFFFFF8,
+};
+
+// Mapped image and the error count so far
+typedef struct {
+
+    const char     *Path;
+    const uint8_t  *Map;
+    uint64_t        Size;
+    uint64_t        LbaBytes;
+    unsigned        Errors;
+
+} VerifyImage;
+
+// FAT #0 of one ESP and the bitmaps built while checking it
+typedef struct {
+
+    const uint8_t  *Fat;
+    uint64_t        FatBytes;
+    uint8_t         NumFATs;
+    uint32_t        LastCluster;
+    _Atomic uint64_t *Linked;   // Cluster is the target of some FAT entry
+    uint64_t       *Reached;    // Cluster belongs to a chain reachable from the root directory
+
+    atomic_bool     MirrorMismatch;
+    atomic_uint_least64_t FreeClusters;
+    atomic_uint_least64_t BadLinks;
+    atomic_uint_least64_t CrossLinks;
+    atomic_uint_least64_t Leaks;
+
+} VerifyFat;
+
+static void report(VerifyImage *img, const char *fmt, ...)
+{
+    if (img->Errors++ >= MAX_REPORTED) return;
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "Error: %s: ", img->Path);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+// Parallel ranges ------------------------
+
+typedef void (*RangeFn)(void *ctx, uint64_t begin, uint64_t end);
+
+typedef struct {
+
+    RangeFn     Fn;
+    void       *Ctx;
+    uint64_t    Begin;
+    uint64_t    End;
+
+} VerifyRange;
+
+static void *rangeWorker(void *arg)
+{
+    VerifyRange *range = arg;
+    range->Fn(range->Ctx, range->Begin, range->End);
+
+    return NULL;
+}
+
+// Split [begin, end) into one slice per CPU; the calling thread takes the first slice
+static void parallelFor(uint64_t begin, uint64_t end, RangeFn fn, void *ctx)
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint64_t count = end - begin;
+    uint64_t workers = cpus > 0 ? (uint64_t)cpus : 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (workers > count / MIN_RANGE) workers = count / MIN_RANGE ? count / MIN_RANGE : 1;
+
+    VerifyRange ranges[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    bool started[MAX_WORKERS] = { false };
+
+    for (uint64_t i = 0; i < workers; i++) {
+        ranges[i] = (VerifyRange){ fn, ctx, begin + count * i / workers, begin + count * (i + 1) / workers };
+        if (i > 0) started[i] = pthread_create(&threads[i], NULL, rangeWorker, &ranges[i]) == 0;
+    }
+
+    // Slices whose thread could not be started run here
+    for (uint64_t i = 0; i < workers; i++)
+        if (!started[i]) rangeWorker(&ranges[i]);
+
+    for (uint64_t i = 1; i < workers; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+}
+
+// FAT ------------------------------------
+
+static uint32_t fatEntry(const VerifyFat *fat, uint32_t cluster)
+{
+    uint32_t value;
+    memcpy(&value, fat->Fat + (uint64_t)cluster * 4, sizeof value);
+
+    return value & FAT_ENTRY_MASK;
+}
+
+static bool testBit(const uint64_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / 64] >> (bit % 64) & 1;
+}
+
+// FAT #1.. compared with FAT #0, slice by slice
+static void compareMirrors(void *ctx, uint64_t begin, uint64_t end)
+{
+    VerifyFat *fat = ctx;
+
+    for (uint8_t i = 1; i < fat->NumFATs && !atomic_load_explicit(&fat->MirrorMismatch, memory_order_relaxed); i++)
+        if (memcmp(fat->Fat + begin, fat->Fat + i * fat->FatBytes + begin, end - begin) != 0)
+            atomic_store(&fat->MirrorMismatch, true);
+}
+
+// Every in-range link sets the target's bit; a bit that was already set is a cross-link
+static void markLinks(void *ctx, uint64_t begin, uint64_t end)
+{
+    VerifyFat *fat = ctx;
+    uint64_t freeClusters = 0, badLinks = 0, crossLinks = 0;
+
+    for (uint64_t c = begin; c < end; c++) {
+        const uint32_t next = fatEntry(fat, c);
+        if (next == 0) {
+            freeClusters++;
+        } else if (next >= FAT_BAD) {
+            continue;
+        } else if (next < 2 || next > fat->LastCluster) {
+            badLinks++;
+        } else {
+            const uint64_t bit = 1ull << (next % 64);
+            if (atomic_fetch_or_explicit(&fat->Linked[next / 64], bit, memory_order_relaxed) & bit) crossLinks++;
+        }
+    }
+
+    atomic_fetch_add(&fat->FreeClusters, freeClusters);
+    atomic_fetch_add(&fat->BadLinks, badLinks);
+    atomic_fetch_add(&fat->CrossLinks, crossLinks);
+}
+
+// Allocated clusters the directory tree never reached: lost chains or detached loops
+static void countLeaks(void *ctx, uint64_t begin, uint64_t end)
+{
+    VerifyFat *fat = ctx;
+    uint64_t leaks = 0;
+
+    for (uint64_t c = begin; c < end; c++) {
+        const uint32_t value = fatEntry(fat, c);
+        if (value != 0 && value != FAT_BAD && !testBit(fat->Reached, c)) leaks++;
+    }
+
+    atomic_fetch_add(&fat->Leaks, leaks);
+}
+
+// Directory tree -------------------------
+
+typedef struct {
+
+    uint32_t    Cluster;
+    uint32_t    Clusters;
+    char        Path[256];
+
+} VerifyDir;
+
+// Follow one chain, marking its clusters. Returns the number of clusters in it
+static uint32_t walkChain(VerifyImage *img, VerifyFat *fat, const char *path, uint32_t first)
+{
+    if (testBit((const uint64_t *)fat->Linked, first))
+        report(img, "%s starts at cluster %u, which another chain links to", path, first);
+
+    uint32_t count = 0;
+    for (uint32_t c = first;;) {
+        if (c < 2 || c > fat->LastCluster) {
+            report(img, "%s: chain leaves the data area at cluster %u", path, c);
+            return count;
+        }
+        if (testBit(fat->Reached, c)) {
+            report(img, "%s: cluster %u is reached twice (loop or cross-link)", path, c);
+            return count;
+        }
+        fat->Reached[c / 64] |= 1ull << (c % 64);
+        count++;
+
+        const uint32_t next = fatEntry(fat, c);
+        if (next >= FAT_EOC_MIN) return count;
+        if (next == 0 || next == FAT_BAD) {
+            report(img, "%s: chain runs into %s cluster %u", path, next ? "bad" : "free", c);
+            return count;
+        }
+        c = next;
+    }
+}
+
+static bool walkTree(VerifyImage *img, VerifyFat *fat, const Vbr *vbr, const uint8_t *data)
+{
+    const uint32_t clusterSize = vbr->BPB_SecPerClus * vbr->BPB_BytsPerSec;
+    size_t depth = 0, cap = 16;
+    VerifyDir *stack = malloc(cap * sizeof *stack);
+    if (!stack) return false;
+
+    stack[depth++] = (VerifyDir){ vbr->BPB_RootClus, walkChain(img, fat, "/", vbr->BPB_RootClus), "" };
+
+    while (depth > 0) {
+        const VerifyDir dir = stack[--depth];
+
+        uint32_t c = dir.Cluster;
+        bool end = false;
+        FAT32_LfnReader reader = { .LongLen = 0 };
+        for (uint32_t k = 0; k < dir.Clusters && !end; k++, c = fatEntry(fat, c)) {
+            const FAT32_DirEntryShort *entries = (const FAT32_DirEntryShort *)(data + (uint64_t)(c - 2) * clusterSize);
+
+            for (uint32_t i = 0; i < clusterSize / sizeof *entries; i++) {
+                const FAT32_DirEntryShort *entry = &entries[i];
+                if (entry->DIR_Name[0] == 0) {
+                    end = true;
+                    break;
+                }
+                if (entry->DIR_Name[0] == 0xE5) {
+                    reader.LongLen = reader.Expect = 0;
+                    continue;
+                }
+                if ((entry->DIR_Attr & 0x3F) == ATTR_LONG_NAME) {
+                    readLongEntry(&reader, (const FAT32_DirEntryLong *)entry);
+                    continue;
+                }
+
+                // A long name must end right before its short entry, with the checksum of that entry
+                const bool pending = reader.LongLen > 0;
+                FAT32_Name fatName;
+                const bool hasLong = readShortEntry(&reader, entry, &fatName);
+                if ((entry->DIR_Attr & ATTR_VOLUME_ID) || entry->DIR_Name[0] == '.') continue;
+
+                char name[4 * LFN_MAX_CHARS + 1];
+                formatFatName(&fatName, name, sizeof name);
+                if (pending && !hasLong)
+                    report(img, "%s/%s: long name entries do not match the short entry", dir.Path, name);
+
+                VerifyDir child = { .Cluster = (uint32_t)entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO };
+                if (snprintf(child.Path, sizeof child.Path, "%s/%s", dir.Path, name) >= (int)sizeof child.Path)
+                    strcpy(child.Path + sizeof child.Path - 4, "...");   // Deep paths only name the error
+
+                if (entry->DIR_Attr & ATTR_DIRECTORY) {
+                    child.Clusters = walkChain(img, fat, child.Path, child.Cluster);
+                    if (child.Clusters == 0) continue;
+
+                    if (depth == cap) {
+                        VerifyDir *grown = realloc(stack, 2 * cap * sizeof *stack);
+                        if (!grown) {
+                            free(stack);
+                            return false;
+                        }
+                        stack = grown;
+                        cap *= 2;
+                    }
+                    stack[depth++] = child;
+                } else if (entry->DIR_FileSize == 0) {
+                    if (child.Cluster != 0) report(img, "%s is empty but starts at cluster %u", child.Path, child.Cluster);
+                } else {
+                    const uint64_t expected = ((uint64_t)entry->DIR_FileSize + clusterSize - 1) / clusterSize;
+                    const uint32_t count = walkChain(img, fat, child.Path, child.Cluster);
+                    if (count != expected)
+                        report(img, "%s: %u bytes need %llu clusters, chain has %u", child.Path,
+                               entry->DIR_FileSize, (unsigned long long)expected, count);
+                }
+            }
+        }
+    }
+
+    free(stack);
+    return true;
+}
+
+// Volume ---------------------------------
+
+static void verifyVolume(VerifyImage *img, const GptPartitionEntry *part, unsigned index)
+{
+    const uint64_t offset = part->StartingLBA * img->LbaBytes;
+    const uint64_t partBytes = (part->EndingLBA - part->StartingLBA + 1) * img->LbaBytes;
+    const uint8_t *volume = img->Map + offset;
+
+    Vbr vbr;
+    memcpy(&vbr, volume, sizeof vbr);
+
+    const uint32_t bps = vbr.BPB_BytsPerSec;
+    if (vbr.BootSecT_Sig != 0xAA55 || memcmp(vbr.BS_FilSysType, "FAT32   ", 8) != 0) {
+        report(img, "ESP (entry %u) has no FAT32 boot sector", index);
+        return;
+    }
+    if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) ||
+        vbr.BPB_SecPerClus == 0 || (vbr.BPB_SecPerClus & (vbr.BPB_SecPerClus - 1)) != 0 ||
+        vbr.BPB_NumFATs == 0 || vbr.BPB_FATSz32 == 0 || vbr.BPB_RsvdSecCnt == 0 ||
+        vbr.BPB_FSInfo >= vbr.BPB_RsvdSecCnt || vbr.BPB_BkBootSec + vbr.BPB_FSInfo >= vbr.BPB_RsvdSecCnt ||
+        (uint64_t)vbr.BPB_TotSec32 * bps > partBytes ||
+        vbr.BPB_TotSec32 <= vbr.BPB_RsvdSecCnt + (uint64_t)vbr.BPB_NumFATs * vbr.BPB_FATSz32) {
+        report(img, "ESP (entry %u) has an inconsistent BPB", index);
+        return;
+    }
+    if (vbr.BPB_HiddSec != part->StartingLBA)
+        report(img, "ESP (entry %u): BPB_HiddSec %u, partition starts at LBA %llu", index,
+               vbr.BPB_HiddSec, (unsigned long long)part->StartingLBA);
+
+    // FSInfo and the backup boot sector / FSInfo pair
+    FSInfo fsinfo;
+    memcpy(&fsinfo, volume + (uint64_t)vbr.BPB_FSInfo * bps, sizeof fsinfo);
+    if (fsinfo.FSI_LeadSigOffset != 0x41615252 || fsinfo.FSI_StrucSig != 0x61417272 ||
+        fsinfo.FSI_TrailSig != 0xAA550000)
+        report(img, "ESP (entry %u): FSInfo signatures are wrong", index);
+
+    if (vbr.BPB_BkBootSec != 0) {
+        const uint8_t *backup = volume + (uint64_t)vbr.BPB_BkBootSec * bps;
+        if (memcmp(volume, backup, bps) != 0)
+            report(img, "ESP (entry %u): backup boot sector differs from the boot sector", index);
+        if (memcmp(volume + (uint64_t)vbr.BPB_FSInfo * bps, backup + (uint64_t)vbr.BPB_FSInfo * bps, bps) != 0)
+            report(img, "ESP (entry %u): backup FSInfo differs from FSInfo", index);
+    }
+
+    // FAT
+    const uint64_t fatBytes = (uint64_t)vbr.BPB_FATSz32 * bps;
+    const uint64_t dataSectors = vbr.BPB_TotSec32 - vbr.BPB_RsvdSecCnt - (uint64_t)vbr.BPB_NumFATs * vbr.BPB_FATSz32;
+    const uint64_t lastCluster = dataSectors / vbr.BPB_SecPerClus + 1;
+
+    VerifyFat fat = {
+        .Fat = volume + (uint64_t)vbr.BPB_RsvdSecCnt * bps,
+        .FatBytes = fatBytes,
+        .NumFATs = vbr.BPB_NumFATs,
+        .LastCluster = lastCluster < fatBytes / 4 - 1 ? lastCluster : fatBytes / 4 - 1,
+    };
+    const uint8_t *data = fat.Fat + vbr.BPB_NumFATs * fatBytes;
+
+    const size_t words = fat.LastCluster / 64 + 1;
+    fat.Linked = calloc(words, sizeof *fat.Linked);
+    fat.Reached = calloc(words, sizeof *fat.Reached);
+    if (!fat.Linked || !fat.Reached) {
+        report(img, "out of memory");
+        free((void *)fat.Linked);
+        free(fat.Reached);
+        return;
+    }
+    atomic_init(&fat.MirrorMismatch, false);
+    atomic_init(&fat.FreeClusters, 0);
+    atomic_init(&fat.BadLinks, 0);
+    atomic_init(&fat.CrossLinks, 0);
+    atomic_init(&fat.Leaks, 0);
+
+    parallelFor(0, fatBytes, compareMirrors, &fat);
+    if (atomic_load(&fat.MirrorMismatch))
+        report(img, "ESP (entry %u): FAT copies differ", index);
+
+    if (vbr.BPB_RootClus < 2 || vbr.BPB_RootClus > fat.LastCluster) {
+        report(img, "ESP (entry %u): root cluster %u is outside the data area", index, vbr.BPB_RootClus);
+    } else {
+        parallelFor(2, (uint64_t)fat.LastCluster + 1, markLinks, &fat);
+        if (!walkTree(img, &fat, &vbr, data)) report(img, "out of memory");
+        parallelFor(2, (uint64_t)fat.LastCluster + 1, countLeaks, &fat);
+
+        const uint64_t bad = atomic_load(&fat.BadLinks), cross = atomic_load(&fat.CrossLinks);
+        const uint64_t leaks = atomic_load(&fat.Leaks), freeClusters = atomic_load(&fat.FreeClusters);
+        if (bad) report(img, "ESP (entry %u): %llu FAT entries point outside the data area", index, (unsigned long long)bad);
+        if (cross) report(img, "ESP (entry %u): %llu clusters are linked from more than one entry", index, (unsigned long long)cross);
+        if (leaks) report(img, "ESP (entry %u): %llu allocated clusters are not reachable (lost chains or loops)", index, (unsigned long long)leaks);
+
+        if (fsinfo.FSI_Free_Count != 0xFFFFFFFF && fsinfo.FSI_Free_Count != freeClusters)
+            report(img, "ESP (entry %u): FSInfo free count %u, FAT has %llu free clusters", index,
+                   fsinfo.FSI_Free_Count, (unsigned long long)freeClusters);
+        if (fsinfo.FSI_Nxt_Free != 0xFFFFFFFF && (fsinfo.FSI_Nxt_Free < 2 || fsinfo.FSI_Nxt_Free > fat.LastCluster))
+            report(img, "ESP (entry %u): FSInfo next free cluster %u is outside the data area", index,
+                   fsinfo.FSI_Nxt_Free);
+
+        printf("%s: ESP (entry %u): %u clusters of %u bytes, %llu free\n", img->Path, index,
+               fat.LastCluster - 1, vbr.BPB_SecPerClus * bps, (unsigned long long)freeClusters);
+    }
+
+    free((void *)fat.Linked);
+    free(fat.Reached);
+}
+
+// GPT ------------------------------------
+
+static const uint8_t *checkHeader(VerifyImage *img, const char *which, uint64_t lba, uint64_t alternate,
+                                  GptHeader *header)
+{
+    memcpy(header, img->Map + lba * img->LbaBytes, sizeof *header);
+
+    if (memcmp(header->Signature, "EFI PART", 8) != 0 || header->HeaderSize < 92 ||
+        header->HeaderSize > img->LbaBytes) {
+        report(img, "%s GPT header at LBA %llu is missing", which, (unsigned long long)lba);
+        return NULL;
+    }
+
+    const uint32_t crc = header->HeaderCRC32;
+    header->HeaderCRC32 = 0;
+    if (calculateCRC32(header, header->HeaderSize) != crc)
+        report(img, "%s GPT header CRC mismatch", which);
+    header->HeaderCRC32 = crc;
+
+    if (header->MyLBA != lba || header->AlternateLBA != alternate)
+        report(img, "%s GPT header: MyLBA %llu AlternateLBA %llu, expected %llu and %llu", which,
+               (unsigned long long)header->MyLBA, (unsigned long long)header->AlternateLBA,
+               (unsigned long long)lba, (unsigned long long)alternate);
+
+    const uint64_t lbas = img->Size / img->LbaBytes;
+    const uint64_t arrayBytes = (uint64_t)header->NumberOfPartitionEntries * header->SizeOfPartition;
+    if (header->SizeOfPartition < sizeof(GptPartitionEntry) || header->SizeOfPartition > 4096 ||
+        (header->SizeOfPartition & (header->SizeOfPartition - 1)) != 0 || header->NumberOfPartitionEntries == 0 ||
+        header->PartitionEntryLBA >= lbas || arrayBytes > (lbas - header->PartitionEntryLBA) * img->LbaBytes) {
+        report(img, "%s GPT header describes an invalid partition entry array", which);
+        return NULL;
+    }
+
+    // Array must lie outside the usable area and the usable area inside the disk
+    const uint64_t arrayEnd = header->PartitionEntryLBA + (arrayBytes + img->LbaBytes - 1) / img->LbaBytes - 1;
+    if (header->FirstUsableLBA > header->LastUsableLBA || header->LastUsableLBA >= lbas - 1 ||
+        header->FirstUsableLBA < 2 ||
+        !(arrayEnd < header->FirstUsableLBA || header->PartitionEntryLBA > header->LastUsableLBA))
+        report(img, "%s GPT header: usable LBAs %llu..%llu overlap the header or entry array", which,
+               (unsigned long long)header->FirstUsableLBA, (unsigned long long)header->LastUsableLBA);
+
+    const uint8_t *array = img->Map + header->PartitionEntryLBA * img->LbaBytes;
+    if (calculateCRC32(array, arrayBytes) != header->PartitionEntryArrayCRC32)
+        report(img, "%s GPT partition entry array CRC mismatch", which);
+
+    return array;
+}
+
+static int compareStart(const void *a, const void *b)
+{
+    const GptPartitionEntry *x = *(const GptPartitionEntry *const *)a;
+    const GptPartitionEntry *y = *(const GptPartitionEntry *const *)b;
+
+    return (x->StartingLBA > y->StartingLBA) - (x->StartingLBA < y->StartingLBA);
+}
+
+static void verifyPartitions(VerifyImage *img, const GptHeader *header, const uint8_t *array)
+{
+    static const Guid unused = { 0 };
+    const GptPartitionEntry **used = calloc(header->NumberOfPartitionEntries, sizeof *used);
+    if (!used) {
+        report(img, "out of memory");
+        return;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < header->NumberOfPartitionEntries; i++) {
+        const GptPartitionEntry *entry = (const GptPartitionEntry *)(array + (size_t)i * header->SizeOfPartition);
+        if (memcmp(&entry->PartitionTypeGUID, &unused, sizeof unused) == 0) continue;
+
+        if (entry->StartingLBA > entry->EndingLBA || entry->StartingLBA < header->FirstUsableLBA ||
+            entry->EndingLBA > header->LastUsableLBA || entry->EndingLBA >= img->Size / img->LbaBytes) {
+            report(img, "partition %u (LBA %llu..%llu) is outside the usable area", i,
+                   (unsigned long long)entry->StartingLBA, (unsigned long long)entry->EndingLBA);
+            continue;
+        }
+        if (entry->StartingLBA * img->LbaBytes % ALIGNMENT != 0)
+            report(img, "partition %u starts at LBA %llu, not aligned to %u bytes", i,
+                   (unsigned long long)entry->StartingLBA, ALIGNMENT);
+
+        used[count++] = entry;
+    }
+
+    qsort(used, count, sizeof *used, compareStart);
+    for (uint32_t i = 1; i < count; i++)
+        if (used[i]->StartingLBA <= used[i - 1]->EndingLBA)
+            report(img, "partitions at LBA %llu and %llu overlap", (unsigned long long)used[i - 1]->StartingLBA,
+                   (unsigned long long)used[i]->StartingLBA);
+
+    for (uint32_t i = 0; i < count; i++)
+        if (memcmp(&used[i]->PartitionTypeGUID, &EFI_GUID, sizeof EFI_GUID) == 0)
+            verifyVolume(img, used[i], (unsigned)(((const uint8_t *)used[i] - array) / header->SizeOfPartition));
+
+    printf("%s: %u partitions, LBA size %llu\n", img->Path, count, (unsigned long long)img->LbaBytes);
+    free(used);
+}
+
+static void verifyLayout(VerifyImage *img)
+{
+    // Protective MBR: one 0xEE record over the whole disk, or as much of it as fits
+    Mbr mbr;
+    memcpy(&mbr, img->Map, sizeof mbr);
+
+    const uint64_t lbas = img->Size / img->LbaBytes;
+    const uint64_t mbrSize = lbas - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : lbas - 1;
+    if (mbr.Signature != 0xAA55 || mbr.PartitionRecord[0].OSType != 0xEE ||
+        mbr.PartitionRecord[0].StartingLBA != 1 || mbr.PartitionRecord[0].SizeInLBA != mbrSize)
+        report(img, "protective MBR is missing or does not cover the disk");
+
+    GptHeader primary, backup;
+    const uint8_t *primaryArray = checkHeader(img, "primary", 1, lbas - 1, &primary);
+    const uint8_t *backupArray = checkHeader(img, "backup", lbas - 1, 1, &backup);
+    if (!primaryArray) return;
+
+    if (backupArray) {
+        if (memcmp(&primary.DiskGuid, &backup.DiskGuid, sizeof(Guid)) != 0 ||
+            primary.FirstUsableLBA != backup.FirstUsableLBA || primary.LastUsableLBA != backup.LastUsableLBA ||
+            primary.NumberOfPartitionEntries != backup.NumberOfPartitionEntries ||
+            primary.SizeOfPartition != backup.SizeOfPartition ||
+            primary.PartitionEntryArrayCRC32 != backup.PartitionEntryArrayCRC32)
+            report(img, "primary and backup GPT headers disagree");
+        else if (memcmp(primaryArray, backupArray, (size_t)primary.NumberOfPartitionEntries * primary.SizeOfPartition) != 0)
+            report(img, "primary and backup partition entry arrays differ");
+
+        if (backup.PartitionEntryLBA <= backup.LastUsableLBA)
+            report(img, "backup partition entry array is not behind the last usable LBA");
+    }
+
+    verifyPartitions(img, &primary, primaryArray);
+}
+
+bool verifyImage(const char *path)
+{
+    VerifyImage img = { .Path = path };
+
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: could not open file %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    // A device written in place reports its size through the block layer
+    img.Size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &img.Size) != 0) img.Size = 0;
+    img.LbaBytes = detectImageLBASize(fd);
+    if (img.LbaBytes == 0 || img.Size % img.LbaBytes != 0 || img.Size / img.LbaBytes < 6) {
+        fprintf(stderr, "Error: %s is not a GPT image\n", path);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, img.Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map %s\n", path);
+        return false;
+    }
+    img.Map = map;
+
+    verifyLayout(&img);
+    munmap(map, img.Size);
+
+    if (img.Errors > MAX_REPORTED)
+        fprintf(stderr, "Error: %s: %u more errors not shown\n", path, img.Errors - MAX_REPORTED);
+    printf("%s: %s\n", path, img.Errors ? "FAILED" : "OK");
+
+    return img.Errors == 0;
+}
@@ -0,0 +1,428 @@
+#include <uefi_verity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <uefi_copy.h>
+#include <uefi_layout.h>
+#include <uefi_sha256.h>
+
+enum {
+    VERITY_MAX_LEVELS = 64,
+    VERITY_CHUNK_BYTES = 1024 * 1024,   // Data a worker reads and hashes per pick
+};
+
+struct VerityJob {
+
+    // Tree geometry, as veritysetup computes it
+    uint32_t    BlockSize;
+    uint64_t    DataBlocks;
+    unsigned    Levels;
+    uint64_t    LevelBlock[VERITY_MAX_LEVELS];  // First block of each level in the hash area, 0 - leaves
+    uint64_t    LevelBlocks[VERITY_MAX_LEVELS];
+    uint64_t    TreeBlocks;                     // Superblock included
+    uint8_t    *Tree;
+    uint8_t     Salt[VERITY_MAX_SALT];
+    size_t      SaltSize;
+    uint8_t     ZeroDigest[SHA256_DIGEST_SIZE];
+    uint8_t     Root[SHA256_DIGEST_SIZE];
+
+    // Partition contents: Source bytes first, the rest from the image or zeros
+    int         SourceFd;
+    uint64_t    SourceSize;
+    int         ImageFd;
+    uint64_t    PartitionOffset;
+
+    // Where the tree goes
+    const char *ImageName;
+    size_t      DataIndex;
+    uint64_t    HashOffset;                     // Byte offset of the hash partition, 0 - sidecar file
+
+    pthread_t  *Threads;
+    unsigned    ThreadCount;
+    atomic_uint_fast64_t NextBlock;
+    atomic_bool Failed;
+
+};
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Hex string into bytes, "-" is the empty salt; false if it is not hex or too long
+static bool parseSalt(const char *hex, uint8_t salt[VERITY_MAX_SALT], size_t *size)
+{
+    *size = 0;
+    if (strcmp(hex, "-") == 0) return true;
+
+    const size_t len = strlen(hex);
+    if (len == 0 || len % 2 != 0 || len / 2 > VERITY_MAX_SALT) return false;
+
+    for (size_t i = 0; i < len / 2; i++) {
+        const int hi = hexDigit(hex[2 * i]), lo = hexDigit(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        salt[i] = hi << 4 | lo;
+    }
+
+    *size = len / 2;
+    return true;
+}
+
+bool setVeritySalt(ImageContext *ctx, char *hex)
+{
+    uint8_t salt[VERITY_MAX_SALT];
+    size_t size = 0;
+    if (!parseSalt(hex, salt, &size)) {
+        fprintf(stderr, "Error: verity salt must be up to %d hex bytes or -, got %s\n", VERITY_MAX_SALT, hex);
+        return false;
+    }
+
+    ctx->VeritySalt = hex;
+    return true;
+}
+
+// Format 1 hash: the salt goes first
+static void hashBlock(const VerityJob *job, const uint8_t *block, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    Sha256 sha;
+    sha256Init(&sha);
+    sha256Update(&sha, job->Salt, job->SaltSize);
+    sha256Update(&sha, block, job->BlockSize);
+    sha256Final(&sha, digest);
+}
+
+static bool readFully(int fd, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+    while (len > 0) {
+        const ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+// Levels of the tree: blocks of each one and where it lies, the top level right after the superblock
+static void planTree(VerityJob *job)
+{
+    unsigned bits = 0;
+    while ((1u << (bits + 1)) <= job->BlockSize / SHA256_DIGEST_SIZE) bits++;
+
+    job->Levels = 0;
+    while (bits * job->Levels < 64 && (job->DataBlocks - 1) >> (bits * job->Levels)) job->Levels++;
+
+    uint64_t position = 1;
+    for (unsigned i = job->Levels; i-- > 0;) {
+        const unsigned shift = (i + 1) * bits;
+        job->LevelBlock[i] = position;
+        job->LevelBlocks[i] = shift < 64 ? ((job->DataBlocks - 1) >> shift) + 1 : 1;
+        position += job->LevelBlocks[i];
+    }
+    job->TreeBlocks = position;
+}
+
+// Leaf digests: one data block after another, chunks handed out to the workers
+static void *hashWorker(void *arg)
+{
+    VerityJob *job = arg;
+    const uint64_t blockSize = job->BlockSize, perChunk = VERITY_CHUNK_BYTES / blockSize;
+    uint8_t *leaves = job->Levels ? job->Tree + job->LevelBlock[0] * blockSize : job->Root;
+
+    uint8_t *buf = malloc(perChunk * blockSize);
+    if (!buf) {
+        atomic_store(&job->Failed, true);
+        return NULL;
+    }
+
+    for (;;) {
+        const uint64_t first = atomic_fetch_add(&job->NextBlock, perChunk);
+        if (first >= job->DataBlocks || atomic_load(&job->Failed)) break;
+
+        const uint64_t count = job->DataBlocks - first < perChunk ? job->DataBlocks - first : perChunk;
+        const uint64_t offset = first * blockSize, len = count * blockSize;
+
+        // Source part, then whatever the image holds past it (a device) or zeros
+        const uint64_t left = offset < job->SourceSize ? job->SourceSize - offset : 0;
+        const uint64_t fromSource = left < len ? left : len;
+        const uint64_t known = job->ImageFd >= 0 ? len : fromSource;
+        bool ok = fromSource == 0 || readFully(job->SourceFd, buf, fromSource, offset);
+        if (ok && known > fromSource)
+            ok = readFully(job->ImageFd, buf + fromSource, known - fromSource, job->PartitionOffset + offset + fromSource);
+        if (!ok) {
+            atomic_store(&job->Failed, true);
+            break;
+        }
+
+        const uint64_t hashed = (known + blockSize - 1) / blockSize;
+        memset(buf + known, 0, hashed * blockSize - known);
+        for (uint64_t i = 0; i < count; i++) {
+            uint8_t *digest = leaves + (first + i) * SHA256_DIGEST_SIZE;
+            if (i < hashed) hashBlock(job, buf + i * blockSize, digest);
+            else            memcpy(digest, job->ZeroDigest, SHA256_DIGEST_SIZE);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void freeJob(VerityJob *job)
+{
+    if (job->SourceFd >= 0) close(job->SourceFd);
+    if (job->ImageFd >= 0) close(job->ImageFd);
+    free(job->Threads);
+    free(job->Tree);
+    free(job);
+}
+
+// Where the tree lies and how big it is; false if the layout cannot take it (with a message)
+static bool planJob(const ImageContext *ctx, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES], VerityJob *job)
+{
+    const size_t data = ctx->VerityData - 1, hash = ctx->VerityHash;
+    const uint64_t lbaSize = ctx->LbaSize, blockSize = ctx->VerityBlock;
+    static const Guid unused = { 0 };
+
+    for (size_t i = 0; i < 2; i++) {
+        const size_t index = i == 0 ? data : hash - 1;
+        if ((i == 0 || hash) && memcmp(&table[index].PartitionTypeGUID, &unused, sizeof unused) == 0) {
+            fprintf(stderr, "Error: verity partition %zu is not in the layout\n", index + 1);
+            return false;
+        }
+    }
+    if (isImageStream(ctx->ImageName)) {
+        fprintf(stderr, "Error: verity needs an image file or device, not a stream\n");
+        return false;
+    }
+    if (blockSize < lbaSize) {
+        fprintf(stderr, "Error: verity block size %llu is smaller than the LBA size %llu, dm-verity would refuse it\n",
+                (unsigned long long)blockSize, (unsigned long long)lbaSize);
+        return false;
+    }
+
+    const bool esp = ctx->EspLBA && table[data].StartingLBA == ctx->EspLBA;
+    if (esp && ctx->Format != IMAGE_FORMAT_RAW) {
+        fprintf(stderr, "Error: verity over the ESP reads it back, it needs a raw image\n");
+        return false;
+    }
+
+    const uint64_t partBytes = (table[data].EndingLBA - table[data].StartingLBA + 1) * lbaSize;
+    job->BlockSize = blockSize;
+    job->DataBlocks = partBytes / blockSize;
+    job->PartitionOffset = table[data].StartingLBA * lbaSize;
+    job->ImageName = ctx->ImageName;
+    job->DataIndex = data;
+
+    if (job->DataBlocks == 0) {
+        fprintf(stderr, "Error: verity partition %zu is smaller than one %u byte block\n", data + 1, job->BlockSize);
+        return false;
+    }
+    planTree(job);
+
+    // The tree must fit in its partition, which nothing else writes to
+    if (hash) {
+        const uint64_t hashBytes = (table[hash - 1].EndingLBA - table[hash - 1].StartingLBA + 1) * lbaSize;
+        const bool taken = partitionSource(ctx, hash - 1) || (ctx->EspLBA && table[hash - 1].StartingLBA == ctx->EspLBA);
+        if (taken || hashBytes < job->TreeBlocks * blockSize) {
+            fprintf(stderr, "Error: verity hash partition %zu %s\n", hash,
+                    taken ? "already has contents" : "is too small for the hash tree");
+            if (!taken)
+                fprintf(stderr, "Error: the hash tree needs %llu bytes\n",
+                        (unsigned long long)(job->TreeBlocks * blockSize));
+            return false;
+        }
+        job->HashOffset = table[hash - 1].StartingLBA * lbaSize;
+    }
+
+    return true;
+}
+
+bool checkVerity(const ImageContext *ctx, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES])
+{
+    VerityJob job = { 0 };
+    return planJob(ctx, table, &job);
+}
+
+VerityJob *startVerity(ImageContext *ctx, ImageIO *io, const GptPartitionEntry table[NUMBER_OF_GPT_TABLE_ENTRIES])
+{
+    const size_t data = ctx->VerityData - 1;
+    const uint64_t blockSize = ctx->VerityBlock;
+    const uint64_t partBytes = (table[data].EndingLBA - table[data].StartingLBA + 1) * ctx->LbaSize;
+    const bool esp = ctx->EspLBA && table[data].StartingLBA == ctx->EspLBA;
+    const char *source = partitionSource(ctx, data);
+
+    ImageTarget target;
+    if (!probeImageTarget(ctx->ImageName, &target)) return NULL;
+
+    VerityJob *job = calloc(1, sizeof *job);
+    if (!job) return NULL;
+    job->SourceFd = job->ImageFd = -1;
+    atomic_init(&job->NextBlock, 0);
+    atomic_init(&job->Failed, false);
+
+    if (!planJob(ctx, table, job)) {
+        freeJob(job);
+        return NULL;
+    }
+
+    // UUID and salt after every other GUID of the image, so those stay as they were
+    const Guid uuid = new_guid(ctx);
+    if (ctx->VeritySalt) {
+        parseSalt(ctx->VeritySalt, job->Salt, &job->SaltSize);
+    } else {
+        const Guid salt[2] = { new_guid(ctx), new_guid(ctx) };
+        memcpy(job->Salt, salt, sizeof salt);
+        job->SaltSize = sizeof salt;
+    }
+
+    job->Tree = calloc(job->TreeBlocks, blockSize);
+    uint8_t *zeros = calloc(1, blockSize);
+    if (!job->Tree || !zeros) {
+        fprintf(stderr, "Error: could not allocate %llu bytes for the verity hash tree\n",
+                (unsigned long long)(job->TreeBlocks * blockSize));
+        free(zeros);
+        freeJob(job);
+        return NULL;
+    }
+    hashBlock(job, zeros, job->ZeroDigest);
+    free(zeros);
+
+    VeritySuperblock *sb = (VeritySuperblock *)job->Tree;
+    memcpy(sb->Signature, "verity\0\0", sizeof sb->Signature);
+    sb->Version = 1;
+    sb->HashType = 1;
+    memcpy(sb->Uuid, &uuid, sizeof sb->Uuid);
+    strcpy(sb->Algorithm, "sha256");
+    sb->DataBlockSize = sb->HashBlockSize = blockSize;
+    sb->DataBlocks = job->DataBlocks;
+    sb->SaltSize = job->SaltSize;
+    memcpy(sb->Salt, job->Salt, job->SaltSize);
+
+    // Payload bytes come from their file; the ESP and anything stale on a device from the image
+    bool ok = true;
+    if (source && !esp) {
+        ok = hostFileSize(source, &job->SourceSize) && (job->SourceFd = open(source, O_RDONLY)) >= 0;
+        if (job->SourceSize > partBytes) job->SourceSize = partBytes;
+    }
+    if (ok && (esp || target.IsBlockDevice)) {
+        ok = ioFlush(io) && (job->ImageFd = open(ctx->ImageName, O_RDONLY)) >= 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: could not open the contents of verity partition %zu\n", data + 1);
+        freeJob(job);
+        return NULL;
+    }
+
+    // Workers hash the leaves while the build goes on; one chunk each at least
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint64_t chunks = (job->DataBlocks * blockSize + VERITY_CHUNK_BYTES - 1) / VERITY_CHUNK_BYTES;
+    unsigned threads = cpus > 0 ? (unsigned)cpus : 1;
+    if (threads > chunks) threads = chunks;
+
+    job->Threads = calloc(threads, sizeof *job->Threads);
+    for (; job->Threads && job->ThreadCount < threads; job->ThreadCount++)
+        if (pthread_create(&job->Threads[job->ThreadCount], NULL, hashWorker, job) != 0) break;
+
+    return job;
+}
+
+// "<image>.ext", replacing the extension of the image name if it has one
+static char *sidecarPath(const char *image, const char *ext)
+{
+    const char *slash = strrchr(image, '/'), *dot = strrchr(image, '.');
+    const size_t base = dot && dot > (slash ? slash : image) ? (size_t)(dot - image) : strlen(image);
+
+    char *path = malloc(base + strlen(ext) + 1);
+    if (!path) return NULL;
+    memcpy(path, image, base);
+    strcpy(path + base, ext);
+
+    return path;
+}
+
+static bool writeFile(const char *path, const void *data, size_t len)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Error: could not create file %s\n", path);
+        return false;
+    }
+
+    const bool ok = fwrite(data, 1, len, file) == len;
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Error: could not write file %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool finishVerity(VerityJob *job, ImageIO *io, bool write)
+{
+    // A failed build stops the workers; with no worker thread at all the leaves are hashed here
+    if (!write) atomic_store(&job->Failed, true);
+    if (job->ThreadCount == 0 && write) hashWorker(job);
+    for (unsigned i = 0; i < job->ThreadCount; i++)
+        pthread_join(job->Threads[i], NULL);
+
+    bool ok = write;
+    if (ok && atomic_load(&job->Failed)) {
+        fprintf(stderr, "Error: could not read verity partition %zu\n", job->DataIndex + 1);
+        ok = false;
+    }
+
+    // Every upper level hashes the blocks of the one below, the root hashes the top block
+    const uint64_t blockSize = job->BlockSize;
+    for (unsigned i = 1; ok && i < job->Levels; i++) {
+        const uint8_t *below = job->Tree + job->LevelBlock[i - 1] * blockSize;
+        uint8_t *digests = job->Tree + job->LevelBlock[i] * blockSize;
+        for (uint64_t b = 0; b < job->LevelBlocks[i - 1]; b++)
+            hashBlock(job, below + b * blockSize, digests + b * SHA256_DIGEST_SIZE);
+    }
+    if (ok && job->Levels) hashBlock(job, job->Tree + job->LevelBlock[job->Levels - 1] * blockSize, job->Root);
+
+    // Hash partition in the image, else the sidecar file
+    const uint64_t treeBytes = job->TreeBlocks * blockSize;
+    char *treePath = NULL;
+    if (ok && job->HashOffset) {
+        for (uint64_t done = 0; ok && done < treeBytes; done += IO_BUFFER_SIZE) {
+            const uint64_t len = treeBytes - done < IO_BUFFER_SIZE ? treeBytes - done : IO_BUFFER_SIZE;
+            ok = ioWrite(io, job->Tree + done, len, job->HashOffset + done);
+        }
+        if (!ok) fprintf(stderr, "Error: could not write the verity hash tree to the image\n");
+    } else if (ok) {
+        treePath = sidecarPath(job->ImageName, ".verity");
+        ok = treePath && writeFile(treePath, job->Tree, treeBytes);
+    }
+
+    char hex[SHA256_HEX_SIZE];
+    sha256Hex(job->Root, hex);
+    char *rootPath = ok ? sidecarPath(job->ImageName, ".roothash") : NULL;
+    if (ok) {
+        char line[SHA256_HEX_SIZE + 1];
+        snprintf(line, sizeof line, "%s\n", hex);
+        ok = rootPath && writeFile(rootPath, line, strlen(line));
+    }
+
+    if (ok)
+        printf("%s: verity root hash %s (partition %zu, %llu blocks of %u bytes, tree in %s)\n", job->ImageName,
+               hex, job->DataIndex + 1, (unsigned long long)job->DataBlocks, job->BlockSize,
+               treePath ? treePath : "hash partition");
+
+    free(treePath);
+    free(rootPath);
+    freeJob(job);
+    return ok;
+}
@@ -1,64 +1,221 @@
-#include <time.h>
-
 #include <stdio.h>   // fopen, fprintf
 #include <stdlib.h>  // EXIT_SUCCESS, EXIT_FAILURE
+#include <string.h>  // strcmp
+
+#include <uefi_image.h>
+#include <uefi_batch.h>
+#include <uefi_serve.h>
+#include <uefi_clone.h>
+#include <uefi_update.h>
+#include <uefi_resize.h>
+#include <uefi_verify.h>
+#include <uefi_io.h>
+#include <uefi_stats.h>
 
-#include <uefi_mbr.h>
-#include <uefi_gpt.h>
-#include <uefi_lba.h>
-#include <uefi_fat32.h>
+// "dir/disk.img" -> "dir/disk-<n>.img"
+static void cloneName(char *buf, size_t size, const char *base, unsigned long n)
+{
+    const char *slash = strrchr(base, '/');
+    const char *dot = strrchr(base, '.');
+    if (!dot || (slash && dot < slash) || dot == (slash ? slash + 1 : base)) dot = base + strlen(base);
+
+    snprintf(buf, size, "%.*s-%lu%s", (int)(dot - base), base, n, dot);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --image FILE      output image file or block device (default: test.img),\n"
+            "                    '-' streams the raw image to stdout front to back\n"
+            "  --lba N           logical block size: 512, 1024, 2048 or 4096; the FAT32 ESP needs\n"
+            "                    65525 clusters, at least 33M, 65M, 129M or 257M respectively\n"
+            "  --esp-size SIZE   size of the ESP, e.g. 33M\n"
+            "  --data-size SIZE  size of the basic data partition, e.g. 1M\n"
+            "  --data-source FILE\n"
+            "                    copy filesystem image or block device FILE into the basic data\n"
+            "                    partition (reflink or copy_file_range), growing it to fit\n"
+            "  --part TYPE:SIZE[:NAME[:ATTRS]][=FILE]\n"
+            "                    add a partition instead of the ESP + basic data pair, repeatable;\n"
+            "                    TYPE is esp, data, linux, linux-root-x86-64, swap, home, ... or a GUID,\n"
+            "                    SIZE may be 'rest' to take the rest of --disk-size, or 'auto'\n"
+            "                    for the size of FILE, which is copied into the partition;\n"
+            "                    --esp-size, --data-size and --data-source are refused with it\n"
+            "  --disk-size SIZE  total size of the image (default: fit the partitions)\n"
+            "  --esp-dir DIR     copy files and directories from DIR into the ESP\n"
+            "                    (default: empty '/EFI/BOOT')\n"
+            "  --sparse          size the image with ftruncate and never write zero regions\n"
+            "  --format raw|qcow2\n"
+            "                    output file format (default: raw); qcow2 only allocates written clusters\n"
+            "  --seed N          reproducible build: GUIDs derived from N and the image spec,\n"
+            "                    timestamps from SOURCE_DATE_EPOCH (also enables it) or 1980-01-01 UTC;\n"
+            "                    --format, --sparse and '-' only change how the same disk bytes are stored\n"
+            "  --cache DIR       reproducible builds only: reuse the image from DIR when the spec\n"
+            "                    and ESP files hash the same (reflink or copy), else add it\n"
+            "  --verity N[:M]    build a dm-verity hash tree over partition N into partition M, or into\n"
+            "                    name.verity; the root hash goes to name.roothash (raw/qcow2 files, devices)\n"
+            "  --verity-block SIZE\n"
+            "                    verity data and hash block size, 512 to 4096 and at least --lba\n"
+            "                    (default: 4096; dm-verity takes no blocks larger than the page size)\n"
+            "  --verity-salt HEX salt of the hash tree, '-' for none (default: from the GUID generator)\n"
+            "  --io auto|sync|uring\n"
+            "                    image write backend (default: auto, io_uring if the kernel has it)\n"
+            "  --io-depth N      writes in flight and pool buffers for the io_uring backend (default: 16)\n",
+            prog);
+    // Image options above, modes below; two strings keep each under the C99 length limit
+    fputs(  "  --stats [table|json]\n"
+            "                    print wall time, bytes, write/seek calls and peak RSS of every\n"
+            "                    build phase (MBR, GPT, ESP VBR/FAT/data, payloads) to stderr\n"
+            "  --trace FILE      write the build phases as a Chrome trace_event file (all --batch jobs)\n"
+            "  --batch FILE      build every image listed in manifest FILE, one per line\n"
+            "                    as key=value options (image=a.img esp-size=64M ...)\n"
+            "  --jobs N          worker threads for --batch and --serve (default: number of CPUs)\n"
+            "  --serve SOCKET    build images on request: one manifest line per image on the Unix\n"
+            "                    socket SOCKET, answered with 'OK image microseconds' or 'ERROR image'\n"
+            "                    (SIGINT/SIGTERM stop the service); a line without image= writes into\n"
+            "                    the next file or block device descriptor passed with SCM_RIGHTS,\n"
+            "                    answered with 'OK fd ...' (a pipe descriptor is refused)\n"
+            "  --clone N         build the image once, then make N copies (name-1.img ...)\n"
+            "                    by reflink/copy with new disk/partition GUIDs and volume IDs\n"
+            "  --update FILE     change files in the ESP of existing image FILE in place\n"
+            "  --add PATH=HOST   with --update: add or replace ESP file PATH with file HOST\n"
+            "  --delete PATH     with --update: delete ESP file or empty directory PATH\n"
+            "  --resize FILE     grow existing image FILE to --disk-size (sparse, a block device to its\n"
+            "                    size) and move the backup GPT to the new end\n"
+            "  --grow-last       with --resize: extend the last partition over the new space\n"
+            "  --verify FILE     check GPT, partitions and ESP file system of FILE read-only\n",
+          stderr);
+}
 
 // =============================
 // MAIN
 // =============================
-int main(void)
+int main(int argc, char *argv[])
 {
+    ImageContext ctx;
+    initImageContext(&ctx);
+    const char *manifest = NULL;
+    const char *serve = NULL;
+    unsigned jobs = 0;
+    unsigned long clones = 0;
+    const char *update = NULL;
+    const char *verify = NULL;
+    const char *resize = NULL;
+    bool growLast = false;
+    const char *trace = NULL;
+    UpdateOp ops[256];
+    size_t opCount = 0;
 
-    FILE *image = fopen(image_name, "wb+");
-    if (!image) {
-        fprintf(stderr, "Error: could not open file %s\n", image_name);
-        return EXIT_FAILURE;
+    // reproducible-builds.org convention: the environment fixes the build time
+    char *epoch = getenv("SOURCE_DATE_EPOCH");
+    if (epoch && *epoch && !setImageOption(&ctx, "source-date-epoch", epoch)) return EXIT_FAILURE;
+
+    // Parse command line flags, "--key value" maps to the same options as a manifest line
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--batch") == 0 && value) {
+            manifest = value;
+            i++;
+        } else if (strcmp(arg, "--serve") == 0 && value) {
+            serve = value;
+            i++;
+        } else if (strcmp(arg, "--jobs") == 0 && value) {
+            // Digits only: strtoul would take "-1" as a huge count
+            char *end = NULL;
+            const unsigned long count = strtoul(value, &end, 10);
+            if (value[0] < '0' || value[0] > '9' || *end != '\0' || count == 0 || count > 1024) {
+                fprintf(stderr, "Error: jobs must be 1..1024, got %s\n", value);
+                return EXIT_FAILURE;
+            }
+            jobs = count;
+            i++;
+        } else if (strcmp(arg, "--clone") == 0 && value) {
+            clones = strtoul(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "--verify") == 0 && value) {
+            verify = value;
+            i++;
+        } else if (strcmp(arg, "--update") == 0 && value) {
+            update = value;
+            i++;
+        } else if (strcmp(arg, "--resize") == 0 && value) {
+            resize = value;
+            i++;
+        } else if (strcmp(arg, "--grow-last") == 0) {
+            growLast = true;
+        } else if ((strcmp(arg, "--add") == 0 || strcmp(arg, "--delete") == 0) && value) {
+            if (opCount == sizeof ops / sizeof ops[0]) {
+                fprintf(stderr, "Error: too many --add/--delete operations (max %zu)\n", sizeof ops / sizeof ops[0]);
+                return EXIT_FAILURE;
+            }
+            UpdateOp *op = &ops[opCount++];
+            op->Action = arg[2] == 'a' ? UPDATE_ADD : UPDATE_DELETE;
+            op->Path = value;
+            op->HostPath = NULL;
+            if (op->Action == UPDATE_ADD) {
+                char *eq = strchr(value, '=');
+                if (!eq) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                *eq = '\0';
+                op->HostPath = eq + 1;
+            }
+            i++;
+        } else if (strcmp(arg, "--trace") == 0 && value) {
+            trace = value;
+            i++;
+        } else if (strcmp(arg, "--sparse") == 0) {
+            ctx.Sparse = true;
+        } else if (strcmp(arg, "--stats") == 0 && !(value && strncmp(value, "--", 2) != 0)) {
+            ctx.Stats = STATS_TABLE;
+        } else if (strncmp(arg, "--", 2) == 0 && value && setImageOption(&ctx, arg + 2, value)) {
+            i++;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    // Set sizes & LBA values
-    gptTableLBAs = GPT_TABLE_SIZE / lbaSize;
-    // Add extra padding for:
-    //   2 aligned partitions
-    //   2 GPT tables
-    //   MBR
-    //   GPT headers
-    const uint64_t padding = (ALIGNMENT*2 + (lbaSize * ((gptTableLBAs*2) + 1 + 2))); 
-    imageSize = espSize + dataSize + padding; 
-    imageSizeLBAs = bytesToLBAs(imageSize);
-    alignLBA = ALIGNMENT / lbaSize;
-    espLBA = alignLBA;
-    espSizeLBAs = bytesToLBAs(espSize);
-    dataSizeLBAs = bytesToLBAs(dataSize);
-    dataLBA = nextAlignedLBA(espLBA + espSizeLBAs);
-
-    // Seed random number generation
-    srand(time(NULL));
-
-    // Write protective MBR
-    if (!writeMBR(image)) {
-        fprintf(stderr, "Error: could not write protective MBR for file %s\n", image_name);
-        return EXIT_FAILURE;
+    if (verify)
+        return verifyImage(verify) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (update)
+        return updateImage(update, ops, opCount) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (resize)
+        return resizeImage(resize, ctx.DiskSize, growLast) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (trace && !openTrace(trace)) return EXIT_FAILURE;
+
+    if (manifest) {
+        const bool ok = runBatch(&ctx, manifest, jobs);
+        return closeTrace() && ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    // Write GPT headers & tables
-    if (!writeGPTs(image)) {
-        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", image_name);
-        return EXIT_FAILURE;
+    if (serve) {
+        const bool ok = serveImages(&ctx, serve, jobs);
+        return closeTrace() && ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    // Write EFI System Partition w/FAT32 filesystem
-    if(!writeESP(image))
-    {
-        fprintf(stderr, "Error: could not write ESP for file %s\n", image_name);
+    // Clones patch identifiers at their raw disk offsets of a file that can be read back
+    if (clones && (ctx.Format != IMAGE_FORMAT_RAW || isImageStream(ctx.ImageName))) {
+        fprintf(stderr, "Error: --clone needs a raw image file\n");
+        closeTrace();
         return EXIT_FAILURE;
     }
 
-    fclose(image);
+    const bool built = buildImage(&ctx);
+    if (!closeTrace() || !built) return EXIT_FAILURE;
+
+    // Golden image is done, stamp out copies that differ only in their identifiers
+    for (unsigned long i = 1; i <= clones; i++) {
+        char name[4096];
+        cloneName(name, sizeof name, ctx.ImageName, i);
+        if (!cloneImage(&ctx, ctx.ImageName, name)) return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}